@@ -111,6 +111,23 @@ struct att_range {
 	uint16_t end;
 };
 
+/* One write of a batch, see enc_write_cmd_batch() */
+struct att_write {
+	uint16_t handle;
+	const uint8_t *value;
+	size_t vlen;
+};
+
+/*
+ * Cursor over the entries of a list response. The entries are views into
+ * the PDU, which has to outlive the cursor.
+ */
+struct att_list_iter {
+	const uint8_t *next;
+	const uint8_t *end;
+	uint16_t len;		/* entry length */
+};
+
 /* These functions do byte conversion */
 static inline uint8_t att_get_u8(const void *ptr)
 {
@@ -200,6 +217,19 @@ static inline bt_uuid_t att_get_uuid128(const void *ptr)
 	return uuid;
 }
 
+/* Next entry of a list response, NULL past the last one */
+static inline const uint8_t *att_list_iter_next(struct att_list_iter *iter)
+{
+	const uint8_t *entry = iter->next;
+
+	if (entry >= iter->end)
+		return NULL;
+
+	iter->next += iter->len;
+
+	return entry;
+}
+
 struct att_data_list *att_data_list_alloc(uint16_t num, uint16_t len);
 void att_data_list_free(struct att_data_list *list);
 
@@ -218,6 +248,8 @@ uint16_t dec_find_by_type_req(const uint8_t *pdu, size_t len, uint16_t *start,
 uint16_t enc_find_by_type_resp(GSList *ranges, uint8_t *pdu, size_t len);
 GSList *dec_find_by_type_resp(const uint8_t *pdu, size_t len);
 struct att_data_list *dec_read_by_grp_resp(const uint8_t *pdu, size_t len);
+uint16_t dec_read_by_grp_resp_iter(const uint8_t *pdu, size_t len,
+						struct att_list_iter *iter);
 uint16_t enc_read_by_type_req(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 						uint8_t *pdu, size_t len);
 uint16_t dec_read_by_type_req(const uint8_t *pdu, size_t len, uint16_t *start,
@@ -228,7 +260,12 @@ uint16_t enc_write_cmd(uint16_t handle, const uint8_t *value, size_t vlen,
 						uint8_t *pdu, size_t len);
 uint16_t dec_write_cmd(const uint8_t *pdu, size_t len, uint16_t *handle,
 						uint8_t *value, size_t *vlen);
+size_t enc_write_cmd_batch(const struct att_write *writes, uint16_t n,
+				uint16_t mtu, uint8_t *pdu, size_t len,
+				uint16_t *lens);
 struct att_data_list *dec_read_by_type_resp(const uint8_t *pdu, size_t len);
+uint16_t dec_read_by_type_resp_iter(const uint8_t *pdu, size_t len,
+						struct att_list_iter *iter);
 uint16_t enc_write_req(uint16_t handle, const uint8_t *value, size_t vlen,
 						uint8_t *pdu, size_t len);
 uint16_t dec_write_req(const uint8_t *pdu, size_t len, uint16_t *handle,
@@ -246,6 +283,14 @@ uint16_t enc_read_blob_resp(uint8_t *value, size_t vlen, uint16_t offset,
 						uint8_t *pdu, size_t len);
 ssize_t dec_read_resp(const uint8_t *pdu, size_t len, uint8_t *value,
 								size_t vlen);
+uint16_t enc_read_multi_req(const uint16_t *handles, uint16_t n,
+						uint8_t *pdu, size_t len);
+uint16_t dec_read_multi_req(const uint8_t *pdu, size_t len, uint16_t *handles,
+								uint16_t max);
+uint16_t enc_read_multi_resp(const uint8_t *values, size_t vlen, uint8_t *pdu,
+								size_t len);
+ssize_t dec_read_multi_resp(const uint8_t *pdu, size_t len, uint8_t *values,
+								size_t vlen);
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 						uint8_t *pdu, size_t len);
 uint16_t enc_find_info_req(uint16_t start, uint16_t end, uint8_t *pdu,
@@ -256,6 +301,8 @@ uint16_t enc_find_info_resp(uint8_t format, struct att_data_list *list,
 						uint8_t *pdu, size_t len);
 struct att_data_list *dec_find_info_resp(const uint8_t *pdu, size_t len,
 							uint8_t *format);
+uint16_t dec_find_info_resp_iter(const uint8_t *pdu, size_t len,
+				uint8_t *format, struct att_list_iter *iter);
 uint16_t enc_notification(uint16_t handle, uint8_t *value, size_t vlen,
 						uint8_t *pdu, size_t len);
 uint16_t enc_indication(uint16_t handle, uint8_t *value, size_t vlen,
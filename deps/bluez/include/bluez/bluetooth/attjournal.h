@@ -0,0 +1,75 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2015  Nod Labs
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef ATT_JOURNAL_H
+#define ATT_JOURNAL_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A journal keeps the last value written to state-like attributes, such as
+ * CCC descriptors, the ring mode or an LED pattern, so that they can be
+ * restored on a new connection after a link loss. It is not tied to a
+ * GAttrib and outlives the connections it is replayed to.
+ *
+ * Entries are keyed by handle and a caller chosen tag, which tells apart
+ * different messages written to the same characteristic; 0 will do for
+ * everything else. Recording a key again replaces its value but keeps its
+ * place in the replay order.
+ */
+struct att_journal;
+struct _GAttrib;
+
+typedef void (*AttJournalDoneFunc)(guint8 status, gpointer user_data);
+
+struct att_journal *att_journal_new(void);
+void att_journal_free(struct att_journal *journal);
+
+/* Values have to fit a write PDU at the default LE MTU */
+gboolean att_journal_record(struct att_journal *journal, uint16_t handle,
+				uint16_t tag, const uint8_t *value,
+				size_t vlen, gboolean request);
+gboolean att_journal_forget(struct att_journal *journal, uint16_t handle,
+							uint16_t tag);
+void att_journal_clear(struct att_journal *journal);
+guint att_journal_length(struct att_journal *journal);
+
+/*
+ * Queues every entry on attrib in recording order and urgent, ahead of
+ * anything else queued there: entries recorded as requests go out as write
+ * requests, the others as write commands, so that they leave in as few
+ * socket writes as the requests allow. done is called once every request
+ * is answered and the last command left the queue, with the first error
+ * any request got, or 0. Returns the number of PDUs queued.
+ */
+guint att_journal_replay(struct att_journal *journal, struct _GAttrib *attrib,
+				AttJournalDoneFunc done, gpointer user_data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,72 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2015  Nod Labs
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef ATT_REACTOR_H
+#define ATT_REACTOR_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A reactor services many ATT connections from a few IO threads, each
+ * running its own epoll io_loop. Connections are spread over the IO
+ * threads and their GAttrib only ever runs on the thread it was put on.
+ *
+ * Notifications and indications are copied off the IO thread and handed
+ * to a pool of worker threads. All PDUs of one connection go to the same
+ * worker, so they are delivered in order. Indications are confirmed by
+ * the IO thread before they are handed over.
+ */
+struct att_reactor;
+struct _GAttrib;
+
+typedef void (*AttReactorNotifyFunc)(guint conn, const uint8_t *pdu,
+					uint16_t len, gpointer user_data);
+typedef void (*AttReactorCallFunc)(struct _GAttrib *attrib,
+					gpointer user_data);
+
+/* io_threads 0 means one per online CPU, workers 0 delivers on IO threads */
+struct att_reactor *att_reactor_new(unsigned int io_threads,
+						unsigned int workers);
+void att_reactor_free(struct att_reactor *reactor);
+
+/*
+ * Returns the connection id, or 0. destroy is called from a reactor
+ * thread once the connection is removed and no PDU for it is in flight.
+ */
+guint att_reactor_add(struct att_reactor *reactor, GIOChannel *io,
+				uint16_t mtu, AttReactorNotifyFunc func,
+				gpointer user_data, GDestroyNotify destroy);
+gboolean att_reactor_remove(struct att_reactor *reactor, guint conn);
+
+/* Run func with the connection's GAttrib on its IO thread */
+gboolean att_reactor_call(struct att_reactor *reactor, guint conn,
+				AttReactorCallFunc func, gpointer user_data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
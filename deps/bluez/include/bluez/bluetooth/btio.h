@@ -73,6 +73,8 @@ typedef enum {
 	BT_IO_MODE_STREAMING
 } BtIOMode;
 
+struct io_loop;
+
 typedef void (*BtIOConfirm)(GIOChannel *io, gpointer user_data);
 
 typedef void (*BtIOConnect)(GIOChannel *io, GError *err, gpointer user_data);
@@ -88,6 +90,12 @@ GIOChannel *bt_io_connect(BtIOConnect connect, gpointer user_data,
 				GDestroyNotify destroy, GError **gerr,
 				BtIOOption opt1, ...);
 
+/* Same as bt_io_connect(), the connect callback is run from loop */
+GIOChannel *bt_io_connect_with_loop(struct io_loop *loop,
+				BtIOConnect connect, gpointer user_data,
+				GDestroyNotify destroy, GError **gerr,
+				BtIOOption opt1, ...);
+
 GIOChannel *bt_io_listen(BtIOConnect connect, BtIOConfirm confirm,
 				gpointer user_data, GDestroyNotify destroy,
 				GError **err, BtIOOption opt1, ...);
@@ -0,0 +1,102 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2015  Nod Labs
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef GATT_CACHE_H
+#define GATT_CACHE_H
+
+#include <stdint.h>
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A cache keeps the attribute database of one peer, as gatt_discover_all()
+ * returns it, in a file named after the peer's
+ * address. The file is memory mapped and its entries are handed out in
+ * place, so a reconnect finds the database without a single request.
+ *
+ * The cached database holds until the peer indicates Service Changed,
+ * which drops the file and discovers the database again. A peer without
+ * the Service Changed characteristic never changes its database, by the
+ * Core spec, and its cache is kept for good.
+ */
+struct gatt_cache;
+struct _GAttrib;
+struct gatt_primary;
+struct gatt_included;
+struct gatt_char;
+struct gatt_desc;
+struct gatt_db;
+
+/* status is 0 once the database is valid, an ATT error code otherwise */
+typedef void (*GattCacheReadyFunc)(guint8 status, gpointer user_data);
+
+/*
+ * Maps the cache file of bdaddr in dir, creating dir if needed. A missing,
+ * truncated or foreign file leaves the cache empty, not valid.
+ */
+struct gatt_cache *gatt_cache_open(const char *dir, const bdaddr_t *bdaddr);
+void gatt_cache_close(struct gatt_cache *cache);
+
+gboolean gatt_cache_valid(struct gatt_cache *cache);
+
+/* Removes the file, the entries handed out so far stay mapped */
+void gatt_cache_invalidate(struct gatt_cache *cache);
+
+/*
+ * The cached entries in handle order, NULL with n 0 unless valid. They
+ * point into the mapping, which is replaced by the next gatt_cache_store()
+ * and dropped by gatt_cache_close().
+ */
+const struct gatt_primary *gatt_cache_services(struct gatt_cache *cache,
+								guint *n);
+const struct gatt_included *gatt_cache_includes(struct gatt_cache *cache,
+								guint *n);
+const struct gatt_char *gatt_cache_chars(struct gatt_cache *cache,
+								guint *n);
+const struct gatt_desc *gatt_cache_descs(struct gatt_cache *cache,
+								guint *n);
+
+/* Writes db as the new cache file and maps it */
+gboolean gatt_cache_store(struct gatt_cache *cache, const struct gatt_db *db);
+
+/*
+ * Makes the database of the peer at the other end of attrib available.
+ * A valid cache is used as it is and ready is called before this returns.
+ * Otherwise the whole database is discovered, stored, and ready called
+ * from the loop. Either way the cache then watches Service Changed on
+ * attrib, enabling its indications with a write request, and rediscovers
+ * when the peer sends one; ready is called again once that is done. If
+ * the indications can't be enabled the cache is invalidated, as nothing
+ * would tell it of a change, and ready is called with the error.
+ * Confirming the indication is left to the application, as for any other.
+ * The cache holds attrib until gatt_cache_close().
+ */
+gboolean gatt_cache_attach(struct gatt_cache *cache, struct _GAttrib *attrib,
+				GattCacheReadyFunc ready, gpointer user_data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -32,17 +32,116 @@ extern "C" {
 #define GATTRIB_ALL_REQS 0xFE
 #define GATTRIB_ALL_HANDLES 0x0000
 
+/* Power of two buckets: 1, 2-3, 4-7, ..., 128+ PDUs per wakeup */
+#define GATTRIB_RX_BATCH_BUCKETS 8
+
+/* Power of two microsecond buckets: 0-1, 2-3, 4-7, ..., 2^23+ us */
+#define GATTRIB_HIST_BUCKETS 24
+
+/* ATT bearers per GAttrib, including its own */
+#define GATTRIB_MAX_BEARERS 8
+
 struct _GAttrib;
 typedef struct _GAttrib GAttrib;
 
+struct io_loop;
+struct att_write;
+
 typedef void (*GAttribResultFunc) (guint8 status, const guint8 *pdu,
 					guint16 len, gpointer user_data);
 typedef void (*GAttribDisconnectFunc)(gpointer user_data);
 typedef void (*GAttribDebugFunc)(const char *str, gpointer user_data);
 typedef void (*GAttribNotifyFunc)(const guint8 *pdu, guint16 len,
 							gpointer user_data);
+typedef void (*GAttribPressureFunc)(GAttrib *attrib, gboolean high,
+							gpointer user_data);
+
+typedef struct {
+	/* Receive path */
+	guint64 rx_wakeups;	/* G_IO_IN wakeups that delivered PDUs */
+	guint64 rx_pdus;	/* PDUs delivered */
+	guint64 rx_reads;	/* recvmmsg() calls, including EAGAIN */
+	guint rx_max_batch;	/* most PDUs handled by a single wakeup */
+	guint64 rx_batch_hist[GATTRIB_RX_BATCH_BUCKETS];
+
+	/* Transmit path */
+	guint64 tx_wakeups;	/* G_IO_OUT wakeups that sent PDUs */
+	guint64 tx_pdus;	/* PDUs sent */
+	guint64 tx_writes;	/* sendmmsg() calls, including EAGAIN */
+	guint tx_max_batch;	/* most PDUs sent by a single wakeup */
+	guint64 batched;	/* PDUs queued through g_attrib_send_batch() */
+
+	/* Command pool */
+	guint64 cmd_allocs;	/* commands taken from the heap */
+	guint64 cmd_reuses;	/* commands recycled from the pool */
+
+	/* Request failures */
+	guint64 timeouts;	/* requests that got no response in time */
+	guint64 aborts;		/* requests dropped because of a timeout */
+	guint64 deadlines;	/* commands failed at their own deadline */
+
+	/* Cross-thread submission */
+	guint64 submits;	/* commands queued through g_attrib_submit() */
+	guint64 submit_batches;	/* IO loop wakeups that picked them up */
+
+	/* Queue pressure */
+	guint queue_max_pdus;	/* most commands queued at once */
+	gsize queue_max_bytes;	/* most PDU bytes queued at once */
+	guint64 pressure_events; /* high watermark crossings */
+
+	/* Notifications */
+	guint64 conflated;	/* PDUs replaced by a newer one, not delivered */
+
+	/* Reads */
+	guint64 read_hits;	/* answered from the read cache */
+	guint64 read_misses;	/* sent to the peer */
+	guint64 read_shared;	/* joined an identical read in flight */
+
+	/* Bearers */
+	guint64 delegated;	/* sent on an additional bearer */
+} GAttribStats;
+
+typedef struct {
+	guint64 count;
+	guint64 sum_us;
+	guint64 max_us;
+	guint64 bucket[GATTRIB_HIST_BUCKETS];
+} GAttribHistogram;
+
+typedef enum {
+	G_ATTRIB_QUEUE_REQUESTS,
+	G_ATTRIB_QUEUE_RESPONSES,
+} GAttribQueue;
+
+typedef enum {
+	/*
+	 * Keep only the newest notification while the handler is behind:
+	 * PDUs for the handle that queue up during one receive batch are
+	 * collapsed into a single call with the last of them.
+	 */
+	G_ATTRIB_CONFLATE = 1 << 0,
+} GAttribRegisterFlags;
+
+/* Requests of higher priority go out first, FIFO within a priority */
+typedef enum {
+	G_ATTRIB_PRIORITY_BULK,		/* long writes, firmware updates */
+	G_ATTRIB_PRIORITY_NORMAL,	/* g_attrib_send() */
+	G_ATTRIB_PRIORITY_URGENT,	/* control writes */
+} GAttribPriority;
+
+typedef struct {
+	guint64 count;		/* notifications and indications seen */
+	guint64 mean_interval_us;
+	guint64 min_interval_us;
+	guint64 max_interval_us;
+	guint64 jitter_us;	/* smoothed inter-arrival jitter */
+} GAttribNotifyTiming;
 
 GAttrib *g_attrib_new(GIOChannel *io);
+GAttrib *g_attrib_new_with_mtu(GIOChannel *io, uint16_t mtu);
+/* Watches and timers go to loop instead of the default GLib context */
+GAttrib *g_attrib_new_with_loop(GIOChannel *io, uint16_t mtu,
+						struct io_loop *loop);
 GAttrib *g_attrib_ref(GAttrib *attrib);
 void g_attrib_unref(GAttrib *attrib);
 
@@ -55,6 +154,96 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 			GAttribResultFunc func, gpointer user_data,
 			GDestroyNotify notify);
 
+/*
+ * Same as g_attrib_send(), but the command fails on its own with
+ * ATT_ECODE_TIMEOUT if it is not completed within timeout_ms. The
+ * connection stays usable; a late response is silently dropped.
+ */
+guint g_attrib_send_with_deadline(GAttrib *attrib, guint id,
+			const guint8 *pdu, guint16 len, guint timeout_ms,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify);
+gboolean g_attrib_set_deadline(GAttrib *attrib, guint id, guint timeout_ms);
+
+/*
+ * Same as g_attrib_send(), queued ahead of every waiting request of lower
+ * priority. The request already sent is never overtaken, and responses
+ * still go before any request.
+ */
+guint g_attrib_send_with_priority(GAttrib *attrib, guint id,
+			const guint8 *pdu, guint16 len,
+			GAttribPriority priority, GAttribResultFunc func,
+			gpointer user_data, GDestroyNotify notify);
+
+/*
+ * Queues a write command for each of the n writes as a single command,
+ * encoded in one pass into one buffer and sent with as few socket writes
+ * as possible. The writes go out back to back, in order; notify runs once
+ * the last one has been sent or the batch was cancelled. Values longer
+ * than the MTU allows are cut. Returns the batch id, 0 on failure.
+ */
+guint g_attrib_send_batch(GAttrib *attrib, const struct att_write *writes,
+				guint n, GDestroyNotify notify,
+				gpointer user_data);
+
+/*
+ * g_attrib_send() for threads other than the one running the GAttrib's
+ * loop. The command is handed over through a lock-free queue and queued by
+ * the IO thread on its next wakeup; func and notify run there. The caller
+ * must hold a reference for the duration of the call. The returned id can
+ * be cancelled from the IO thread once the command has been picked up.
+ */
+guint g_attrib_submit(GAttrib *attrib, const guint8 *pdu, guint16 len,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify);
+
+/*
+ * Watermarks on the commands queued in a GAttrib, in PDUs and in bytes, 0
+ * disables a limit. func is called with high TRUE from the g_attrib_send()
+ * that reaches a high watermark, and with high FALSE once the queues
+ * drained to both low watermarks. Producers are expected to throttle or
+ * drop in between; nothing is refused by GAttrib itself.
+ */
+gboolean g_attrib_set_watermarks(GAttrib *attrib, guint high_pdus,
+				guint low_pdus, gsize high_bytes,
+				gsize low_bytes, GAttribPressureFunc func,
+				gpointer user_data);
+/* Current queue depth, returns TRUE while above the high watermark */
+gboolean g_attrib_get_pressure(GAttrib *attrib, guint *pdus, gsize *bytes);
+
+/*
+ * Read and read blob requests identical to one already queued or on air
+ * are not sent again, they complete with its response. Responses for a
+ * handle with a TTL are also kept that long and answered from the loop
+ * without a transaction; ttl_ms 0 stops caching the handle. Use it for
+ * values known to be static. The cache is dropped on disconnection, for a
+ * handle range with g_attrib_invalidate_reads(), and when the Service
+ * Changed characteristic watched at handle is indicated. Confirming the
+ * indication is left to the application.
+ */
+gboolean g_attrib_set_read_ttl(GAttrib *attrib, guint16 handle, guint ttl_ms);
+void g_attrib_invalidate_reads(GAttrib *attrib, guint16 start, guint16 end);
+gboolean g_attrib_watch_service_changed(GAttrib *attrib, guint16 handle);
+
+/*
+ * Enhanced ATT style bearers: more L2CAP channels to the same peer, each
+ * with a request of its own in flight. Requests sent through attrib are
+ * spread over its bearers, the least busy one first, but those for a
+ * handle with a request still pending go after it on the same bearer,
+ * and so do follow-ups sent under the id of an earlier request.
+ * Commands and the MTU exchange stay on the first bearer unless their
+ * handle is pending elsewhere, so does g_attrib_submit(). Prepared writes
+ * always do, as the peer keeps a prepare queue per bearer; they are not
+ * ordered after a request for their handle pending on another bearer.
+ * Requests on every bearer count against attrib's watermarks.
+ * Notifications and indications from every bearer go to attrib's
+ * listeners, a confirmation goes back on the bearer of the indication.
+ * Returns the index of the new bearer, or 0.
+ */
+guint g_attrib_add_bearer(GAttrib *attrib, GIOChannel *io);
+/* Bearers that are still connected */
+guint g_attrib_get_bearers(GAttrib *attrib);
+
 gboolean g_attrib_cancel(GAttrib *attrib, guint id);
 gboolean g_attrib_cancel_all(GAttrib *attrib);
 
@@ -64,6 +253,13 @@ gboolean g_attrib_set_debug(GAttrib *attrib,
 guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 				GAttribNotifyFunc func, gpointer user_data,
 				GDestroyNotify notify);
+/* G_ATTRIB_CONFLATE needs ATT_OP_HANDLE_NOTIFY and a single handle */
+guint g_attrib_register_full(GAttrib *attrib, guint8 opcode, guint16 handle,
+				GAttribRegisterFlags flags,
+				GAttribNotifyFunc func, gpointer user_data,
+				GDestroyNotify notify);
+/* Notifications a conflated listener never saw */
+gboolean g_attrib_get_conflated(GAttrib *attrib, guint id, guint64 *dropped);
 
 gboolean g_attrib_is_encrypted(GAttrib *attrib);
 
@@ -73,6 +269,18 @@ gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu);
 gboolean g_attrib_unregister(GAttrib *attrib, guint id);
 gboolean g_attrib_unregister_all(GAttrib *attrib);
 
+gboolean g_attrib_get_stats(GAttrib *attrib, GAttribStats *stats);
+void g_attrib_reset_stats(GAttrib *attrib);
+
+gboolean g_attrib_get_rtt(GAttrib *attrib, guint8 opcode,
+						GAttribHistogram *hist);
+gboolean g_attrib_get_queue_wait(GAttrib *attrib, GAttribQueue queue,
+						GAttribHistogram *hist);
+gboolean g_attrib_get_notify_timing(GAttrib *attrib, guint16 handle,
+						GAttribNotifyTiming *timing);
+guint64 g_attrib_histogram_percentile(const GAttribHistogram *hist,
+								double pct);
+
 #ifdef __cplusplus
 }
 #endif
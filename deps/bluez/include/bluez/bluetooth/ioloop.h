@@ -0,0 +1,92 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2015  Nod Labs
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifndef IO_LOOP_H
+#define IO_LOOP_H
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event loop used by GAttrib and bt_io for socket watches and timers.
+ *
+ * io_loop_default() wraps the default GLib main context, which is what
+ * GAttrib has always used. io_loop_epoll_new() creates a loop on its own
+ * epoll instance: run it on a dedicated thread with io_loop_run(), or hand
+ * it to a GLib main context with io_loop_attach().
+ *
+ * Other loops can be plugged in by filling in struct io_loop_ops. A loop
+ * and everything registered on it belong to a single thread; only
+ * io_loop_quit() may be called from elsewhere.
+ */
+struct io_loop;
+
+typedef gboolean (*IOLoopFunc)(int fd, GIOCondition cond, gpointer user_data);
+
+struct io_loop_ops {
+	guint (*add_watch)(struct io_loop *loop, int fd, GIOCondition cond,
+				IOLoopFunc func, gpointer user_data,
+				GDestroyNotify destroy);
+	guint (*add_timeout)(struct io_loop *loop, guint ms,
+				GSourceFunc func, gpointer user_data,
+				GDestroyNotify destroy);
+	void (*remove)(struct io_loop *loop, guint id);
+	/* pollable fd that becomes readable when dispatch has work, or -1 */
+	int (*get_fd)(struct io_loop *loop);
+	/* wait up to timeout ms (-1 forever) and run what is ready */
+	int (*dispatch)(struct io_loop *loop, int timeout);
+	/* make a blocked dispatch return, may be called from any thread */
+	void (*wakeup)(struct io_loop *loop);
+	void (*free)(struct io_loop *loop);
+};
+
+struct io_loop {
+	const struct io_loop_ops *ops;
+	volatile int quit;
+};
+
+struct io_loop *io_loop_default(void);
+struct io_loop *io_loop_epoll_new(void);
+void io_loop_free(struct io_loop *loop);
+
+guint io_loop_add_watch(struct io_loop *loop, int fd, GIOCondition cond,
+				IOLoopFunc func, gpointer user_data,
+				GDestroyNotify destroy);
+guint io_loop_add_timeout(struct io_loop *loop, guint ms, GSourceFunc func,
+				gpointer user_data, GDestroyNotify destroy);
+void io_loop_remove(struct io_loop *loop, guint id);
+
+int io_loop_get_fd(struct io_loop *loop);
+int io_loop_dispatch(struct io_loop *loop, int timeout);
+void io_loop_run(struct io_loop *loop);
+void io_loop_quit(struct io_loop *loop);
+
+/* Dispatch loop from the default GLib main context, returns a source id */
+guint io_loop_attach(struct io_loop *loop);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
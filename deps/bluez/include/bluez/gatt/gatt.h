@@ -74,6 +74,29 @@ struct gatt_char {
 	uint16_t value_handle;
 };
 
+struct gatt_desc {
+	char uuid[MAX_LEN_UUID_STR + 1];
+	uint16_t handle;
+};
+
+/* A whole attribute database, every array in handle order */
+struct gatt_db {
+	struct gatt_primary *services;
+	struct gatt_included *includes;
+	struct gatt_char *chars;
+	struct gatt_desc *descs;
+	guint n_services;
+	guint n_includes;
+	guint n_chars;
+	guint n_descs;
+};
+
+struct gatt_discovery;
+
+/* db belongs to the callee, NULL unless status is 0 */
+typedef void (*gatt_db_cb_t) (struct gatt_db *db, guint8 status,
+							gpointer user_data);
+
 guint gatt_discover_primary(GAttrib *attrib, bt_uuid_t *uuid, gatt_cb_t func,
 							gpointer user_data);
 
@@ -87,13 +110,70 @@ guint gatt_discover_char(GAttrib *attrib, uint16_t start, uint16_t end,
 guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 							gpointer user_data);
 
+/*
+ * gatt_read_char() for a value of about hint octets, which a long read
+ * then assembles without growing its buffer.
+ */
+guint gatt_read_long_char(GAttrib *attrib, uint16_t handle, uint16_t hint,
+				GAttribResultFunc func, gpointer user_data);
+
+/*
+ * Reads the values of n handles of known lengths with Read Multiple, in as
+ * few requests as the MTU allows. func gets them as one Read Multiple
+ * Response, in the order of handles, for dec_read_multi_resp().
+ */
+guint gatt_read_multi(GAttrib *attrib, const uint16_t *handles,
+				const uint16_t *lens, guint16 n,
+				GAttribResultFunc func, gpointer user_data);
+
+/*
+ * A value too long for one Write Request goes out as a long write with the
+ * default window. The id returned is then that of its first Prepare Write
+ * only: cancelling it doesn't stop the write, while that request is still
+ * pending it makes the write fail with ATT_ECODE_UNLIKELY. Long writes
+ * that may have to be stopped go through gatt_write_long_char().
+ */
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 					size_t vlen, GAttribResultFunc func,
 					gpointer user_data);
 
+/* Prepare Write Requests a long write keeps queued unless told otherwise */
+#define GATT_WRITE_WINDOW	4
+
+struct gatt_long_write;
+
+typedef void (*gatt_write_progress_t) (size_t written, size_t total,
+							gpointer user_data);
+
+/*
+ * Writes a long value with up to window Prepare Write Requests queued at
+ * a time. Every response has to echo what was sent, or the prepared
+ * writes are cancelled and func gets ATT_ECODE_UNLIKELY. progress, if
+ * any, runs with the octets echoed so far. Once all are in, func gets the
+ * Execute Write Response. The write is valid until func returns, and
+ * aborting it before func runs cancels the prepared writes, and the Execute
+ * Write unless it is already on air, without calling func.
+ */
+struct gatt_long_write *gatt_write_long_char(GAttrib *attrib, uint16_t handle,
+				const uint8_t *value, size_t vlen,
+				guint window, gatt_write_progress_t progress,
+				GAttribResultFunc func, gpointer user_data);
+void gatt_write_long_abort(struct gatt_long_write *long_write);
+
 guint gatt_discover_char_desc(GAttrib *attrib, uint16_t start, uint16_t end,
 				GAttribResultFunc func, gpointer user_data);
 
+/*
+ * Discovers primary services, included services, characteristics and
+ * descriptors in one go, with the next request always queued, and hands
+ * them to func as one flat database. The discovery is valid until func
+ * runs or it is cancelled, which drops whatever it found.
+ */
+struct gatt_discovery *gatt_discover_all(GAttrib *attrib, gatt_db_cb_t func,
+							gpointer user_data);
+void gatt_discover_all_cancel(struct gatt_discovery *disc);
+void gatt_db_free(struct gatt_db *db);
+
 guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, uint8_t *value, int vlen,
 				GDestroyNotify notify, gpointer user_data);
 
@@ -85,35 +85,30 @@ const char *att_ecode2str(uint8_t status)
 
 void att_data_list_free(struct att_data_list *list)
 {
-	if (list == NULL)
-		return;
-
-	if (list->data) {
-		int i;
-		for (i = 0; i < list->num; i++)
-			g_free(list->data[i]);
-	}
-
-	g_free(list->data);
 	g_free(list);
 }
 
+/*
+ * The list, the entry pointers and the entries share a single allocation,
+ * data[i] points into it and must not be freed or replaced on its own.
+ */
 struct att_data_list *att_data_list_alloc(uint16_t num, uint16_t len)
 {
 	struct att_data_list *list;
+	uint8_t *entry;
 	int i;
 
 	if (len > UINT8_MAX)
 		return NULL;
 
-	list = g_new0(struct att_data_list, 1);
+	list = g_malloc0(sizeof(*list) + num * (sizeof(uint8_t *) + len));
 	list->len = len;
 	list->num = num;
+	list->data = (uint8_t **) (list + 1);
 
-	list->data = g_malloc0(sizeof(uint8_t *) * num);
-
-	for (i = 0; i < num; i++)
-		list->data[i] = g_malloc0(sizeof(uint8_t) * len);
+	entry = (uint8_t *) (list->data + num);
+	for (i = 0; i < num; i++, entry += len)
+		list->data[i] = entry;
 
 	return list;
 }
@@ -200,32 +195,71 @@ uint16_t enc_read_by_grp_resp(struct att_data_list *list, uint8_t *pdu,
 	return w;
 }
 
-struct att_data_list *dec_read_by_grp_resp(const uint8_t *pdu, size_t len)
+/*
+ * Sets up a cursor over the entries of a list response that follow the
+ * opcode and length bytes. A trailing partial entry is ignored, as the
+ * copying decoders always did. Returns the number of entries, 0 if the
+ * PDU holds none.
+ */
+static uint16_t list_iter_init(const uint8_t *pdu, size_t len, uint16_t elen,
+				uint16_t min_elen, struct att_list_iter *iter)
 {
-	struct att_data_list *list;
-	const uint8_t *ptr;
-	uint16_t elen, num;
-	int i;
+	uint16_t num;
 
-	if (pdu[0] != ATT_OP_READ_BY_GROUP_RESP)
-		return NULL;
+	iter->next = NULL;
+	iter->end = NULL;
+	iter->len = elen;
+
+	if (len < 2 || elen < min_elen)
+		return 0;
 
-	elen = pdu[1];
 	num = (len - 2) / elen;
-	list = att_data_list_alloc(num, elen);
+	if (num == 0)
+		return 0;
+
+	iter->next = &pdu[2];
+	iter->end = iter->next + num * elen;
+
+	return num;
+}
+
+static struct att_data_list *list_from_iter(const struct att_list_iter *iter,
+								uint16_t num)
+{
+	struct att_data_list *list;
+
+	list = att_data_list_alloc(num, iter->len);
 	if (list == NULL)
 		return NULL;
 
-	ptr = &pdu[2];
-
-	for (i = 0; i < num; i++) {
-		memcpy(list->data[i], ptr, list->len);
-		ptr += list->len;
-	}
+	/* the entries are laid out back to back, as in the PDU */
+	memcpy(list->data[0], iter->next, num * iter->len);
 
 	return list;
 }
 
+uint16_t dec_read_by_grp_resp_iter(const uint8_t *pdu, size_t len,
+						struct att_list_iter *iter)
+{
+	if (pdu == NULL || len < 2 || pdu[0] != ATT_OP_READ_BY_GROUP_RESP)
+		return list_iter_init(pdu, 0, 0, 0, iter);
+
+	/* start and end handle, then the group type value */
+	return list_iter_init(pdu, len, pdu[1], 5, iter);
+}
+
+struct att_data_list *dec_read_by_grp_resp(const uint8_t *pdu, size_t len)
+{
+	struct att_list_iter iter;
+	uint16_t num;
+
+	num = dec_read_by_grp_resp_iter(pdu, len, &iter);
+	if (num == 0)
+		return NULL;
+
+	return list_from_iter(&iter, num);
+}
+
 uint16_t enc_find_by_type_req(uint16_t start, uint16_t end, bt_uuid_t *uuid,
 					const uint8_t *value, size_t vlen,
 					uint8_t *pdu, size_t len)
@@ -432,30 +466,26 @@ uint16_t enc_read_by_type_resp(struct att_data_list *list, uint8_t *pdu,
 	return w;
 }
 
-struct att_data_list *dec_read_by_type_resp(const uint8_t *pdu, size_t len)
+uint16_t dec_read_by_type_resp_iter(const uint8_t *pdu, size_t len,
+						struct att_list_iter *iter)
 {
-	struct att_data_list *list;
-	const uint8_t *ptr;
-	uint16_t elen, num;
-	int i;
-
-	if (pdu[0] != ATT_OP_READ_BY_TYPE_RESP)
-		return NULL;
+	if (pdu == NULL || len < 2 || pdu[0] != ATT_OP_READ_BY_TYPE_RESP)
+		return list_iter_init(pdu, 0, 0, 0, iter);
 
-	elen = pdu[1];
-	num = (len - 2) / elen;
-	list = att_data_list_alloc(num, elen);
-	if (list == NULL)
-		return NULL;
+	/* handle, then the attribute value */
+	return list_iter_init(pdu, len, pdu[1], 3, iter);
+}
 
-	ptr = &pdu[2];
+struct att_data_list *dec_read_by_type_resp(const uint8_t *pdu, size_t len)
+{
+	struct att_list_iter iter;
+	uint16_t num;
 
-	for (i = 0; i < num; i++) {
-		memcpy(list->data[i], ptr, list->len);
-		ptr += list->len;
-	}
+	num = dec_read_by_type_resp_iter(pdu, len, &iter);
+	if (num == 0)
+		return NULL;
 
-	return list;
+	return list_from_iter(&iter, num);
 }
 
 uint16_t enc_write_cmd(uint16_t handle, const uint8_t *value, size_t vlen,
@@ -483,6 +513,48 @@ uint16_t enc_write_cmd(uint16_t handle, const uint8_t *value, size_t vlen,
 	return min_len;
 }
 
+/*
+ * Encodes a write command per entry of writes, back to back into pdu, each
+ * at most mtu long with its value cut like enc_write_cmd() does. lens gets
+ * the length of every PDU. Returns the bytes used, 0 if they don't fit
+ * into len. With pdu NULL only the bytes needed are returned.
+ */
+size_t enc_write_cmd_batch(const struct att_write *writes, uint16_t n,
+				uint16_t mtu, uint8_t *pdu, size_t len,
+				uint16_t *lens)
+{
+	const uint16_t min_len = sizeof(pdu[0]) + sizeof(uint16_t);
+	size_t w = 0, vlen;
+	uint16_t i;
+
+	if (writes == NULL || mtu < min_len)
+		return 0;
+
+	if (pdu != NULL && lens == NULL)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		vlen = MIN(writes[i].vlen, (size_t) (mtu - min_len));
+
+		if (pdu != NULL) {
+			if (w + min_len + vlen > len)
+				return 0;
+
+			pdu[w] = ATT_OP_WRITE_CMD;
+			att_put_u16(writes[i].handle, &pdu[w + 1]);
+			if (vlen > 0)
+				memcpy(&pdu[w + min_len], writes[i].value,
+									vlen);
+
+			lens[i] = min_len + vlen;
+		}
+
+		w += min_len + vlen;
+	}
+
+	return w;
+}
+
 uint16_t dec_write_cmd(const uint8_t *pdu, size_t len, uint16_t *handle,
 						uint8_t *value, size_t *vlen)
 {
@@ -716,6 +788,91 @@ ssize_t dec_read_resp(const uint8_t *pdu, size_t len, uint8_t *value,
 	return len - 1;
 }
 
+uint16_t enc_read_multi_req(const uint16_t *handles, uint16_t n,
+						uint8_t *pdu, size_t len)
+{
+	const size_t req_len = sizeof(pdu[0]) + n * sizeof(handles[0]);
+	uint16_t i;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	/* A single handle takes a Read Request */
+	if (n < 2 || len < req_len)
+		return 0;
+
+	pdu[0] = ATT_OP_READ_MULTI_REQ;
+
+	for (i = 0; i < n; i++)
+		att_put_u16(handles[i], &pdu[1 + 2 * i]);
+
+	return req_len;
+}
+
+uint16_t dec_read_multi_req(const uint8_t *pdu, size_t len, uint16_t *handles,
+								uint16_t max)
+{
+	uint16_t i, n;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	if (len < 5 || (len - 1) % 2 != 0)
+		return 0;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_REQ)
+		return 0;
+
+	n = (len - 1) / 2;
+	if (n > max)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		handles[i] = att_get_u16(&pdu[1 + 2 * i]);
+
+	return n;
+}
+
+uint16_t enc_read_multi_resp(const uint8_t *values, size_t vlen, uint8_t *pdu,
+								size_t len)
+{
+	if (pdu == NULL)
+		return 0;
+
+	if (len < 1)
+		return 0;
+
+	/* The server sends as much of the set of values as fits */
+	if (vlen > len - 1)
+		vlen = len - 1;
+
+	pdu[0] = ATT_OP_READ_MULTI_RESP;
+
+	memcpy(pdu + 1, values, vlen);
+
+	return vlen + 1;
+}
+
+ssize_t dec_read_multi_resp(const uint8_t *pdu, size_t len, uint8_t *values,
+								size_t vlen)
+{
+	if (pdu == NULL || len < 1)
+		return -EINVAL;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_RESP)
+		return -EINVAL;
+
+	if (values == NULL)
+		return len - 1;
+
+	if (vlen < (len - 1))
+		return -ENOBUFS;
+
+	memcpy(values, pdu + 1, len - 1);
+
+	return len - 1;
+}
+
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 						uint8_t *pdu, size_t len)
 {
@@ -804,44 +961,39 @@ uint16_t enc_find_info_resp(uint8_t format, struct att_data_list *list,
 	return w;
 }
 
-struct att_data_list *dec_find_info_resp(const uint8_t *pdu, size_t len,
-							uint8_t *format)
+uint16_t dec_find_info_resp_iter(const uint8_t *pdu, size_t len,
+				uint8_t *format, struct att_list_iter *iter)
 {
-	struct att_data_list *list;
-	uint8_t *ptr;
-	uint16_t elen, num;
-	int i;
+	uint16_t elen;
 
-	if (pdu == NULL)
-		return 0;
-
-	if (format == NULL)
-		return 0;
-
-	if (pdu[0] != ATT_OP_FIND_INFO_RESP)
-		return 0;
+	if (pdu == NULL || format == NULL || len < 2 ||
+					pdu[0] != ATT_OP_FIND_INFO_RESP)
+		return list_iter_init(pdu, 0, 0, 0, iter);
 
 	*format = pdu[1];
-	elen = sizeof(pdu[0]) + sizeof(*format);
-	if (*format == 0x01)
-		elen += 2;
-	else if (*format == 0x02)
-		elen += 16;
 
-	num = (len - 2) / elen;
+	/* handle, then a 16 or 128 bit UUID */
+	if (*format == ATT_FIND_INFO_RESP_FMT_16BIT)
+		elen = 2 + 2;
+	else if (*format == ATT_FIND_INFO_RESP_FMT_128BIT)
+		elen = 2 + 16;
+	else
+		elen = 0;
 
-	ptr = (void *) &pdu[2];
+	return list_iter_init(pdu, len, elen, 4, iter);
+}
 
-	list = att_data_list_alloc(num, elen);
-	if (list == NULL)
-		return NULL;
+struct att_data_list *dec_find_info_resp(const uint8_t *pdu, size_t len,
+							uint8_t *format)
+{
+	struct att_list_iter iter;
+	uint16_t num;
 
-	for (i = 0; i < num; i++) {
-		memcpy(list->data[i], ptr, list->len);
-		ptr += list->len;
-	}
+	num = dec_find_info_resp_iter(pdu, len, format, &iter);
+	if (num == 0)
+		return NULL;
 
-	return list;
+	return list_from_iter(&iter, num);
 }
 
 uint16_t enc_notification(uint16_t handle, uint8_t *value, size_t vlen,
@@ -1093,7 +1245,7 @@ uint16_t dec_prep_write_resp(const uint8_t *pdu, size_t len, uint16_t *handle,
 	if (len < min_len)
 		return 0;
 
-	if (pdu[0] != ATT_OP_PREP_WRITE_REQ)
+	if (pdu[0] != ATT_OP_PREP_WRITE_RESP)
 		return 0;
 
 	*handle = att_get_u16(&pdu[1]);
@@ -0,0 +1,248 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2015  Nod Labs
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/bluetooth/att.h>
+#include <bluez/bluetooth/gattrib.h>
+#include <bluez/bluetooth/attjournal.h>
+
+#define JOURNAL_VALUE_MAX (ATT_DEFAULT_LE_MTU - 3)
+
+struct journal_entry {
+	uint16_t handle;
+	uint16_t tag;
+	gboolean request;
+	uint16_t vlen;
+	uint8_t value[JOURNAL_VALUE_MAX];
+};
+
+struct att_journal {
+	GQueue entries;		/* in replay order */
+};
+
+struct journal_replay {
+	AttJournalDoneFunc done;
+	gpointer user_data;
+	guint pending;		/* requests and the last command in flight */
+	guint unanswered;
+	guint8 status;		/* the first error */
+};
+
+struct att_journal *att_journal_new(void)
+{
+	return g_try_new0(struct att_journal, 1);
+}
+
+void att_journal_free(struct att_journal *journal)
+{
+	if (journal == NULL)
+		return;
+
+	att_journal_clear(journal);
+	g_free(journal);
+}
+
+static GList *entry_find(struct att_journal *journal, uint16_t handle,
+								uint16_t tag)
+{
+	GList *l;
+
+	for (l = journal->entries.head; l; l = l->next) {
+		struct journal_entry *e = l->data;
+
+		if (e->handle == handle && e->tag == tag)
+			return l;
+	}
+
+	return NULL;
+}
+
+gboolean att_journal_record(struct att_journal *journal, uint16_t handle,
+				uint16_t tag, const uint8_t *value,
+				size_t vlen, gboolean request)
+{
+	struct journal_entry *e;
+	GList *l;
+
+	if (journal == NULL || handle == 0 || vlen > JOURNAL_VALUE_MAX)
+		return FALSE;
+
+	l = entry_find(journal, handle, tag);
+	if (l) {
+		e = l->data;
+	} else {
+		e = g_try_new0(struct journal_entry, 1);
+		if (e == NULL)
+			return FALSE;
+
+		e->handle = handle;
+		e->tag = tag;
+		g_queue_push_tail(&journal->entries, e);
+	}
+
+	e->request = request;
+	e->vlen = vlen;
+	memcpy(e->value, value, vlen);
+
+	return TRUE;
+}
+
+gboolean att_journal_forget(struct att_journal *journal, uint16_t handle,
+							uint16_t tag)
+{
+	GList *l;
+
+	if (journal == NULL)
+		return FALSE;
+
+	l = entry_find(journal, handle, tag);
+	if (l == NULL)
+		return FALSE;
+
+	g_free(l->data);
+	g_queue_delete_link(&journal->entries, l);
+
+	return TRUE;
+}
+
+void att_journal_clear(struct att_journal *journal)
+{
+	struct journal_entry *e;
+
+	if (journal == NULL)
+		return;
+
+	while ((e = g_queue_pop_head(&journal->entries)))
+		g_free(e);
+}
+
+guint att_journal_length(struct att_journal *journal)
+{
+	if (journal == NULL)
+		return 0;
+
+	return g_queue_get_length(&journal->entries);
+}
+
+static void replay_result(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct journal_replay *replay = user_data;
+
+	replay->unanswered--;
+
+	if (status != 0 && replay->status == 0)
+		replay->status = status;
+}
+
+/* A request was answered or dropped, or the last command left the queue */
+static void replay_release(gpointer user_data)
+{
+	struct journal_replay *replay = user_data;
+
+	if (--replay->pending > 0)
+		return;
+
+	/* Requests dropped unanswered, the link went away */
+	if (replay->unanswered > 0 && replay->status == 0)
+		replay->status = ATT_ECODE_IO;
+
+	if (replay->done)
+		replay->done(replay->status, replay->user_data);
+
+	g_free(replay);
+}
+
+guint att_journal_replay(struct att_journal *journal, GAttrib *attrib,
+				AttJournalDoneFunc done, gpointer user_data)
+{
+	struct journal_entry *e;
+	struct journal_replay *replay;
+	uint8_t pdu[ATT_DEFAULT_LE_MTU];
+	uint16_t plen;
+	guint queued = 0;
+	GList *l;
+
+	if (journal == NULL || attrib == NULL ||
+				g_queue_is_empty(&journal->entries))
+		return 0;
+
+	replay = g_new0(struct journal_replay, 1);
+	replay->done = done;
+	replay->user_data = user_data;
+
+	/* Held until every entry is queued, so done can't run before */
+	replay->pending = 1;
+
+	for (l = journal->entries.head; l; l = l->next) {
+		GAttribResultFunc func = NULL;
+		GDestroyNotify notify = NULL;
+
+		e = l->data;
+
+		if (e->request) {
+			plen = enc_write_req(e->handle, e->value, e->vlen,
+							pdu, sizeof(pdu));
+			func = replay_result;
+			notify = replay_release;
+		} else {
+			plen = enc_write_cmd(e->handle, e->value, e->vlen,
+							pdu, sizeof(pdu));
+			/* Completion waits for the last command too */
+			if (l->next == NULL)
+				notify = replay_release;
+		}
+
+		if (g_attrib_send_with_priority(attrib, 0, pdu, plen,
+					G_ATTRIB_PRIORITY_URGENT, func,
+					replay, notify) == 0) {
+			/* The GAttrib went stale under us */
+			replay->status = ATT_ECODE_IO;
+			break;
+		}
+
+		if (notify)
+			replay->pending++;
+		if (func)
+			replay->unanswered++;
+		queued++;
+	}
+
+	if (queued == 0) {
+		g_free(replay);
+		return 0;
+	}
+
+	replay_release(replay);
+
+	return queued;
+}
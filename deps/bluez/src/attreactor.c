@@ -0,0 +1,492 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2015  Nod Labs
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <glib.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/bluetooth/att.h>
+#include <bluez/bluetooth/gattrib.h>
+#include <bluez/bluetooth/ioloop.h>
+#include <bluez/bluetooth/attreactor.h>
+
+#include "log.h"
+
+struct reactor_thread {
+	struct att_reactor *reactor;
+	GThread *thread;
+	struct io_loop *loop;
+	int event_fd;
+	GAsyncQueue *calls;
+	gint conns;
+};
+
+struct reactor_worker {
+	GThread *thread;
+	GAsyncQueue *events;
+};
+
+struct reactor_conn {
+	guint id;
+	gint refs;
+	gint closed;
+	struct reactor_thread *thread;
+	struct reactor_worker *worker;
+	GIOChannel *io;
+	uint16_t mtu;
+	GAttrib *attrib;	/* only touched from thread */
+	guint notify_id;
+	guint ind_id;
+	AttReactorNotifyFunc func;
+	gpointer user_data;
+	GDestroyNotify destroy;
+};
+
+struct reactor_call {
+	struct reactor_conn *conn;
+	void (*func)(struct reactor_conn *conn, gpointer user_data);
+	gpointer user_data;
+};
+
+struct reactor_event {
+	struct reactor_conn *conn;
+	uint16_t len;
+	uint8_t pdu[0];
+};
+
+struct att_reactor {
+	struct reactor_thread *threads;
+	unsigned int n_threads;
+	struct reactor_worker *workers;
+	unsigned int n_workers;
+	GMutex lock;		/* protects conns and next_id */
+	GHashTable *conns;
+	guint next_id;
+};
+
+/* Pushed to a worker queue to make the worker exit */
+static struct reactor_event worker_stop;
+
+static struct reactor_conn *conn_ref(struct reactor_conn *conn)
+{
+	g_atomic_int_inc(&conn->refs);
+
+	return conn;
+}
+
+static void conn_unref(struct reactor_conn *conn)
+{
+	if (!g_atomic_int_dec_and_test(&conn->refs))
+		return;
+
+	if (conn->destroy)
+		conn->destroy(conn->user_data);
+
+	g_io_channel_unref(conn->io);
+	g_free(conn);
+}
+
+static void deliver(struct reactor_event *ev)
+{
+	struct reactor_conn *conn = ev->conn;
+
+	if (!g_atomic_int_get(&conn->closed))
+		conn->func(conn->id, ev->pdu, ev->len, conn->user_data);
+
+	conn_unref(conn);
+	g_free(ev);
+}
+
+static gpointer worker_main(gpointer data)
+{
+	struct reactor_worker *worker = data;
+	struct reactor_event *ev;
+
+	while ((ev = g_async_queue_pop(worker->events)) != &worker_stop)
+		deliver(ev);
+
+	return NULL;
+}
+
+static void conn_event(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+	struct reactor_conn *conn = user_data;
+	struct reactor_event *ev;
+
+	if (pdu[0] == ATT_OP_HANDLE_IND) {
+		size_t buflen;
+		uint8_t *buf = g_attrib_get_buffer(conn->attrib, &buflen);
+		uint16_t olen = enc_confirmation(buf, buflen);
+
+		if (olen > 0)
+			g_attrib_send(conn->attrib, 0, buf, olen, NULL, NULL,
+									NULL);
+	}
+
+	ev = g_try_malloc(sizeof(*ev) + len);
+	if (ev == NULL)
+		return;
+
+	ev->conn = conn_ref(conn);
+	ev->len = len;
+	memcpy(ev->pdu, pdu, len);
+
+	if (conn->worker == NULL) {
+		deliver(ev);
+		return;
+	}
+
+	g_async_queue_push(conn->worker->events, ev);
+}
+
+static void conn_attach(struct reactor_conn *conn, gpointer user_data)
+{
+	/* Removed before it got here, conn_detach is queued behind us */
+	if (g_atomic_int_get(&conn->closed))
+		return;
+
+	conn->attrib = g_attrib_new_with_loop(conn->io, conn->mtu,
+							conn->thread->loop);
+	if (conn->attrib == NULL) {
+		error("att_reactor: connection %u not attached", conn->id);
+		return;
+	}
+
+	conn->notify_id = g_attrib_register(conn->attrib,
+					ATT_OP_HANDLE_NOTIFY,
+					GATTRIB_ALL_HANDLES, conn_event,
+					conn, NULL);
+	conn->ind_id = g_attrib_register(conn->attrib, ATT_OP_HANDLE_IND,
+					GATTRIB_ALL_HANDLES, conn_event,
+					conn, NULL);
+}
+
+static void conn_detach(struct reactor_conn *conn, gpointer user_data)
+{
+	g_atomic_int_add(&conn->thread->conns, -1);
+
+	if (conn->attrib == NULL)
+		return;
+
+	g_attrib_unregister(conn->attrib, conn->notify_id);
+	g_attrib_unregister(conn->attrib, conn->ind_id);
+	g_attrib_unref(conn->attrib);
+	conn->attrib = NULL;
+}
+
+static void thread_quit(struct reactor_conn *conn, gpointer user_data)
+{
+	struct reactor_thread *thread = user_data;
+
+	io_loop_quit(thread->loop);
+}
+
+static gboolean thread_calls(int fd, GIOCondition cond, gpointer user_data)
+{
+	struct reactor_thread *thread = user_data;
+	struct reactor_call *call;
+	uint64_t val;
+
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		error("att_reactor: %s", strerror(errno));
+
+	while ((call = g_async_queue_try_pop(thread->calls))) {
+		call->func(call->conn, call->user_data);
+
+		if (call->conn)
+			conn_unref(call->conn);
+
+		g_free(call);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Takes over the caller's reference to conn, which is dropped on thread
+ * once func ran: only a reactor thread ever destroys a connection.
+ */
+static void thread_post(struct reactor_thread *thread,
+			struct reactor_conn *conn,
+			void (*func)(struct reactor_conn *conn, gpointer data),
+			gpointer user_data)
+{
+	struct reactor_call *call;
+	uint64_t val = 1;
+
+	call = g_new0(struct reactor_call, 1);
+	call->conn = conn;
+	call->func = func;
+	call->user_data = user_data;
+
+	g_async_queue_push(thread->calls, call);
+
+	if (write(thread->event_fd, &val, sizeof(val)) < 0)
+		error("att_reactor: %s", strerror(errno));
+}
+
+static gpointer thread_main(gpointer data)
+{
+	struct reactor_thread *thread = data;
+
+	io_loop_run(thread->loop);
+
+	return NULL;
+}
+
+static int thread_init(struct reactor_thread *thread, unsigned int index)
+{
+	char name[16];
+
+	thread->loop = io_loop_epoll_new();
+	if (thread->loop == NULL)
+		return -ENOMEM;
+
+	thread->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (thread->event_fd < 0) {
+		io_loop_free(thread->loop);
+		return -errno;
+	}
+
+	thread->calls = g_async_queue_new();
+	io_loop_add_watch(thread->loop, thread->event_fd, G_IO_IN,
+						thread_calls, thread, NULL);
+
+	snprintf(name, sizeof(name), "att-io%u", index);
+	thread->thread = g_thread_new(name, thread_main, thread);
+
+	return 0;
+}
+
+static void thread_cleanup(struct reactor_thread *thread)
+{
+	if (thread->thread) {
+		thread_post(thread, NULL, thread_quit, thread);
+		g_thread_join(thread->thread);
+	}
+
+	io_loop_free(thread->loop);
+	close(thread->event_fd);
+	g_async_queue_unref(thread->calls);
+}
+
+struct att_reactor *att_reactor_new(unsigned int io_threads,
+						unsigned int workers)
+{
+	struct att_reactor *reactor;
+	char name[16];
+	unsigned int i;
+
+	if (io_threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		io_threads = cpus > 0 ? cpus : 1;
+	}
+
+	reactor = g_new0(struct att_reactor, 1);
+	g_mutex_init(&reactor->lock);
+	reactor->conns = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	reactor->threads = g_new0(struct reactor_thread, io_threads);
+	for (i = 0; i < io_threads; i++) {
+		reactor->threads[i].reactor = reactor;
+		if (thread_init(&reactor->threads[i], i) < 0)
+			goto fail;
+		reactor->n_threads++;
+	}
+
+	reactor->workers = g_new0(struct reactor_worker, workers);
+	for (i = 0; i < workers; i++) {
+		struct reactor_worker *worker = &reactor->workers[i];
+
+		snprintf(name, sizeof(name), "att-worker%u", i);
+		worker->events = g_async_queue_new();
+		worker->thread = g_thread_new(name, worker_main, worker);
+		reactor->n_workers++;
+	}
+
+	return reactor;
+
+fail:
+	att_reactor_free(reactor);
+	return NULL;
+}
+
+static void conn_close(struct att_reactor *reactor, struct reactor_conn *conn)
+{
+	g_atomic_int_set(&conn->closed, 1);
+
+	/* With the table's reference */
+	thread_post(conn->thread, conn, conn_detach, NULL);
+}
+
+void att_reactor_free(struct att_reactor *reactor)
+{
+	GHashTableIter iter;
+	gpointer value;
+	unsigned int i;
+
+	if (reactor == NULL)
+		return;
+
+	g_hash_table_iter_init(&iter, reactor->conns);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		g_hash_table_iter_remove(&iter);
+		conn_close(reactor, value);
+	}
+
+	/* Pending detach calls run before the quit posted here */
+	for (i = 0; i < reactor->n_threads; i++)
+		thread_cleanup(&reactor->threads[i]);
+
+	for (i = 0; i < reactor->n_workers; i++) {
+		struct reactor_worker *worker = &reactor->workers[i];
+
+		g_async_queue_push(worker->events, &worker_stop);
+		g_thread_join(worker->thread);
+		g_async_queue_unref(worker->events);
+	}
+
+	g_hash_table_destroy(reactor->conns);
+	g_mutex_clear(&reactor->lock);
+	g_free(reactor->threads);
+	g_free(reactor->workers);
+	g_free(reactor);
+}
+
+guint att_reactor_add(struct att_reactor *reactor, GIOChannel *io,
+				uint16_t mtu, AttReactorNotifyFunc func,
+				gpointer user_data, GDestroyNotify destroy)
+{
+	struct reactor_conn *conn;
+	struct reactor_thread *thread;
+	unsigned int i;
+
+	if (reactor == NULL || io == NULL || func == NULL)
+		return 0;
+
+	/* Least loaded IO thread */
+	thread = &reactor->threads[0];
+	for (i = 1; i < reactor->n_threads; i++) {
+		if (g_atomic_int_get(&reactor->threads[i].conns) <
+					g_atomic_int_get(&thread->conns))
+			thread = &reactor->threads[i];
+	}
+
+	conn = g_new0(struct reactor_conn, 1);
+	conn->refs = 1;
+	conn->thread = thread;
+	conn->io = g_io_channel_ref(io);
+	conn->mtu = mtu;
+	conn->func = func;
+	conn->user_data = user_data;
+	conn->destroy = destroy;
+
+	g_mutex_lock(&reactor->lock);
+	conn->id = ++reactor->next_id;
+	g_hash_table_insert(reactor->conns, GUINT_TO_POINTER(conn->id), conn);
+	g_mutex_unlock(&reactor->lock);
+
+	if (reactor->n_workers > 0)
+		conn->worker = &reactor->workers[conn->id %
+							reactor->n_workers];
+
+	g_atomic_int_inc(&thread->conns);
+	thread_post(thread, conn_ref(conn), conn_attach, NULL);
+
+	return conn->id;
+}
+
+gboolean att_reactor_remove(struct att_reactor *reactor, guint id)
+{
+	struct reactor_conn *conn;
+
+	if (reactor == NULL)
+		return FALSE;
+
+	g_mutex_lock(&reactor->lock);
+	conn = g_hash_table_lookup(reactor->conns, GUINT_TO_POINTER(id));
+	if (conn)
+		g_hash_table_remove(reactor->conns, GUINT_TO_POINTER(id));
+	g_mutex_unlock(&reactor->lock);
+
+	if (conn == NULL)
+		return FALSE;
+
+	conn_close(reactor, conn);
+
+	return TRUE;
+}
+
+struct user_call {
+	AttReactorCallFunc func;
+	gpointer user_data;
+};
+
+static void conn_call(struct reactor_conn *conn, gpointer data)
+{
+	struct user_call *call = data;
+
+	if (conn->attrib && !g_atomic_int_get(&conn->closed))
+		call->func(conn->attrib, call->user_data);
+
+	g_free(call);
+}
+
+gboolean att_reactor_call(struct att_reactor *reactor, guint id,
+				AttReactorCallFunc func, gpointer user_data)
+{
+	struct reactor_conn *conn;
+	struct user_call *call;
+
+	if (reactor == NULL || func == NULL)
+		return FALSE;
+
+	g_mutex_lock(&reactor->lock);
+	conn = g_hash_table_lookup(reactor->conns, GUINT_TO_POINTER(id));
+	if (conn)
+		conn_ref(conn);
+	g_mutex_unlock(&reactor->lock);
+
+	if (conn == NULL)
+		return FALSE;
+
+	call = g_new0(struct user_call, 1);
+	call->func = func;
+	call->user_data = user_data;
+
+	/* With the reference taken above */
+	thread_post(conn->thread, conn, conn_call, call);
+
+	return TRUE;
+}
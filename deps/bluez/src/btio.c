@@ -42,6 +42,7 @@
 #include <glib.h>
 
 #include <bluez/bluetooth/btio.h>
+#include <bluez/bluetooth/ioloop.h>
 
 #ifndef BT_FLUSHABLE
 #define BT_FLUSHABLE	8
@@ -82,6 +83,7 @@ struct set_opts {
 };
 
 struct connect {
+	GIOChannel *io;
 	BtIOConnect connect;
 	gpointer user_data;
 	GDestroyNotify destroy;
@@ -153,6 +155,7 @@ static void connect_remove(struct connect *conn)
 {
 	if (conn->destroy)
 		conn->destroy(conn->user_data);
+	g_io_channel_unref(conn->io);
 	g_free(conn);
 }
 
@@ -207,20 +210,18 @@ static gboolean accept_cb(GIOChannel *io, GIOCondition cond,
 	return FALSE;
 }
 
-static gboolean connect_cb(GIOChannel *io, GIOCondition cond,
-							gpointer user_data)
+static gboolean connect_cb(int sock, GIOCondition cond, gpointer user_data)
 {
 	struct connect *conn = user_data;
+	GIOChannel *io = conn->io;
 	GError *gerr = NULL;
-	int err, sk_err, sock;
+	int err, sk_err;
 	socklen_t len = sizeof(sk_err);
 
 	/* If the user aborted this connect attempt */
 	if ((cond & G_IO_NVAL) || check_nval(io))
 		return FALSE;
 
-	sock = g_io_channel_unix_get_fd(io);
-
 	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &sk_err, &len) < 0)
 		err = -errno;
 	else
@@ -286,20 +287,23 @@ static void server_add(GIOChannel *io, BtIOConnect connect,
 					(GDestroyNotify) server_remove);
 }
 
-static void connect_add(GIOChannel *io, BtIOConnect connect,
-				gpointer user_data, GDestroyNotify destroy)
+static void connect_add(GIOChannel *io, struct io_loop *loop,
+				BtIOConnect connect, gpointer user_data,
+				GDestroyNotify destroy)
 {
 	struct connect *conn;
 	GIOCondition cond;
 
 	conn = g_new0(struct connect, 1);
+	conn->io = g_io_channel_ref(io);
 	conn->connect = connect;
 	conn->user_data = user_data;
 	conn->destroy = destroy;
 
 	cond = G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, connect_cb, conn,
-					(GDestroyNotify) connect_remove);
+	io_loop_add_watch(loop, g_io_channel_unix_get_fd(io), cond,
+				connect_cb, conn,
+				(GDestroyNotify) connect_remove);
 }
 
 static void accept_add(GIOChannel *io, BtIOConnect connect, gpointer user_data,
@@ -1470,21 +1474,15 @@ failed:
 	return NULL;
 }
 
-GIOChannel *bt_io_connect(BtIOConnect connect, gpointer user_data,
-				GDestroyNotify destroy, GError **gerr,
-				BtIOOption opt1, ...)
+static GIOChannel *io_connect(struct io_loop *loop, BtIOConnect connect,
+				gpointer user_data, GDestroyNotify destroy,
+				GError **gerr, BtIOOption opt1, va_list args)
 {
 	GIOChannel *io;
-	va_list args;
 	struct set_opts opts;
 	int err, sock;
-	gboolean ret;
 
-	va_start(args, opt1);
-	ret = parse_set_opts(&opts, gerr, opt1, args);
-	va_end(args);
-
-	if (ret == FALSE)
+	if (parse_set_opts(&opts, gerr, opt1, args) == FALSE)
 		return NULL;
 
 	io = create_io(FALSE, &opts, gerr);
@@ -1516,7 +1514,37 @@ GIOChannel *bt_io_connect(BtIOConnect connect, gpointer user_data,
 		return NULL;
 	}
 
-	connect_add(io, connect, user_data, destroy);
+	connect_add(io, loop, connect, user_data, destroy);
+
+	return io;
+}
+
+GIOChannel *bt_io_connect(BtIOConnect connect, gpointer user_data,
+				GDestroyNotify destroy, GError **gerr,
+				BtIOOption opt1, ...)
+{
+	GIOChannel *io;
+	va_list args;
+
+	va_start(args, opt1);
+	io = io_connect(io_loop_default(), connect, user_data, destroy, gerr,
+								opt1, args);
+	va_end(args);
+
+	return io;
+}
+
+GIOChannel *bt_io_connect_with_loop(struct io_loop *loop,
+				BtIOConnect connect, gpointer user_data,
+				GDestroyNotify destroy, GError **gerr,
+				BtIOOption opt1, ...)
+{
+	GIOChannel *io;
+	va_list args;
+
+	va_start(args, opt1);
+	io = io_connect(loop, connect, user_data, destroy, gerr, opt1, args);
+	va_end(args);
 
 	return io;
 }
@@ -26,8 +26,10 @@
 #include <config.h>
 #endif
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <glib.h>
 #include <bluetooth/sdp.h>
 #include <bluetooth/sdp_lib.h>
@@ -191,8 +193,9 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 							gpointer user_data)
 {
 	struct discover_primary *dp = user_data;
-	struct att_data_list *list;
-	unsigned int i, err;
+	struct att_list_iter iter;
+	const uint8_t *data;
+	unsigned int err;
 	uint16_t start, end;
 
 	if (status) {
@@ -200,24 +203,23 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		goto done;
 	}
 
-	list = dec_read_by_grp_resp(ipdu, iplen);
-	if (list == NULL) {
+	if (dec_read_by_grp_resp_iter(ipdu, iplen, &iter) == 0) {
 		err = ATT_ECODE_IO;
 		goto done;
 	}
 
-	for (i = 0, end = 0; i < list->num; i++) {
-		const uint8_t *data = list->data[i];
+	end = 0;
+	while ((data = att_list_iter_next(&iter))) {
 		struct gatt_primary *primary;
 		bt_uuid_t uuid;
 
 		start = att_get_u16(&data[0]);
 		end = att_get_u16(&data[2]);
 
-		if (list->len == 6) {
+		if (iter.len == 6) {
 			bt_uuid_t uuid16 = att_get_uuid16(&data[4]);
 			bt_uuid_to_uuid128(&uuid16, &uuid);
-		} else if (list->len == 20) {
+		} else if (iter.len == 20) {
 			uuid = att_get_uuid128(&data[4]);
 		} else {
 			/* Skipping invalid data */
@@ -226,7 +228,6 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 
 		primary = g_try_new0(struct gatt_primary, 1);
 		if (!primary) {
-			att_data_list_free(list);
 			err = ATT_ECODE_INSUFF_RESOURCES;
 			goto done;
 		}
@@ -236,7 +237,6 @@ static void primary_all_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		dp->primaries = g_slist_append(dp->primaries, primary);
 	}
 
-	att_data_list_free(list);
 	err = 0;
 
 	if (end != 0xffff) {
@@ -338,9 +338,11 @@ static guint resolve_included_uuid(struct included_discovery *isd,
 				resolve_included_uuid_cb, query, NULL);
 }
 
-static struct gatt_included *included_from_buf(const uint8_t *buf, gsize len)
+/* An entry of 8 bytes carries a 16 bit UUID, one of 6 leaves it empty */
+static void included_parse(const uint8_t *buf, gsize len,
+						struct gatt_included *incl)
 {
-	struct gatt_included *incl = g_new0(struct gatt_included, 1);
+	memset(incl, 0, sizeof(*incl));
 
 	incl->handle = att_get_u16(&buf[0]);
 	incl->range.start = att_get_u16(&buf[2]);
@@ -353,6 +355,13 @@ static struct gatt_included *included_from_buf(const uint8_t *buf, gsize len)
 		bt_uuid_to_uuid128(&uuid16, &uuid128);
 		bt_uuid_to_string(&uuid128, incl->uuid, sizeof(incl->uuid));
 	}
+}
+
+static struct gatt_included *included_from_buf(const uint8_t *buf, gsize len)
+{
+	struct gatt_included *incl = g_new0(struct gatt_included, 1);
+
+	included_parse(buf, len, incl);
 
 	return incl;
 }
@@ -381,8 +390,8 @@ static void find_included_cb(uint8_t status, const uint8_t *pdu, uint16_t len,
 	struct included_discovery *isd = user_data;
 	uint16_t last_handle = isd->end_handle;
 	unsigned int err = status;
-	struct att_data_list *list;
-	int i;
+	struct att_list_iter iter;
+	const uint8_t *data;
 
 	if (err == ATT_ECODE_ATTR_NOT_FOUND)
 		err = 0;
@@ -390,26 +399,24 @@ static void find_included_cb(uint8_t status, const uint8_t *pdu, uint16_t len,
 	if (status)
 		goto done;
 
-	list = dec_read_by_type_resp(pdu, len);
-	if (list == NULL) {
+	if (dec_read_by_type_resp_iter(pdu, len, &iter) == 0) {
 		err = ATT_ECODE_IO;
 		goto done;
 	}
 
-	if (list->len != 6 && list->len != 8) {
+	if (iter.len != 6 && iter.len != 8) {
 		err = ATT_ECODE_IO;
-		att_data_list_free(list);
 		goto done;
 	}
 
-	for (i = 0; i < list->num; i++) {
+	while ((data = att_list_iter_next(&iter))) {
 		struct gatt_included *incl;
 
-		incl = included_from_buf(list->data[i], list->len);
+		incl = included_from_buf(data, iter.len);
 		last_handle = incl->handle;
 
 		/* 128 bit UUID, needs resolving */
-		if (list->len == 6) {
+		if (iter.len == 6) {
 			resolve_included_uuid(isd, incl);
 			continue;
 		}
@@ -417,8 +424,6 @@ static void find_included_cb(uint8_t status, const uint8_t *pdu, uint16_t len,
 		isd->includes = g_slist_append(isd->includes, incl);
 	}
 
-	att_data_list_free(list);
-
 	if (last_handle < isd->end_handle)
 		find_included(isd, last_handle + 1);
 
@@ -445,8 +450,9 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 							gpointer user_data)
 {
 	struct discover_char *dc = user_data;
-	struct att_data_list *list;
-	unsigned int i, err = ATT_ECODE_ATTR_NOT_FOUND;
+	struct att_list_iter iter;
+	const uint8_t *value;
+	unsigned int err = ATT_ECODE_ATTR_NOT_FOUND;
 	uint16_t last = 0;
 
 	if (status) {
@@ -454,20 +460,19 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 		goto done;
 	}
 
-	list = dec_read_by_type_resp(ipdu, iplen);
-	if (list == NULL) {
+	if (dec_read_by_type_resp_iter(ipdu, iplen, &iter) == 0 ||
+				(iter.len != 7 && iter.len != 21)) {
 		err = ATT_ECODE_IO;
 		goto done;
 	}
 
-	for (i = 0; i < list->num; i++) {
-		uint8_t *value = list->data[i];
+	while ((value = att_list_iter_next(&iter))) {
 		struct gatt_char *chars;
 		bt_uuid_t uuid;
 
 		last = att_get_u16(value);
 
-		if (list->len == 7) {
+		if (iter.len == 7) {
 			bt_uuid_t uuid16 = att_get_uuid16(&value[5]);
 			bt_uuid_to_uuid128(&uuid16, &uuid);
 		} else
@@ -490,8 +495,6 @@ static void char_discovered_cb(guint8 status, const guint8 *ipdu, guint16 iplen,
 									chars);
 	}
 
-	att_data_list_free(list);
-
 	if (last != 0 && (last + 1 < dc->end)) {
 		bt_uuid_t uuid;
 		guint16 oplen;
@@ -571,7 +574,9 @@ struct read_long_data {
 	GAttribResultFunc func;
 	gpointer user_data;
 	guint8 *buffer;
+	size_t capacity;
 	guint16 size;
+	guint16 hint;		/* expected value length, 0 if unknown */
 	guint16 handle;
 	guint id;
 	int ref;
@@ -590,13 +595,46 @@ static void read_long_destroy(gpointer user_data)
 	g_free(long_read);
 }
 
+/*
+ * Makes room for len more octets. The buffer at least doubles, so every
+ * octet of a long read is copied a constant number of times.
+ */
+static gboolean read_long_reserve(struct read_long_data *long_read,
+								size_t len)
+{
+	size_t need = long_read->size + len;
+	size_t capacity = long_read->capacity;
+	guint8 *tmp;
+
+	if (need <= capacity)
+		return TRUE;
+
+	/* The whole value is handed out with a guint16 length */
+	if (need > G_MAXUINT16)
+		return FALSE;
+
+	while (capacity < need)
+		capacity *= 2;
+
+	if (capacity > G_MAXUINT16)
+		capacity = G_MAXUINT16;
+
+	tmp = g_try_realloc(long_read->buffer, capacity);
+	if (tmp == NULL)
+		return FALSE;
+
+	long_read->buffer = tmp;
+	long_read->capacity = capacity;
+
+	return TRUE;
+}
+
 static void read_blob_helper(guint8 status, const guint8 *rpdu, guint16 rlen,
 							gpointer user_data)
 {
 	struct read_long_data *long_read = user_data;
 	uint8_t *buf;
 	size_t buflen;
-	guint8 *tmp;
 	guint16 plen;
 	guint id;
 
@@ -605,15 +643,12 @@ static void read_blob_helper(guint8 status, const guint8 *rpdu, guint16 rlen,
 		goto done;
 	}
 
-	tmp = g_try_realloc(long_read->buffer, long_read->size + rlen - 1);
-
-	if (tmp == NULL) {
+	if (!read_long_reserve(long_read, rlen - 1)) {
 		status = ATT_ECODE_INSUFF_RESOURCES;
 		goto done;
 	}
 
-	memcpy(&tmp[long_read->size], &rpdu[1], rlen - 1);
-	long_read->buffer = tmp;
+	memcpy(&long_read->buffer[long_read->size], &rpdu[1], rlen - 1);
 	long_read->size += rlen - 1;
 
 	buf = g_attrib_get_buffer(long_read->attrib, &buflen);
@@ -649,7 +684,9 @@ static void read_char_helper(guint8 status, const guint8 *rpdu,
 	if (status != 0 || rlen < buflen)
 		goto done;
 
-	long_read->buffer = g_malloc(rlen);
+	/* The opcode stays in front, as in a value read in one go */
+	long_read->capacity = MAX((size_t) long_read->hint + 1, 2 * rlen);
+	long_read->buffer = g_try_malloc(long_read->capacity);
 	if (long_read->buffer == NULL) {
 		status = ATT_ECODE_INSUFF_RESOURCES;
 		goto done;
@@ -675,6 +712,12 @@ done:
 
 guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 							gpointer user_data)
+{
+	return gatt_read_long_char(attrib, handle, 0, func, user_data);
+}
+
+guint gatt_read_long_char(GAttrib *attrib, uint16_t handle, uint16_t hint,
+				GAttribResultFunc func, gpointer user_data)
 {
 	uint8_t *buf;
 	size_t buflen;
@@ -691,6 +734,7 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 	long_read->func = func;
 	long_read->user_data = user_data;
 	long_read->handle = handle;
+	long_read->hint = MIN(hint, G_MAXUINT16 - 1);
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 	plen = enc_read_req(handle, buf, buflen);
@@ -706,16 +750,164 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 	return id;
 }
 
-struct write_long_data {
+struct read_multi_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
 	gpointer user_data;
-	guint16 handle;
-	uint16_t offset;
-	uint8_t *value;
-	size_t vlen;
+	uint16_t *handles;
+	uint16_t *lens;
+	guint8 *buffer;		/* a Read Multiple Response of all values */
+	guint16 size;
+	guint16 n;
+	guint16 next;		/* first handle of the request in flight */
+	guint16 count;		/* handles it reads */
+	guint16 expect;		/* octets it reads */
+	guint id;
+	int ref;
 };
 
+static void read_multi_destroy(gpointer user_data)
+{
+	struct read_multi_data *multi = user_data;
+
+	if (__sync_sub_and_fetch(&multi->ref, 1) > 0)
+		return;
+
+	g_free(multi);
+}
+
+/* As many handles from next on as both request and response fit mtu */
+static void read_multi_split(struct read_multi_data *multi, size_t mtu)
+{
+	multi->count = 0;
+	multi->expect = 0;
+
+	while (multi->next + multi->count < multi->n) {
+		uint16_t vlen = multi->lens[multi->next + multi->count];
+
+		if (1 + 2 * (multi->count + 1) > mtu ||
+					1 + multi->expect + vlen > mtu)
+			break;
+
+		multi->expect += vlen;
+		multi->count++;
+	}
+}
+
+static void read_multi_helper(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data);
+
+static guint read_multi_send(struct read_multi_data *multi)
+{
+	uint8_t *buf;
+	size_t buflen;
+	guint16 plen;
+	guint id;
+
+	buf = g_attrib_get_buffer(multi->attrib, &buflen);
+	read_multi_split(multi, buflen);
+
+	/* Read Multiple takes two handles at least */
+	if (multi->count == 1)
+		plen = enc_read_req(multi->handles[multi->next], buf, buflen);
+	else
+		plen = enc_read_multi_req(&multi->handles[multi->next],
+						multi->count, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	id = g_attrib_send(multi->attrib, multi->id, buf, plen,
+				read_multi_helper, multi, read_multi_destroy);
+	if (id != 0)
+		__sync_fetch_and_add(&multi->ref, 1);
+
+	return id;
+}
+
+static void read_multi_helper(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data)
+{
+	struct read_multi_data *multi = user_data;
+
+	if (status != 0) {
+		multi->func(status, rpdu, rlen, multi->user_data);
+		return;
+	}
+
+	/* The values are told apart by length only */
+	if (rlen != multi->expect + 1) {
+		status = ATT_ECODE_INVALID_PDU;
+		goto done;
+	}
+
+	memcpy(&multi->buffer[multi->size], &rpdu[1], multi->expect);
+	multi->size += multi->expect;
+	multi->next += multi->count;
+
+	if (multi->next == multi->n)
+		goto done;
+
+	if (read_multi_send(multi) != 0)
+		return;
+
+	status = ATT_ECODE_IO;
+
+done:
+	multi->func(status, multi->buffer, multi->size, multi->user_data);
+}
+
+guint gatt_read_multi(GAttrib *attrib, const uint16_t *handles,
+				const uint16_t *lens, guint16 n,
+				GAttribResultFunc func, gpointer user_data)
+{
+	struct read_multi_data *multi;
+	size_t buflen, total = 1;
+	guint16 i;
+	guint id;
+
+	if (attrib == NULL || n == 0)
+		return 0;
+
+	g_attrib_get_buffer(attrib, &buflen);
+
+	for (i = 0; i < n; i++) {
+		if (1 + (size_t) lens[i] > buflen)
+			return 0;
+		total += lens[i];
+	}
+
+	if (total > G_MAXUINT16)
+		return 0;
+
+	/* The handles, lengths and values come with it */
+	multi = g_try_malloc0(sizeof(*multi) + 2 * n * sizeof(uint16_t) +
+									total);
+	if (multi == NULL)
+		return 0;
+
+	multi->attrib = attrib;
+	multi->func = func;
+	multi->user_data = user_data;
+	multi->handles = (uint16_t *) (multi + 1);
+	multi->lens = multi->handles + n;
+	multi->buffer = (guint8 *) (multi->lens + n);
+	multi->n = n;
+
+	memcpy(multi->handles, handles, n * sizeof(uint16_t));
+	memcpy(multi->lens, lens, n * sizeof(uint16_t));
+
+	multi->buffer[0] = ATT_OP_READ_MULTI_RESP;
+	multi->size = 1;
+
+	id = read_multi_send(multi);
+	if (id == 0)
+		g_free(multi);
+	else
+		multi->id = id;
+
+	return id;
+}
+
 static guint execute_write(GAttrib *attrib, uint8_t flags,
 				GAttribResultFunc func, gpointer user_data)
 {
@@ -731,50 +923,247 @@ static guint execute_write(GAttrib *attrib, uint8_t flags,
 	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
 }
 
-static guint prepare_write(struct write_long_data *long_write);
+/*
+ * A long write keeps up to window Prepare Write Requests queued, so the
+ * next one goes out as soon as the response to the last is in. ATT allows
+ * one request at a time, responses come back in order, and the ring of
+ * ids and lengths below follows the requests from head to head + pending.
+ */
+struct gatt_long_write {
+	GAttrib *attrib;
+	GAttribResultFunc func;
+	gatt_write_progress_t progress;
+	gpointer user_data;
+	uint8_t *value;
+	size_t vlen;
+	size_t sent;		/* octets queued */
+	size_t acked;		/* octets echoed back intact */
+	guint16 handle;
+	guint window;
+	guint head;
+	guint pending;
+	guint *ids;
+	uint16_t *lens;
+	guint exec_id;		/* the Execute Write, once all are in */
+	bool in_progress;	/* progress may abort, see below */
+	bool aborted;
+	bool finished;		/* func is running, aborting is too late */
+};
+
+static void write_long_free(struct gatt_long_write *long_write)
+{
+	g_attrib_unref(long_write->attrib);
+	g_free(long_write);
+}
+
+/* Drops the queued requests and whatever the server prepared so far */
+static void write_long_stop(struct gatt_long_write *long_write)
+{
+	guint i;
+
+	for (i = 0; i < long_write->pending; i++) {
+		guint slot = (long_write->head + i) % long_write->window;
+
+		g_attrib_cancel(long_write->attrib, long_write->ids[slot]);
+	}
+
+	long_write->pending = 0;
+
+	/* Still queued it is dropped, on air the peer may commit anyway */
+	if (long_write->exec_id)
+		g_attrib_cancel(long_write->attrib, long_write->exec_id);
+	long_write->exec_id = 0;
+
+	execute_write(long_write->attrib, ATT_CANCEL_ALL_PREP_WRITES, NULL,
+									NULL);
+}
+
+static void write_long_finish(struct gatt_long_write *long_write,
+				guint8 status, const guint8 *rpdu, guint16 rlen)
+{
+	long_write->finished = true;
+
+	if (long_write->func)
+		long_write->func(status, rpdu, rlen, long_write->user_data);
+
+	write_long_free(long_write);
+}
+
+static void write_long_fail(struct gatt_long_write *long_write,
+				guint8 status, const guint8 *rpdu, guint16 rlen)
+{
+	write_long_stop(long_write);
+	write_long_finish(long_write, status, rpdu, rlen);
+}
+
+static void execute_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data)
+{
+	struct gatt_long_write *long_write = user_data;
+
+	long_write->exec_id = 0;
+	write_long_finish(long_write, status, rpdu, rlen);
+}
+
+static void prepare_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
+							gpointer user_data);
+
+static gboolean prepare_write(struct gatt_long_write *long_write)
+{
+	guint slot = (long_write->head + long_write->pending) %
+							long_write->window;
+	size_t buflen, vlen = long_write->vlen - long_write->sent;
+	uint8_t *buf;
+	guint16 plen;
+	guint id;
+
+	buf = g_attrib_get_buffer(long_write->attrib, &buflen);
+
+	plen = enc_prep_write_req(long_write->handle, long_write->sent,
+					long_write->value + long_write->sent,
+					vlen, buf, buflen);
+	if (plen == 0)
+		return FALSE;
+
+	/* Long writes must not hold up short control writes */
+	id = g_attrib_send_with_priority(long_write->attrib, 0, buf, plen,
+					G_ATTRIB_PRIORITY_BULK,
+					prepare_write_cb, long_write, NULL);
+	if (id == 0)
+		return FALSE;
+
+	long_write->ids[slot] = id;
+	long_write->lens[slot] = plen - 5;
+	long_write->sent += plen - 5;
+	long_write->pending++;
+
+	return TRUE;
+}
+
+static gboolean prepare_write_fill(struct gatt_long_write *long_write)
+{
+	while (long_write->pending < long_write->window &&
+				long_write->sent < long_write->vlen) {
+		if (!prepare_write(long_write))
+			return FALSE;
+	}
+
+	return TRUE;
+}
 
 static void prepare_write_cb(guint8 status, const guint8 *rpdu, guint16 rlen,
 							gpointer user_data)
 {
-	struct write_long_data *long_write = user_data;
+	struct gatt_long_write *long_write = user_data;
+	uint8_t value[ATT_MAX_VALUE_LEN];
+	uint16_t handle, offset, len;
+	size_t vlen;
+
+	len = long_write->lens[long_write->head];
+	long_write->head = (long_write->head + 1) % long_write->window;
+	long_write->pending--;
 
 	if (status != 0) {
-		long_write->func(status, rpdu, rlen, long_write->user_data);
+		write_long_fail(long_write, status, rpdu, rlen);
 		return;
 	}
 
-	/* Skip Prepare Write Response PDU header (5 bytes) */
-	long_write->offset += rlen - 5;
+	/* The server echoes what it queued, which must be what was sent */
+	if (rlen > 5 + sizeof(value) || dec_prep_write_resp(rpdu, rlen, &handle,
+					&offset, value, &vlen) == 0 ||
+			handle != long_write->handle ||
+			offset != long_write->acked || vlen != len ||
+			memcmp(value, long_write->value + offset, len) != 0) {
+		write_long_fail(long_write, ATT_ECODE_UNLIKELY, rpdu, rlen);
+		return;
+	}
+
+	long_write->acked += len;
 
-	if (long_write->offset == long_write->vlen) {
-		execute_write(long_write->attrib, ATT_WRITE_ALL_PREP_WRITES,
-				long_write->func, long_write->user_data);
-		g_free(long_write->value);
-		g_free(long_write);
+	if (long_write->progress) {
+		long_write->in_progress = true;
+		long_write->progress(long_write->acked, long_write->vlen,
+							long_write->user_data);
+		long_write->in_progress = false;
+
+		if (long_write->aborted) {
+			write_long_free(long_write);
+			return;
+		}
+	}
 
+	if (long_write->acked < long_write->vlen) {
+		if (!prepare_write_fill(long_write))
+			write_long_fail(long_write, ATT_ECODE_IO, NULL, 0);
 		return;
 	}
 
-	prepare_write(long_write);
+	/* Kept until the response, so it can still be aborted */
+	long_write->exec_id = execute_write(long_write->attrib,
+						ATT_WRITE_ALL_PREP_WRITES,
+						execute_write_cb, long_write);
+	if (long_write->exec_id == 0)
+		write_long_finish(long_write, ATT_ECODE_IO, NULL, 0);
 }
 
-static guint prepare_write(struct write_long_data *long_write)
+struct gatt_long_write *gatt_write_long_char(GAttrib *attrib, uint16_t handle,
+				const uint8_t *value, size_t vlen,
+				guint window, gatt_write_progress_t progress,
+				GAttribResultFunc func, gpointer user_data)
 {
-	GAttrib *attrib = long_write->attrib;
-	uint16_t handle = long_write->handle;
-	uint16_t offset = long_write->offset;
-	uint8_t *buf, *value = long_write->value + offset;
-	size_t buflen, vlen = long_write->vlen - offset;
-	guint16 plen;
+	struct gatt_long_write *long_write;
 
-	buf = g_attrib_get_buffer(attrib, &buflen);
+	/* Every offset has to fit the 16 bit field */
+	if (attrib == NULL || vlen == 0 || vlen > G_MAXUINT16)
+		return NULL;
 
-	plen = enc_prep_write_req(handle, offset, value, vlen, buf, buflen);
-	if (plen == 0)
-		return 0;
+	if (window == 0)
+		window = GATT_WRITE_WINDOW;
 
-	return g_attrib_send(attrib, 0, buf, plen, prepare_write_cb, long_write,
-									NULL);
+	/* The ring and a copy of the value come with it */
+	long_write = g_try_malloc0(sizeof(*long_write) +
+				window * (sizeof(guint) + sizeof(uint16_t)) +
+				vlen);
+	if (long_write == NULL)
+		return NULL;
+
+	long_write->attrib = g_attrib_ref(attrib);
+	long_write->func = func;
+	long_write->progress = progress;
+	long_write->user_data = user_data;
+	long_write->handle = handle;
+	long_write->window = window;
+	long_write->ids = (guint *) (long_write + 1);
+	long_write->lens = (uint16_t *) (long_write->ids + window);
+	long_write->value = (uint8_t *) (long_write->lens + window);
+	long_write->vlen = vlen;
+
+	memcpy(long_write->value, value, vlen);
+
+	if (!prepare_write_fill(long_write)) {
+		long_write->func = NULL;
+		write_long_fail(long_write, ATT_ECODE_IO, NULL, 0);
+		return NULL;
+	}
+
+	return long_write;
+}
+
+void gatt_write_long_abort(struct gatt_long_write *long_write)
+{
+	/* Freed once func returns */
+	if (long_write == NULL || long_write->finished)
+		return;
+
+	write_long_stop(long_write);
+
+	/* Freed by prepare_write_cb() once progress returns */
+	if (long_write->in_progress) {
+		long_write->aborted = true;
+		return;
+	}
+
+	write_long_free(long_write);
 }
 
 guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
@@ -782,7 +1171,7 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 {
 	uint8_t *buf;
 	size_t buflen;
-	struct write_long_data *long_write;
+	struct gatt_long_write *long_write;
 
 	buf = g_attrib_get_buffer(attrib, &buflen);
 
@@ -800,18 +1189,12 @@ guint gatt_write_char(GAttrib *attrib, uint16_t handle, uint8_t *value,
 	}
 
 	/* Write Long Characteristic Values */
-	long_write = g_try_new0(struct write_long_data, 1);
+	long_write = gatt_write_long_char(attrib, handle, value, vlen, 0, NULL,
+							func, user_data);
 	if (long_write == NULL)
 		return 0;
 
-	long_write->attrib = attrib;
-	long_write->func = func;
-	long_write->user_data = user_data;
-	long_write->handle = handle;
-	long_write->value = g_memdup(value, vlen);
-	long_write->vlen = vlen;
-
-	return prepare_write(long_write);
+	return long_write->ids[long_write->head];
 }
 
 guint gatt_exchange_mtu(GAttrib *attrib, uint16_t mtu, GAttribResultFunc func,
@@ -853,6 +1236,512 @@ guint gatt_write_cmd(GAttrib *attrib, uint16_t handle, uint8_t *value, int vlen,
 	return g_attrib_send(attrib, 0, buf, plen, NULL, user_data, notify);
 }
 
+/*
+ * gatt_discover_all() runs the services, included services and
+ * characteristics chains side by side over the whole handle range, each
+ * queueing its next request as soon as a response came in. Descriptors
+ * are looked for only between a characteristic value and the next
+ * declaration, or the end of its service, and those requests are queued
+ * the moment both ends are known. The bearer thus always has a request
+ * waiting, and independent ones spread over additional bearers.
+ */
+enum {
+	DISC_SERVICES,
+	DISC_INCLUDES,
+	DISC_INCLUDE_UUID,
+	DISC_CHARS,
+	DISC_DESCS,
+};
+
+struct gatt_discovery {
+	GAttrib *attrib;
+	gatt_db_cb_t cb;
+	gpointer user_data;
+	GArray *services;
+	GArray *includes;
+	GArray *chars;
+	GArray *descs;
+	GQueue reqs;		/* requests in flight */
+	bool services_done;
+	bool chars_done;
+	guint next_gap;		/* first characteristic not looked after */
+	guint8 status;
+};
+
+struct discovery_req {
+	struct gatt_discovery *disc;	/* NULL once cancelled */
+	guint id;
+	uint8_t type;
+	uint16_t end;			/* of the range it covers */
+	guint index;			/* included service it resolves */
+};
+
+static void discovery_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data);
+
+static bool discovery_send(struct gatt_discovery *disc, uint8_t type,
+				uint16_t start, uint16_t end, guint index)
+{
+	struct discovery_req *req;
+	size_t buflen;
+	uint8_t *buf = g_attrib_get_buffer(disc->attrib, &buflen);
+	bt_uuid_t uuid;
+	guint16 plen;
+
+	switch (type) {
+	case DISC_SERVICES:
+		bt_uuid16_create(&uuid, GATT_PRIM_SVC_UUID);
+		plen = enc_read_by_grp_req(start, end, &uuid, buf, buflen);
+		break;
+	case DISC_INCLUDES:
+		bt_uuid16_create(&uuid, GATT_INCLUDE_UUID);
+		plen = enc_read_by_type_req(start, end, &uuid, buf, buflen);
+		break;
+	case DISC_INCLUDE_UUID:
+		plen = enc_read_req(start, buf, buflen);
+		break;
+	case DISC_CHARS:
+		bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
+		plen = enc_read_by_type_req(start, end, &uuid, buf, buflen);
+		break;
+	default:
+		plen = enc_find_info_req(start, end, buf, buflen);
+		break;
+	}
+
+	if (plen == 0)
+		return false;
+
+	req = g_new0(struct discovery_req, 1);
+	req->disc = disc;
+	req->type = type;
+	req->end = end;
+	req->index = index;
+
+	req->id = g_attrib_send(disc->attrib, 0, buf, plen, discovery_cb, req,
+								g_free);
+	if (req->id == 0) {
+		g_free(req);
+		return false;
+	}
+
+	g_queue_push_tail(&disc->reqs, req);
+
+	return true;
+}
+
+static void discovery_free(struct gatt_discovery *disc)
+{
+	g_array_free(disc->services, TRUE);
+	g_array_free(disc->includes, TRUE);
+	g_array_free(disc->chars, TRUE);
+	g_array_free(disc->descs, TRUE);
+	g_attrib_unref(disc->attrib);
+	g_free(disc);
+}
+
+void gatt_discover_all_cancel(struct gatt_discovery *disc)
+{
+	struct discovery_req *req;
+
+	if (disc == NULL)
+		return;
+
+	/* Their callbacks won't run, the GAttrib frees them */
+	while ((req = g_queue_pop_head(&disc->reqs))) {
+		req->disc = NULL;
+		g_attrib_cancel(disc->attrib, req->id);
+	}
+
+	discovery_free(disc);
+}
+
+static gint desc_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct gatt_desc *da = a, *db = b;
+
+	return (gint) da->handle - (gint) db->handle;
+}
+
+static size_t db_align(size_t size)
+{
+	return (size + 7) & ~(size_t) 7;
+}
+
+/* The database and its entries come in one block, see gatt_db_free() */
+static struct gatt_db *db_flatten(struct gatt_discovery *disc)
+{
+	GArray *arrays[] = { disc->services, disc->includes, disc->chars,
+								disc->descs };
+	const size_t sizes[] = { sizeof(struct gatt_primary),
+				sizeof(struct gatt_included),
+				sizeof(struct gatt_char),
+				sizeof(struct gatt_desc) };
+	void *bases[G_N_ELEMENTS(arrays)];
+	struct gatt_db *db;
+	size_t size, offsets[G_N_ELEMENTS(arrays)];
+	uint8_t *block;
+	unsigned int i;
+
+	g_array_sort(disc->descs, desc_cmp);
+
+	size = db_align(sizeof(*db));
+	for (i = 0; i < G_N_ELEMENTS(arrays); i++) {
+		offsets[i] = size;
+		size += db_align(arrays[i]->len * sizes[i]);
+	}
+
+	block = g_try_malloc0(size);
+	if (block == NULL)
+		return NULL;
+
+	for (i = 0; i < G_N_ELEMENTS(arrays); i++) {
+		bases[i] = block + offsets[i];
+		memcpy(bases[i], arrays[i]->data, arrays[i]->len * sizes[i]);
+	}
+
+	db = (struct gatt_db *) block;
+	db->services = bases[0];
+	db->n_services = disc->services->len;
+	db->includes = bases[1];
+	db->n_includes = disc->includes->len;
+	db->chars = bases[2];
+	db->n_chars = disc->chars->len;
+	db->descs = bases[3];
+	db->n_descs = disc->descs->len;
+
+	return db;
+}
+
+void gatt_db_free(struct gatt_db *db)
+{
+	g_free(db);
+}
+
+static void discovery_finish(struct gatt_discovery *disc)
+{
+	gatt_db_cb_t cb = disc->cb;
+	gpointer user_data = disc->user_data;
+	struct gatt_db *db = NULL;
+	guint8 status = disc->status;
+
+	if (status == 0) {
+		db = db_flatten(disc);
+		if (db == NULL)
+			status = ATT_ECODE_INSUFF_RESOURCES;
+	}
+
+	/* Stops whatever is still in flight after an error */
+	gatt_discover_all_cancel(disc);
+
+	cb(db, status, user_data);
+}
+
+static void discovery_fail(struct gatt_discovery *disc, guint8 status)
+{
+	if (disc->status == 0)
+		disc->status = status;
+}
+
+/* The last handle of the service holding handle */
+static uint16_t service_end(struct gatt_discovery *disc, uint16_t handle)
+{
+	guint i;
+
+	for (i = 0; i < disc->services->len; i++) {
+		struct gatt_primary *prim = &g_array_index(disc->services,
+						struct gatt_primary, i);
+
+		if (prim->range.start <= handle && handle <= prim->range.end)
+			return prim->range.end;
+	}
+
+	return 0xffff;
+}
+
+/*
+ * Queues a descriptor search behind every characteristic whose range is
+ * known: up to the next declaration found, clipped to its service.
+ */
+static void schedule_descs(struct gatt_discovery *disc)
+{
+	struct gatt_char *chr, *next;
+	uint16_t start, end;
+
+	if (!disc->services_done)
+		return;
+
+	for (; disc->next_gap < disc->chars->len; disc->next_gap++) {
+		chr = &g_array_index(disc->chars, struct gatt_char,
+							disc->next_gap);
+
+		if (disc->next_gap + 1 < disc->chars->len) {
+			next = &g_array_index(disc->chars, struct gatt_char,
+							disc->next_gap + 1);
+			end = next->handle - 1;
+		} else if (disc->chars_done)
+			end = 0xffff;
+		else
+			break;
+
+		start = chr->value_handle + 1;
+		end = MIN(end, service_end(disc, chr->value_handle));
+
+		if (chr->value_handle == 0xffff || start > end)
+			continue;
+
+		if (!discovery_send(disc, DISC_DESCS, start, end, 0))
+			discovery_fail(disc, ATT_ECODE_IO);
+	}
+}
+
+static void services_found(struct gatt_discovery *disc, const uint8_t *pdu,
+								guint16 len)
+{
+	struct att_list_iter iter;
+	struct gatt_primary prim;
+	const uint8_t *data;
+	uint16_t last = 0;
+	bt_uuid_t uuid;
+
+	if (dec_read_by_grp_resp_iter(pdu, len, &iter) == 0 ||
+				(iter.len != 6 && iter.len != 20)) {
+		discovery_fail(disc, ATT_ECODE_IO);
+		return;
+	}
+
+	while ((data = att_list_iter_next(&iter))) {
+		memset(&prim, 0, sizeof(prim));
+		prim.range.start = att_get_u16(&data[0]);
+		prim.range.end = att_get_u16(&data[2]);
+
+		if (iter.len == 6) {
+			bt_uuid_t uuid16 = att_get_uuid16(&data[4]);
+
+			bt_uuid_to_uuid128(&uuid16, &uuid);
+		} else
+			uuid = att_get_uuid128(&data[4]);
+
+		bt_uuid_to_string(&uuid, prim.uuid, sizeof(prim.uuid));
+		g_array_append_val(disc->services, prim);
+
+		last = prim.range.end;
+	}
+
+	if (last == 0xffff || last == 0)
+		disc->services_done = true;
+	else if (!discovery_send(disc, DISC_SERVICES, last + 1, 0xffff, 0))
+		discovery_fail(disc, ATT_ECODE_IO);
+}
+
+static void includes_found(struct gatt_discovery *disc, const uint8_t *pdu,
+								guint16 len)
+{
+	struct att_list_iter iter;
+	struct gatt_included incl;
+	const uint8_t *data;
+	uint16_t last = 0;
+
+	if (dec_read_by_type_resp_iter(pdu, len, &iter) == 0 ||
+				(iter.len != 6 && iter.len != 8)) {
+		discovery_fail(disc, ATT_ECODE_IO);
+		return;
+	}
+
+	while ((data = att_list_iter_next(&iter))) {
+		included_parse(data, iter.len, &incl);
+		g_array_append_val(disc->includes, incl);
+		last = incl.handle;
+
+		/* 128 bit UUID, read from the included service */
+		if (iter.len == 6 && !discovery_send(disc, DISC_INCLUDE_UUID,
+						incl.range.start, 0,
+						disc->includes->len - 1))
+			discovery_fail(disc, ATT_ECODE_IO);
+	}
+
+	if (last != 0xffff && !discovery_send(disc, DISC_INCLUDES, last + 1,
+								0xffff, 0))
+		discovery_fail(disc, ATT_ECODE_IO);
+}
+
+static void include_uuid_found(struct gatt_discovery *disc, guint index,
+					const uint8_t *pdu, guint16 len)
+{
+	struct gatt_included *incl;
+	uint8_t value[16];
+	bt_uuid_t uuid;
+
+	if (dec_read_resp(pdu, len, value, sizeof(value)) != 16) {
+		discovery_fail(disc, ATT_ECODE_IO);
+		return;
+	}
+
+	incl = &g_array_index(disc->includes, struct gatt_included, index);
+	uuid = att_get_uuid128(value);
+	bt_uuid_to_string(&uuid, incl->uuid, sizeof(incl->uuid));
+}
+
+static void chars_found(struct gatt_discovery *disc, const uint8_t *pdu,
+								guint16 len)
+{
+	struct att_list_iter iter;
+	struct gatt_char chr;
+	const uint8_t *data;
+	uint16_t last = 0;
+	bt_uuid_t uuid;
+
+	if (dec_read_by_type_resp_iter(pdu, len, &iter) == 0 ||
+				(iter.len != 7 && iter.len != 21)) {
+		discovery_fail(disc, ATT_ECODE_IO);
+		return;
+	}
+
+	/* Keep the bearer busy, the entries can wait */
+	data = iter.end - iter.len;
+	last = att_get_u16(data);
+	if (last == 0xffff)
+		disc->chars_done = true;
+	else if (!discovery_send(disc, DISC_CHARS, last + 1, 0xffff, 0))
+		discovery_fail(disc, ATT_ECODE_IO);
+
+	while ((data = att_list_iter_next(&iter))) {
+		memset(&chr, 0, sizeof(chr));
+		chr.handle = att_get_u16(&data[0]);
+		chr.properties = data[2];
+		chr.value_handle = att_get_u16(&data[3]);
+
+		if (iter.len == 7) {
+			bt_uuid_t uuid16 = att_get_uuid16(&data[5]);
+
+			bt_uuid_to_uuid128(&uuid16, &uuid);
+		} else
+			uuid = att_get_uuid128(&data[5]);
+
+		bt_uuid_to_string(&uuid, chr.uuid, sizeof(chr.uuid));
+		g_array_append_val(disc->chars, chr);
+	}
+}
+
+static void descs_found(struct gatt_discovery *disc, uint16_t end,
+					const uint8_t *pdu, guint16 len)
+{
+	struct att_list_iter iter;
+	struct gatt_desc desc;
+	const uint8_t *data;
+	uint16_t last = 0;
+	uint8_t format;
+	bt_uuid_t uuid;
+
+	if (dec_find_info_resp_iter(pdu, len, &format, &iter) == 0) {
+		discovery_fail(disc, ATT_ECODE_IO);
+		return;
+	}
+
+	while ((data = att_list_iter_next(&iter))) {
+		last = att_get_u16(data);
+
+		if (format == ATT_FIND_INFO_RESP_FMT_16BIT) {
+			bt_uuid_t uuid16 = att_get_uuid16(&data[2]);
+
+			/* Declarations past the last one, not descriptors */
+			if (uuid16.value.u16 >= GATT_PRIM_SVC_UUID &&
+					uuid16.value.u16 <= GATT_CHARAC_UUID)
+				continue;
+
+			bt_uuid_to_uuid128(&uuid16, &uuid);
+		} else
+			uuid = att_get_uuid128(&data[2]);
+
+		memset(&desc, 0, sizeof(desc));
+		desc.handle = last;
+		bt_uuid_to_string(&uuid, desc.uuid, sizeof(desc.uuid));
+		g_array_append_val(disc->descs, desc);
+	}
+
+	if (last < end && !discovery_send(disc, DISC_DESCS, last + 1, end, 0))
+		discovery_fail(disc, ATT_ECODE_IO);
+}
+
+static void discovery_cb(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct discovery_req *req = user_data;
+	struct gatt_discovery *disc = req->disc;
+
+	if (disc == NULL)
+		return;
+
+	g_queue_remove(&disc->reqs, req);
+
+	if (status == ATT_ECODE_ATTR_NOT_FOUND &&
+					req->type != DISC_INCLUDE_UUID) {
+		/* The chain reached the end of its range */
+		if (req->type == DISC_SERVICES)
+			disc->services_done = true;
+		else if (req->type == DISC_CHARS)
+			disc->chars_done = true;
+	} else if (status)
+		discovery_fail(disc, status);
+	else if (disc->status == 0) {
+		switch (req->type) {
+		case DISC_SERVICES:
+			services_found(disc, pdu, len);
+			break;
+		case DISC_INCLUDES:
+			includes_found(disc, pdu, len);
+			break;
+		case DISC_INCLUDE_UUID:
+			include_uuid_found(disc, req->index, pdu, len);
+			break;
+		case DISC_CHARS:
+			chars_found(disc, pdu, len);
+			break;
+		case DISC_DESCS:
+			descs_found(disc, req->end, pdu, len);
+			break;
+		}
+	}
+
+	if (disc->status == 0)
+		schedule_descs(disc);
+
+	if (disc->status != 0 || g_queue_is_empty(&disc->reqs))
+		discovery_finish(disc);
+}
+
+struct gatt_discovery *gatt_discover_all(GAttrib *attrib, gatt_db_cb_t func,
+							gpointer user_data)
+{
+	struct gatt_discovery *disc;
+
+	if (attrib == NULL || func == NULL)
+		return NULL;
+
+	disc = g_try_new0(struct gatt_discovery, 1);
+	if (disc == NULL)
+		return NULL;
+
+	disc->attrib = g_attrib_ref(attrib);
+	disc->cb = func;
+	disc->user_data = user_data;
+	disc->services = g_array_new(FALSE, FALSE,
+						sizeof(struct gatt_primary));
+	disc->includes = g_array_new(FALSE, FALSE,
+						sizeof(struct gatt_included));
+	disc->chars = g_array_new(FALSE, FALSE, sizeof(struct gatt_char));
+	disc->descs = g_array_new(FALSE, FALSE, sizeof(struct gatt_desc));
+
+	if (!discovery_send(disc, DISC_SERVICES, 0x0001, 0xffff, 0) ||
+		!discovery_send(disc, DISC_INCLUDES, 0x0001, 0xffff, 0) ||
+		!discovery_send(disc, DISC_CHARS, 0x0001, 0xffff, 0)) {
+		gatt_discover_all_cancel(disc);
+		return NULL;
+	}
+
+	return disc;
+}
+
 static sdp_data_t *proto_seq_find(sdp_list_t *proto_list)
 {
 	sdp_list_t *list;
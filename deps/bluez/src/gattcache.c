@@ -0,0 +1,535 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2015  Nod Labs
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/bluetooth/att.h>
+#include <bluez/bluetooth/gattrib.h>
+#include <bluez/bluetooth/gatt.h>
+#include <bluez/bluetooth/gattcache.h>
+
+#include "log.h"
+
+#define CACHE_MAGIC	0x43544147	/* "GATC" */
+#define CACHE_VERSION	2
+
+enum {
+	SECTION_SERVICES,
+	SECTION_INCLUDES,
+	SECTION_CHARS,
+	SECTION_DESCS,
+	SECTIONS,
+};
+
+/*
+ * The file starts with this header, followed by the entry arrays, each
+ * 8-byte aligned. Entries are the structs of gatt.h as they are laid out
+ * in memory, a file written by a different build fails the size check.
+ */
+struct cache_file {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t sc_handle;	/* Service Changed value, 0 if there is none */
+	uint16_t sc_ccc;	/* its CCC, 0 if there is none */
+	uint16_t sizes[SECTIONS];
+	uint32_t counts[SECTIONS];
+	uint32_t size;		/* of the whole file */
+};
+
+static const uint16_t entry_sizes[SECTIONS] = {
+	sizeof(struct gatt_primary),
+	sizeof(struct gatt_included),
+	sizeof(struct gatt_char),
+	sizeof(struct gatt_desc),
+};
+
+struct gatt_cache {
+	char *path;
+	struct cache_file *file;	/* the mapping, NULL if there is none */
+	size_t map_len;
+	bool valid;
+	GAttrib *attrib;
+	GattCacheReadyFunc ready;
+	gpointer user_data;
+	struct gatt_discovery *disc;	/* running, if any */
+	guint sc_watch;
+	uint16_t sc_handle;		/* the one sc_watch is registered on */
+	guint sc_enable;		/* its CCC write, until answered */
+};
+
+static void discover(struct gatt_cache *cache);
+
+static size_t section_offset(const struct cache_file *f, int section)
+{
+	size_t offset = sizeof(*f);
+	int i;
+
+	for (i = 0; i < section; i++) {
+		offset = (offset + 7) & ~(size_t) 7;
+		offset += (size_t) f->counts[i] * f->sizes[i];
+	}
+
+	return (offset + 7) & ~(size_t) 7;
+}
+
+static const void *section(const struct cache_file *f, int section,
+								guint *n)
+{
+	*n = f->counts[section];
+
+	return (const uint8_t *) f + section_offset(f, section);
+}
+
+static void cache_unmap(struct gatt_cache *cache)
+{
+	if (cache->file)
+		munmap(cache->file, cache->map_len);
+
+	cache->file = NULL;
+	cache->map_len = 0;
+	cache->valid = false;
+}
+
+static bool cache_check(const struct cache_file *f, size_t len)
+{
+	int i;
+
+	if (len < sizeof(*f) || f->magic != CACHE_MAGIC ||
+			f->version != CACHE_VERSION || f->size != len)
+		return false;
+
+	for (i = 0; i < SECTIONS; i++) {
+		if (f->sizes[i] != entry_sizes[i] ||
+					f->counts[i] > len / entry_sizes[i])
+			return false;
+	}
+
+	return section_offset(f, SECTIONS) == len;
+}
+
+static void cache_map(struct gatt_cache *cache)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(cache->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*cache->file)) {
+		close(fd);
+		return;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	if (!cache_check(map, st.st_size)) {
+		munmap(map, st.st_size);
+		return;
+	}
+
+	cache->file = map;
+	cache->map_len = st.st_size;
+	cache->valid = true;
+}
+
+struct gatt_cache *gatt_cache_open(const char *dir, const bdaddr_t *bdaddr)
+{
+	struct gatt_cache *cache;
+	char addr[18], name[32];
+
+	if (dir == NULL || bdaddr == NULL)
+		return NULL;
+
+	if (g_mkdir_with_parents(dir, 0700) < 0) {
+		error("gatt cache %s: %s", dir, strerror(errno));
+		return NULL;
+	}
+
+	cache = g_try_new0(struct gatt_cache, 1);
+	if (cache == NULL)
+		return NULL;
+
+	ba2str(bdaddr, addr);
+	snprintf(name, sizeof(name), "%s.gattdb", addr);
+	cache->path = g_build_filename(dir, name, NULL);
+
+	cache_map(cache);
+
+	return cache;
+}
+
+void gatt_cache_close(struct gatt_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	gatt_discover_all_cancel(cache->disc);
+
+	if (cache->attrib) {
+		if (cache->sc_enable)
+			g_attrib_cancel(cache->attrib, cache->sc_enable);
+		if (cache->sc_watch)
+			g_attrib_unregister(cache->attrib, cache->sc_watch);
+		g_attrib_unref(cache->attrib);
+	}
+
+	cache_unmap(cache);
+	g_free(cache->path);
+	g_free(cache);
+}
+
+gboolean gatt_cache_valid(struct gatt_cache *cache)
+{
+	return cache != NULL && cache->valid;
+}
+
+void gatt_cache_invalidate(struct gatt_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	if (unlink(cache->path) < 0 && errno != ENOENT)
+		error("gatt cache %s: %s", cache->path, strerror(errno));
+
+	cache->valid = false;
+}
+
+const struct gatt_primary *gatt_cache_services(struct gatt_cache *cache,
+								guint *n)
+{
+	*n = 0;
+
+	if (!gatt_cache_valid(cache))
+		return NULL;
+
+	return section(cache->file, SECTION_SERVICES, n);
+}
+
+const struct gatt_included *gatt_cache_includes(struct gatt_cache *cache,
+								guint *n)
+{
+	*n = 0;
+
+	if (!gatt_cache_valid(cache))
+		return NULL;
+
+	return section(cache->file, SECTION_INCLUDES, n);
+}
+
+const struct gatt_char *gatt_cache_chars(struct gatt_cache *cache,
+								guint *n)
+{
+	*n = 0;
+
+	if (!gatt_cache_valid(cache))
+		return NULL;
+
+	return section(cache->file, SECTION_CHARS, n);
+}
+
+const struct gatt_desc *gatt_cache_descs(struct gatt_cache *cache,
+								guint *n)
+{
+	*n = 0;
+
+	if (!gatt_cache_valid(cache))
+		return NULL;
+
+	return section(cache->file, SECTION_DESCS, n);
+}
+
+static void uuid16_string(uint16_t value, char *str, size_t n)
+{
+	bt_uuid_t uuid16, uuid;
+
+	bt_uuid16_create(&uuid16, value);
+	bt_uuid_to_uuid128(&uuid16, &uuid);
+	bt_uuid_to_string(&uuid, str, n);
+}
+
+/* The Service Changed value handle and the CCC that follows it */
+static void find_service_changed(struct cache_file *f,
+						const struct gatt_db *db)
+{
+	char sc[MAX_LEN_UUID_STR + 1], ccc[MAX_LEN_UUID_STR + 1];
+	uint16_t limit = 0xffff;
+	guint i;
+
+	uuid16_string(GATT_CHARAC_SERVICE_CHANGED, sc, sizeof(sc));
+	uuid16_string(GATT_CLIENT_CHARAC_CFG_UUID, ccc, sizeof(ccc));
+
+	for (i = 0; i < db->n_chars; i++) {
+		if (strcmp(db->chars[i].uuid, sc) != 0)
+			continue;
+
+		f->sc_handle = db->chars[i].value_handle;
+		if (i + 1 < db->n_chars)
+			limit = db->chars[i + 1].handle;
+		break;
+	}
+
+	if (f->sc_handle == 0)
+		return;
+
+	for (i = 0; i < db->n_descs; i++) {
+		const struct gatt_desc *desc = &db->descs[i];
+
+		if (desc->handle > f->sc_handle && desc->handle < limit &&
+						strcmp(desc->uuid, ccc) == 0) {
+			f->sc_ccc = desc->handle;
+			break;
+		}
+	}
+}
+
+gboolean gatt_cache_store(struct gatt_cache *cache, const struct gatt_db *db)
+{
+	const void *entries[SECTIONS] = { db->services, db->includes,
+							db->chars, db->descs };
+	const guint counts[SECTIONS] = { db->n_services, db->n_includes,
+							db->n_chars, db->n_descs };
+	struct cache_file hdr, *f;
+	char *tmp;
+	size_t size;
+	void *map;
+	int fd, i;
+
+	if (cache == NULL || db == NULL)
+		return FALSE;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CACHE_MAGIC;
+	hdr.version = CACHE_VERSION;
+	for (i = 0; i < SECTIONS; i++) {
+		hdr.sizes[i] = entry_sizes[i];
+		hdr.counts[i] = counts[i];
+	}
+
+	size = section_offset(&hdr, SECTIONS);
+	hdr.size = size;
+	find_service_changed(&hdr, db);
+
+	/* Written next to the old file and renamed over it when complete */
+	tmp = g_strdup_printf("%s.tmp", cache->path);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		error("gatt cache %s: %s", tmp, strerror(errno));
+		g_free(tmp);
+		return FALSE;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		error("gatt cache %s: %s", tmp, strerror(errno));
+		goto fail;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		error("gatt cache %s: %s", tmp, strerror(errno));
+		goto fail;
+	}
+
+	f = map;
+	*f = hdr;
+	for (i = 0; i < SECTIONS; i++)
+		memcpy((uint8_t *) f + section_offset(f, i), entries[i],
+					(size_t) counts[i] * entry_sizes[i]);
+
+	if (rename(tmp, cache->path) < 0) {
+		error("gatt cache %s: %s", cache->path, strerror(errno));
+		munmap(map, size);
+		goto fail;
+	}
+
+	close(fd);
+	g_free(tmp);
+
+	/* The new file stays mapped, there is nothing to read back */
+	cache_unmap(cache);
+	cache->file = f;
+	cache->map_len = size;
+	cache->valid = true;
+
+	return TRUE;
+
+fail:
+	close(fd);
+	unlink(tmp);
+	g_free(tmp);
+	return FALSE;
+}
+
+static void service_changed(const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct gatt_cache *cache = user_data;
+
+	if (len < 7)
+		return;
+
+	DBG("service changed 0x%04x-0x%04x", att_get_u16(&pdu[3]),
+							att_get_u16(&pdu[5]));
+
+	gatt_cache_invalidate(cache);
+
+	/* Start over if the database changed while being discovered */
+	gatt_discover_all_cancel(cache->disc);
+	cache->disc = NULL;
+
+	discover(cache);
+}
+
+/* Without Service Changed indications the database can't be trusted */
+static void unwatch_service_changed(struct gatt_cache *cache)
+{
+	if (cache->sc_enable)
+		g_attrib_cancel(cache->attrib, cache->sc_enable);
+	cache->sc_enable = 0;
+
+	if (cache->sc_watch)
+		g_attrib_unregister(cache->attrib, cache->sc_watch);
+	cache->sc_watch = 0;
+	cache->sc_handle = 0;
+}
+
+static void service_changed_enabled(guint8 status, const guint8 *pdu,
+					guint16 len, gpointer user_data)
+{
+	struct gatt_cache *cache = user_data;
+
+	cache->sc_enable = 0;
+
+	if (status == 0)
+		return;
+
+	error("gatt cache %s: enabling Service Changed: %s", cache->path,
+							att_ecode2str(status));
+
+	unwatch_service_changed(cache);
+	gatt_cache_invalidate(cache);
+
+	if (cache->ready)
+		cache->ready(status, cache->user_data);
+}
+
+static void watch_service_changed(struct gatt_cache *cache)
+{
+	uint8_t ind[2];
+
+	if (cache->sc_watch && cache->sc_handle == cache->file->sc_handle)
+		return;
+
+	unwatch_service_changed(cache);
+
+	cache->sc_handle = cache->file->sc_handle;
+	if (cache->sc_handle == 0)
+		return;
+
+	cache->sc_watch = g_attrib_register(cache->attrib, ATT_OP_HANDLE_IND,
+					cache->sc_handle, service_changed,
+					cache, NULL);
+
+	if (cache->file->sc_ccc == 0)
+		return;
+
+	att_put_u16(GATT_CLIENT_CHARAC_CFG_IND_BIT, ind);
+	cache->sc_enable = gatt_write_char(cache->attrib, cache->file->sc_ccc,
+					ind, sizeof(ind),
+					service_changed_enabled, cache);
+	if (cache->sc_enable == 0) {
+		unwatch_service_changed(cache);
+		gatt_cache_invalidate(cache);
+	}
+}
+
+static void discovered(struct gatt_db *db, guint8 status, gpointer user_data)
+{
+	struct gatt_cache *cache = user_data;
+
+	cache->disc = NULL;
+
+	if (status == 0 && !gatt_cache_store(cache, db))
+		status = ATT_ECODE_IO;
+
+	gatt_db_free(db);
+
+	if (status == 0)
+		watch_service_changed(cache);
+
+	if (status == 0 && !cache->valid)
+		status = ATT_ECODE_IO;
+
+	if (cache->ready)
+		cache->ready(status, cache->user_data);
+}
+
+static void discover(struct gatt_cache *cache)
+{
+	cache->disc = gatt_discover_all(cache->attrib, discovered, cache);
+	if (cache->disc == NULL && cache->ready)
+		cache->ready(ATT_ECODE_IO, cache->user_data);
+}
+
+gboolean gatt_cache_attach(struct gatt_cache *cache, GAttrib *attrib,
+				GattCacheReadyFunc ready, gpointer user_data)
+{
+	if (cache == NULL || attrib == NULL || cache->attrib != NULL)
+		return FALSE;
+
+	cache->attrib = g_attrib_ref(attrib);
+	cache->ready = ready;
+	cache->user_data = user_data;
+
+	if (!cache->valid) {
+		discover(cache);
+		return TRUE;
+	}
+
+	watch_service_changed(cache);
+
+	if (ready)
+		ready(cache->valid ? 0 : ATT_ECODE_IO, user_data);
+
+	return TRUE;
+}
@@ -22,13 +22,19 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <glib.h>
 
 #include <stdio.h>
@@ -36,6 +42,7 @@
 #include <bluetooth/bluetooth.h>
 
 #include <bluez/bluetooth/btio.h>
+#include <bluez/bluetooth/ioloop.h>
 #include <bluez/bluetooth/uuid.h>
 #include <bluez/bluetooth/att.h>
 #include <bluez/bluetooth/gattrib.h>
@@ -44,33 +51,182 @@
 
 #define GATT_TIMEOUT 30
 
+/*
+ * Incoming PDUs are drained from the non-blocking socket in batches of
+ * RX_RING_SLOTS with a single recvmmsg() call. RX_MAX_FILLS bounds the
+ * work done per wakeup so a continuous notification stream can't starve
+ * the rest of the main loop; whatever is left is picked up on the next
+ * iteration.
+ */
+#define RX_RING_SLOTS 16
+#define RX_SLOT_SIZE 512
+#define RX_MAX_FILLS 4
+
+/*
+ * Commands carry their PDU inline and are recycled through a per-GAttrib
+ * free list, so steady state sending does not touch the allocator. Each
+ * entry is sized for the ATT MTU at the time it was allocated.
+ */
+#define CMD_POOL_MAX 64
+
+/*
+ * Upper bound of PDUs handed to a single sendmmsg() call. Responses and
+ * write commands are coalesced; a request that expects a reply always
+ * ends the batch since ATT allows only one outstanding request.
+ */
+#define TX_BATCH_MAX 32
+
+/* All ATT request opcodes are below 0x20, RTTs are indexed by opcode */
+#define RTT_SLOTS 0x20
+
+/*
+ * Command deadlines and the ATT transaction timeout are kept on a
+ * hierarchical timer wheel: WHEEL_LEVELS levels of WHEEL_SIZE slots, each
+ * level WHEEL_SIZE times coarser than the one below. With 10ms ticks it
+ * spans about 46 hours. Arming and disarming a timer is O(1) and a single
+ * GLib timeout is armed for the next tick that needs attention.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK_US 10000
+#define WHEEL_SPAN (G_GUINT64_CONSTANT(1) << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* Level of a timer that is being fired and no longer sits in a slot */
+#define WHEEL_FIRING -1
+
+struct timer_wheel {
+	guint64 now;		/* next tick to be processed */
+	gint64 epoch;		/* monotonic time of tick 0 */
+	guint pending[WHEEL_LEVELS];
+	GQueue slot[WHEEL_LEVELS][WHEEL_SIZE];
+	guint source;
+	guint64 source_tick;
+};
+
+/* Per-handle notification timing, jitter is smoothed as in RFC 3550 */
+struct notify_timing {
+	gint64 last;
+	gint64 last_interval;
+	guint64 count;
+	guint64 sum_interval;
+	guint64 min_interval;
+	guint64 max_interval;
+	gint64 jitter16;
+};
+
+/* Requests for a handle stay on one bearer while any is pending */
+struct route {
+	guint8 bearer;
+	guint pending;
+};
+
+struct rx_ring {
+	uint8_t slot[RX_RING_SLOTS][RX_SLOT_SIZE];
+	struct iovec iov[RX_RING_SLOTS];
+	struct mmsghdr msg[RX_RING_SLOTS];
+};
+
 struct _GAttrib {
 	GIOChannel *io;
+	struct io_loop *loop;
 	int refs;
 	uint8_t *buf;
 	size_t buflen;
 	guint read_watch;
 	guint write_watch;
-	guint timeout_watch;
 	GQueue *requests;
 	GQueue *responses;
 	GSList *events;
+	GSList *any_events;
+	GHashTable *event_table;
+	GHashTable *commands;
 	guint next_cmd_id;
+	struct command *submitted;	/* pushed by g_attrib_submit() */
+	int submit_fd;
+	guint submit_watch;
+	guint queued_pdus;
+	gsize queued_bytes;
+	guint high_pdus;
+	guint low_pdus;
+	gsize high_bytes;
+	gsize low_bytes;
+	bool pressure;
+	GAttribPressureFunc pressure_func;
+	gpointer pressure_data;
+	GQueue held;		/* conflated events waiting for delivery */
+	GHashTable *reads;	/* read key -> request open for sharing */
+	GHashTable *read_ttl;	/* handle -> cache TTL in ms */
+	GHashTable *read_cache;	/* read key -> struct cached_read */
+	gint64 reads_reset;	/* responses to older reads are not cached */
+	GQueue hits;		/* cache hits waiting for delivery */
+	guint hits_source;
+	guint sc_event;		/* Service Changed listener */
+	struct _GAttrib *bearers[GATTRIB_MAX_BEARERS];	/* [0] is attrib */
+	guint n_bearers;	/* 0 until a second bearer is added */
+	guint8 ind_bearer;	/* where the last indication came from */
+	GHashTable *routes;	/* handle -> struct route */
+	GQueue delegated;	/* requests sent on another bearer */
+	guint completing_id;	/* the request whose callback is running */
+	guint8 completing_bearer;	/* and the bearer that answered it */
+	struct _GAttrib *parent;	/* of an additional bearer */
+	guint8 bearer_index;
 	GDestroyNotify destroy;
 	gpointer destroy_user_data;
 	bool stale;
+	struct rx_ring *rx;
+	struct command *cmd_pool;
+	guint cmd_pool_len;
+	GAttribHistogram rtt[RTT_SLOTS];
+	GAttribHistogram wait[2];
+	GHashTable *notify_timing;
+	struct timer_wheel wheel;
+	GAttribStats stats;
 };
 
 struct command {
+	GList link;
 	guint id;
 	guint8 opcode;
-	guint8 *pdu;
 	guint16 len;
+	guint16 size;
 	guint8 expected;
+	guint8 priority;
 	bool sent;
+	bool expired;
+	bool queued;		/* counted in the queue watermarks */
+	bool shared;		/* in attrib->reads, open to identical reads */
+	bool hit;		/* answered from the read cache */
+	bool routed;		/* holds its handle's bearer, see bearer_pick() */
 	GAttribResultFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
+	gint64 queued_at;
+	gint64 sent_at;
+	gint64 deadline;
+	GList timer;
+	GQueue *timer_slot;
+	gint8 timer_level;
+	guint64 expires;
+	struct command *shadowed;
+	struct command *next_free;
+	struct command *leader;	/* read whose transaction this one shares */
+	GQueue joined;		/* reads sharing this one's transaction */
+	struct _GAttrib *owner;	/* sent on another bearer of owner */
+	guint8 bearer;
+	guint bearer_id;	/* the command on that bearer */
+	guint16 npdus;		/* PDUs of a batch, see g_attrib_send_batch() */
+	guint16 tx_next;	/* batch PDUs already on the air */
+	guint16 tx_offset;	/* where the next of them starts in pdu */
+	guint8 pdu[0];
+};
+
+/* A read response kept for the TTL of its handle */
+struct cached_read {
+	gint64 expires;
+	guint16 len;
+	guint8 pdu[0];
 };
 
 struct event {
@@ -80,8 +236,24 @@ struct event {
 	GAttribNotifyFunc func;
 	gpointer user_data;
 	GDestroyNotify notify;
+	bool conflate;
+	bool held;		/* on attrib->held, latest is valid */
+	guint8 *latest;
+	guint16 latest_len;
+	guint16 latest_size;
+	guint64 dropped;
 };
 
+/*
+ * Listeners are indexed by (opcode, handle) so that an incoming PDU only
+ * visits the handlers that can match it. Registrations for all handles of
+ * an opcode use GATTRIB_ALL_HANDLES as handle part of the key, which never
+ * collides with a real attribute handle. GATTRIB_ALL_EVENTS and
+ * GATTRIB_ALL_REQS listeners are kept apart in attrib->any_events.
+ */
+#define EVENT_KEY(opcode, handle) \
+	GUINT_TO_POINTER(((guint) (opcode) << 16) | (handle))
+
 static guint8 opcode2expected(guint8 opcode)
 {
 	switch (opcode) {
@@ -147,483 +319,2134 @@ static bool is_response(guint8 opcode)
 	return false;
 }
 
-GAttrib *g_attrib_ref(GAttrib *attrib)
+/*
+ * Reads are keyed by handle, offset and whether they are a READ_BLOB, so
+ * that identical requests find each other in attrib->reads and their
+ * responses in attrib->read_cache. Values are at most 512 bytes long,
+ * larger offsets are simply not keyed.
+ */
+#define READ_KEY(handle, offset, blob) \
+	GUINT_TO_POINTER(((guint) (blob) << 31) | ((guint) (offset) << 16) | \
+								(handle))
+#define READ_KEY_HANDLE(key) (GPOINTER_TO_UINT(key) & 0xffff)
+
+static bool read_key(const guint8 *pdu, guint16 len, gpointer *key)
 {
-	int refs;
+	guint16 handle, offset;
 
-	if (!attrib)
-		return NULL;
+	switch (pdu[0]) {
+	case ATT_OP_READ_REQ:
+		if (len < 3)
+			return false;
 
-	refs = __sync_add_and_fetch(&attrib->refs, 1);
+		handle = att_get_u16(&pdu[1]);
+		*key = READ_KEY(handle, 0, 0);
+		break;
 
-	DBG("%p: ref=%d", attrib, refs);
+	case ATT_OP_READ_BLOB_REQ:
+		if (len < 5)
+			return false;
 
-	return attrib;
-}
+		handle = att_get_u16(&pdu[1]);
+		offset = att_get_u16(&pdu[3]);
+		if (offset > 0x7fff)
+			return false;
 
-static void command_destroy(struct command *cmd)
-{
-	if (cmd->notify)
-		cmd->notify(cmd->user_data);
+		*key = READ_KEY(handle, offset, 1);
+		break;
+
+	default:
+		return false;
+	}
 
-	g_free(cmd->pdu);
-	g_free(cmd);
+	return handle != 0;
 }
 
-static void event_destroy(struct event *evt)
+static void hist_add(GAttribHistogram *hist, gint64 us)
 {
-	if (evt->notify)
-		evt->notify(evt->user_data);
+	guint64 v = us > 0 ? us : 0;
+	guint bucket = 0;
 
-	g_free(evt);
+	hist->count++;
+	hist->sum_us += v;
+	if (v > hist->max_us)
+		hist->max_us = v;
+
+	while ((v >>= 1) && bucket < GATTRIB_HIST_BUCKETS - 1)
+		bucket++;
+
+	hist->bucket[bucket]++;
 }
 
-static void attrib_destroy(GAttrib *attrib)
+static void notify_timing_add(struct _GAttrib *attrib, guint16 handle,
+								gint64 now)
 {
-	GSList *l;
-	struct command *c;
+	struct notify_timing *t;
+	gint64 interval, d;
+
+	t = g_hash_table_lookup(attrib->notify_timing,
+						GUINT_TO_POINTER(handle));
+	if (t == NULL) {
+		t = g_try_new0(struct notify_timing, 1);
+		if (t == NULL)
+			return;
+
+		g_hash_table_insert(attrib->notify_timing,
+					GUINT_TO_POINTER(handle), t);
+	}
 
-	while ((c = g_queue_pop_head(attrib->requests)))
-		command_destroy(c);
+	t->count++;
 
-	while ((c = g_queue_pop_head(attrib->responses)))
-		command_destroy(c);
+	if (t->count == 1) {
+		t->last = now;
+		return;
+	}
 
-	g_queue_free(attrib->requests);
-	attrib->requests = NULL;
+	interval = now - t->last;
+	t->last = now;
 
-	g_queue_free(attrib->responses);
-	attrib->responses = NULL;
+	t->sum_interval += interval;
+	if (t->count == 2 || (guint64) interval < t->min_interval)
+		t->min_interval = interval;
+	if ((guint64) interval > t->max_interval)
+		t->max_interval = interval;
 
-	for (l = attrib->events; l; l = l->next)
-		event_destroy(l->data);
+	if (t->count > 2) {
+		d = interval - t->last_interval;
+		if (d < 0)
+			d = -d;
 
-	g_slist_free(attrib->events);
-	attrib->events = NULL;
+		/* J += (|D| - J) / 16, kept scaled by 16 */
+		t->jitter16 += d - ((t->jitter16 + 8) >> 4);
+	}
 
-	if (attrib->timeout_watch > 0)
-		g_source_remove(attrib->timeout_watch);
+	t->last_interval = interval;
+}
 
-	if (attrib->write_watch > 0)
-		g_source_remove(attrib->write_watch);
+static guint64 wheel_tick(struct timer_wheel *w, gint64 us)
+{
+	if (us <= w->epoch)
+		return 0;
 
-	if (attrib->read_watch > 0)
-		g_source_remove(attrib->read_watch);
+	return (us - w->epoch) / WHEEL_TICK_US;
+}
 
-	if (attrib->io)
-		g_io_channel_unref(attrib->io);
+static void timer_insert(struct timer_wheel *w, struct command *cmd)
+{
+	guint64 expires = MAX(cmd->expires, w->now);
+	guint64 delta = expires - w->now;
+	int level = 0;
 
-	g_free(attrib->buf);
+	/* Beyond the wheel span: park it, it is re-armed when reached */
+	if (delta >= WHEEL_SPAN)
+		expires = w->now + WHEEL_SPAN - 1;
 
-	if (attrib->destroy)
-		attrib->destroy(attrib->destroy_user_data);
+	while (level < WHEEL_LEVELS - 1 &&
+				delta >> (WHEEL_BITS * (level + 1)) > 0)
+		level++;
 
-	g_free(attrib);
+	cmd->timer_slot = &w->slot[level][(expires >> (WHEEL_BITS * level)) &
+								WHEEL_MASK];
+	cmd->timer_level = level;
+	w->pending[level]++;
+
+	g_queue_push_tail_link(cmd->timer_slot, &cmd->timer);
 }
 
-void g_attrib_unref(GAttrib *attrib)
+static void timer_disarm(struct timer_wheel *w, struct command *cmd)
 {
-	int refs;
-
-	if (!attrib)
+	if (cmd->timer_slot == NULL)
 		return;
 
-	refs = __sync_sub_and_fetch(&attrib->refs, 1);
-
-	DBG("%p: ref=%d", attrib, refs);
+	g_queue_unlink(cmd->timer_slot, &cmd->timer);
 
-	if (refs > 0)
-		return;
+	if (cmd->timer_level != WHEEL_FIRING)
+		w->pending[cmd->timer_level]--;
 
-	attrib_destroy(attrib);
+	cmd->timer_slot = NULL;
 }
 
-GIOChannel *g_attrib_get_channel(GAttrib *attrib)
+static bool wheel_empty(struct timer_wheel *w)
 {
-	if (!attrib)
-		return NULL;
+	int i;
 
-	return attrib->io;
+	for (i = 0; i < WHEEL_LEVELS; i++)
+		if (w->pending[i] > 0)
+			return false;
+
+	return true;
 }
 
-gboolean g_attrib_set_destroy_function(GAttrib *attrib,
-		GDestroyNotify destroy, gpointer user_data)
+/* First tick at which wheel_run() has something to do */
+static guint64 wheel_next(struct timer_wheel *w)
 {
-	if (attrib == NULL)
-		return FALSE;
+	/* Higher levels cascade whenever the lowest one wraps */
+	guint64 next = (w->now + WHEEL_MASK) & ~(guint64) WHEEL_MASK;
+	int i;
 
-	attrib->destroy = destroy;
-	attrib->destroy_user_data = user_data;
+	for (i = 0; w->pending[0] > 0 && i < WHEEL_SIZE; i++) {
+		if (!g_queue_is_empty(&w->slot[0][(w->now + i) & WHEEL_MASK]))
+			return MIN(w->now + i, next);
+	}
 
-	return TRUE;
+	return next;
 }
 
-static gboolean disconnect_timeout(gpointer data)
+GAttrib *g_attrib_ref(GAttrib *attrib)
 {
-	struct _GAttrib *attrib = data;
-	struct command *c;
+	int refs;
 
-	g_attrib_ref(attrib);
+	if (!attrib)
+		return NULL;
 
-	c = g_queue_pop_head(attrib->requests);
-	if (c == NULL)
-		goto done;
+	refs = __sync_add_and_fetch(&attrib->refs, 1);
 
-	if (c->func)
-		c->func(ATT_ECODE_TIMEOUT, NULL, 0, c->user_data);
+	DBG("%p: ref=%d", attrib, refs);
 
-	command_destroy(c);
+	return attrib;
+}
 
-	while ((c = g_queue_pop_head(attrib->requests))) {
-		if (c->func)
-			c->func(ATT_ECODE_ABORTED, NULL, 0, c->user_data);
-		command_destroy(c);
-	}
+static struct command *command_alloc(struct _GAttrib *attrib, guint16 len)
+{
+	struct command *cmd = attrib->cmd_pool;
+	guint16 size;
 
-done:
-	attrib->stale = true;
+	if (cmd && cmd->size >= len) {
+		attrib->cmd_pool = cmd->next_free;
+		attrib->cmd_pool_len--;
+		attrib->stats.cmd_reuses++;
 
-	g_attrib_unref(attrib);
+		size = cmd->size;
+		memset(cmd, 0, sizeof(*cmd));
+		cmd->size = size;
+	} else {
+		size = MAX(len, attrib->buflen);
+		cmd = g_try_malloc0(sizeof(*cmd) + size);
+		if (cmd == NULL)
+			return NULL;
 
-	return FALSE;
+		attrib->stats.cmd_allocs++;
+		cmd->size = size;
+	}
+
+	cmd->link.data = cmd;
+	cmd->timer.data = cmd;
+
+	return cmd;
 }
 
-static gboolean can_write_data(GIOChannel *io, GIOCondition cond,
-								gpointer data)
+/*
+ * attrib->commands maps a command id to its command, and through the
+ * embedded link to its queue node. Compound procedures re-queue follow-up
+ * PDUs under the id of the first one, so the newest command owns the entry
+ * and shadows the older ones with the same id.
+ */
+static void command_index_add(struct _GAttrib *attrib, struct command *cmd)
 {
-	struct _GAttrib *attrib = data;
-	struct command *cmd;
-	GError *gerr = NULL;
-	gsize len;
-	GIOStatus iostat;
-	GQueue *queue;
+	gpointer key = GUINT_TO_POINTER(cmd->id);
 
-	if (attrib->stale)
-		return FALSE;
+	cmd->shadowed = g_hash_table_lookup(attrib->commands, key);
+	g_hash_table_insert(attrib->commands, key, cmd);
+}
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
-		return FALSE;
+static void command_index_remove(struct _GAttrib *attrib,
+							struct command *cmd)
+{
+	gpointer key = GUINT_TO_POINTER(cmd->id);
+	struct command *c;
 
-	queue = attrib->responses;
-	cmd = g_queue_peek_head(queue);
-	if (cmd == NULL) {
-		queue = attrib->requests;
-		cmd = g_queue_peek_head(queue);
+	c = g_hash_table_lookup(attrib->commands, key);
+	if (c == cmd) {
+		if (cmd->shadowed)
+			g_hash_table_insert(attrib->commands, key,
+							cmd->shadowed);
+		else
+			g_hash_table_remove(attrib->commands, key);
+		return;
 	}
-	if (cmd == NULL)
-		return FALSE;
-
-	/*
-	 * Verify that we didn't already send this command. This can only
-	 * happen with elementes from attrib->requests.
-	 */
-	if (cmd->sent)
-		return FALSE;
 
-	iostat = g_io_channel_write_chars(io, (char *) cmd->pdu, cmd->len,
-								&len, &gerr);
-	if (iostat != G_IO_STATUS_NORMAL) {
-		if (gerr) {
-			error("%s", gerr->message);
-			g_error_free(gerr);
+	for (; c; c = c->shadowed) {
+		if (c->shadowed == cmd) {
+			c->shadowed = cmd->shadowed;
+			break;
 		}
-
-		return FALSE;
 	}
+}
+
+/*
+ * Queue pressure covers every command in requests and responses, including
+ * the request waiting for its response. It is raised when either the PDU
+ * count or the byte count reaches its high watermark and cleared once both
+ * are back at or below their low watermarks.
+ */
+static void queue_grew(struct _GAttrib *attrib, struct command *cmd)
+{
+	attrib->queued_pdus += MAX(cmd->npdus, 1);
+	attrib->queued_bytes += cmd->len;
 
-	if (cmd->expected == 0) {
-		g_queue_pop_head(queue);
-		command_destroy(cmd);
+	if (attrib->queued_pdus > attrib->stats.queue_max_pdus)
+		attrib->stats.queue_max_pdus = attrib->queued_pdus;
+	if (attrib->queued_bytes > attrib->stats.queue_max_bytes)
+		attrib->stats.queue_max_bytes = attrib->queued_bytes;
 
-		return TRUE;
-	}
+	if (attrib->pressure)
+		return;
 
-	cmd->sent = true;
+	if ((attrib->high_pdus == 0 ||
+				attrib->queued_pdus < attrib->high_pdus) &&
+			(attrib->high_bytes == 0 ||
+				attrib->queued_bytes < attrib->high_bytes))
+		return;
 
-	if (attrib->timeout_watch == 0)
-		attrib->timeout_watch = g_timeout_add_seconds(GATT_TIMEOUT,
-						disconnect_timeout, attrib);
+	attrib->pressure = true;
+	attrib->stats.pressure_events++;
 
-	return FALSE;
+	if (attrib->pressure_func)
+		attrib->pressure_func(attrib, TRUE, attrib->pressure_data);
 }
 
-static void destroy_sender(gpointer data)
+static void queue_shrank(struct _GAttrib *attrib, struct command *cmd)
 {
-	struct _GAttrib *attrib = data;
+	attrib->queued_pdus -= MAX(cmd->npdus, 1);
+	attrib->queued_bytes -= cmd->len;
 
-	attrib->write_watch = 0;
-	g_attrib_unref(attrib);
+	if (!attrib->pressure)
+		return;
+
+	if ((attrib->high_pdus && attrib->queued_pdus > attrib->low_pdus) ||
+			(attrib->high_bytes &&
+				attrib->queued_bytes > attrib->low_bytes))
+		return;
+
+	attrib->pressure = false;
+
+	if (attrib->pressure_func)
+		attrib->pressure_func(attrib, FALSE, attrib->pressure_data);
 }
 
-static void wake_up_sender(struct _GAttrib *attrib)
+/*
+ * Commands embed their queue link, so they must never go through the
+ * GQueue helpers that allocate or free list nodes.
+ */
+static struct command *command_pop_head(GQueue *queue)
 {
-	if (attrib->write_watch > 0)
-		return;
+	GList *link = g_queue_pop_head_link(queue);
 
-	attrib = g_attrib_ref(attrib);
-	attrib->write_watch = g_io_add_watch_full(attrib->io,
-				G_PRIORITY_DEFAULT, G_IO_OUT,
-				can_write_data, attrib, destroy_sender);
+	return link ? link->data : NULL;
 }
 
-static bool match_event(struct event *evt, const uint8_t *pdu, gsize len)
+/* The attribute a PDU works on, if it is about a single one */
+static guint16 route_handle(struct command *cmd)
 {
-	guint16 handle;
+	if (cmd->npdus > 0)
+		return 0;
 
-	if (evt->expected == GATTRIB_ALL_EVENTS)
-		return true;
+	switch (cmd->opcode) {
+	case ATT_OP_READ_REQ:
+	case ATT_OP_READ_BLOB_REQ:
+	case ATT_OP_WRITE_REQ:
+	case ATT_OP_WRITE_CMD:
+	case ATT_OP_SIGNED_WRITE_CMD:
+		if (cmd->len >= 3)
+			return att_get_u16(&cmd->pdu[1]);
+	}
 
-	if (!is_response(pdu[0]) && evt->expected == GATTRIB_ALL_REQS)
-		return true;
+	return 0;
+}
 
-	if (evt->expected == pdu[0] && evt->handle == GATTRIB_ALL_HANDLES)
-		return true;
+static void route_hold(struct _GAttrib *attrib, struct command *cmd,
+								guint8 bearer)
+{
+	guint16 handle = route_handle(cmd);
+	struct route *r;
 
-	if (len < 3)
-		return false;
+	if (handle == 0)
+		return;
 
-	handle = att_get_u16(&pdu[1]);
+	r = g_hash_table_lookup(attrib->routes, GUINT_TO_POINTER(handle));
+	if (r == NULL) {
+		r = g_try_new0(struct route, 1);
+		if (r == NULL)
+			return;
 
-	if (evt->expected == pdu[0] && evt->handle == handle)
-		return true;
+		g_hash_table_insert(attrib->routes, GUINT_TO_POINTER(handle),
+									r);
+	}
 
-	return false;
+	/* Moved off a bearer that went away */
+	r->bearer = bearer;
+	r->pending++;
+	cmd->routed = true;
 }
 
-static gboolean received_data(GIOChannel *io, GIOCondition cond, gpointer data)
+static void route_release(struct _GAttrib *attrib, struct command *cmd)
 {
-	struct _GAttrib *attrib = data;
-	struct command *cmd = NULL;
-	GSList *l;
-	uint8_t buf[512], status;
-	gsize len;
-	GIOStatus iostat;
+	gpointer key = GUINT_TO_POINTER(route_handle(cmd));
+	struct route *r;
 
-	if (attrib->stale)
-		return FALSE;
+	cmd->routed = false;
 
-	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
-		attrib->read_watch = 0;
-		return FALSE;
-	}
+	r = g_hash_table_lookup(attrib->routes, key);
+	if (r && --r->pending == 0)
+		g_hash_table_remove(attrib->routes, key);
+}
 
-	memset(buf, 0, sizeof(buf));
+/* Identical reads no longer join cmd, the ones that did stay with it */
+static void read_unshare(struct _GAttrib *attrib, struct command *cmd)
+{
+	gpointer key;
 
-	iostat = g_io_channel_read_chars(io, (char *) buf, sizeof(buf),
-								&len, NULL);
-	if (iostat != G_IO_STATUS_NORMAL) {
-		status = ATT_ECODE_IO;
-		goto done;
-	}
+	cmd->shared = false;
 
-	for (l = attrib->events; l; l = l->next) {
-		struct event *evt = l->data;
+	if (read_key(cmd->pdu, cmd->len, &key) &&
+			g_hash_table_lookup(attrib->reads, key) == cmd)
+		g_hash_table_remove(attrib->reads, key);
+}
 
-		if (match_event(evt, buf, len))
-			evt->func(buf, len, evt->user_data);
-	}
+static void command_destroy(struct _GAttrib *attrib, struct command *cmd);
 
-	if (!is_response(buf[0]))
-		return TRUE;
+/* Completes cmd and every read sharing its transaction */
+static void command_complete(struct _GAttrib *attrib, struct command *cmd,
+				guint8 status, const guint8 *pdu, guint16 len)
+{
+	guint prev_id = attrib->completing_id;
+	guint8 prev_bearer = attrib->completing_bearer;
+	struct command *c;
 
-	if (attrib->timeout_watch > 0) {
-		g_source_remove(attrib->timeout_watch);
-		attrib->timeout_watch = 0;
-	}
+	if (cmd->shared)
+		read_unshare(attrib, cmd);
 
-	cmd = g_queue_pop_head(attrib->requests);
-	if (cmd == NULL) {
-		/* Keep the watch if we have events to report */
-		return attrib->events != NULL;
-	}
+	/*
+	 * Out of its queue already, so no longer cancellable: a callback
+	 * cancelling its own id would unlink it a second time.
+	 */
+	command_index_remove(attrib, cmd);
 
-	if (buf[0] == ATT_OP_ERROR) {
-		status = buf[4];
-		goto done;
-	}
+	/* Follow-ups sent under the id stay on its bearer, see attrib_send() */
+	attrib->completing_id = cmd->id;
+	attrib->completing_bearer = cmd->owner ? cmd->bearer : 0;
 
-	if (cmd->expected != buf[0]) {
-		status = ATT_ECODE_IO;
-		goto done;
-	}
+	if (cmd->func)
+		cmd->func(status, pdu, len, cmd->user_data);
 
-	status = 0;
+	while ((c = command_pop_head(&cmd->joined))) {
+		command_index_remove(attrib, c);
 
-done:
-	if (!g_queue_is_empty(attrib->requests) ||
-					!g_queue_is_empty(attrib->responses))
-		wake_up_sender(attrib);
+		attrib->completing_id = c->id;
 
-	if (cmd) {
-		if (cmd->func)
-			cmd->func(status, buf, len, cmd->user_data);
+		if (c->func)
+			c->func(status, pdu, len, c->user_data);
 
-		command_destroy(cmd);
+		command_destroy(attrib, c);
 	}
 
-	return TRUE;
+	attrib->completing_id = prev_id;
+	attrib->completing_bearer = prev_bearer;
 }
 
-GAttrib *g_attrib_new(GIOChannel *io)
+static void command_destroy(struct _GAttrib *attrib, struct command *cmd)
 {
-	struct _GAttrib *attrib;
-	uint16_t imtu;
-	uint16_t att_mtu;
-	uint16_t cid;
-	GError *gerr = NULL;
-
-	g_io_channel_set_encoding(io, NULL, NULL);
-	g_io_channel_set_buffered(io, FALSE);
+	struct command *c;
 
-	bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &imtu,
-				BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
-	if (gerr) {
-		error("%s", gerr->message);
-		g_error_free(gerr);
-		return NULL;
-	}
+	timer_disarm(&attrib->wheel, cmd);
+	command_index_remove(attrib, cmd);
 
-	attrib = g_try_new0(struct _GAttrib, 1);
-	if (attrib == NULL)
-		return NULL;
+	if (cmd->queued)
+		queue_shrank(attrib, cmd);
 
-	att_mtu = (cid == ATT_CID) ? ATT_DEFAULT_LE_MTU : imtu;
+	if (cmd->shared)
+		read_unshare(attrib, cmd);
 
-	attrib->buf = g_malloc0(att_mtu);
-	attrib->buflen = att_mtu;
+	if (cmd->routed)
+		route_release(attrib, cmd);
 
-	attrib->io = g_io_channel_ref(io);
-	attrib->requests = g_queue_new();
-	attrib->responses = g_queue_new();
+	/* Cancelled along with the transaction they were waiting for */
+	while ((c = command_pop_head(&cmd->joined)))
+		command_destroy(attrib, c);
 
-	attrib->read_watch = g_io_add_watch(attrib->io,
-			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			received_data, attrib);
+	if (cmd->notify)
+		cmd->notify(cmd->user_data);
+
+	if (attrib->cmd_pool_len >= CMD_POOL_MAX ||
+					cmd->size < attrib->buflen) {
+		g_free(cmd);
+		return;
+	}
+
+	cmd->next_free = attrib->cmd_pool;
+	attrib->cmd_pool = cmd;
+	attrib->cmd_pool_len++;
+}
+
+static void command_pool_flush(struct _GAttrib *attrib)
+{
+	struct command *cmd;
+
+	while ((cmd = attrib->cmd_pool)) {
+		attrib->cmd_pool = cmd->next_free;
+		g_free(cmd);
+	}
+
+	attrib->cmd_pool_len = 0;
+}
+
+static void event_destroy(struct event *evt)
+{
+	if (evt->notify)
+		evt->notify(evt->user_data);
+
+	g_free(evt->latest);
+	g_free(evt);
+}
+
+static void submitted_free(struct command *cmd)
+{
+	struct command *next;
+
+	for (; cmd; cmd = next) {
+		next = cmd->next_free;
+
+		if (cmd->notify)
+			cmd->notify(cmd->user_data);
+
+		g_free(cmd);
+	}
+}
+
+static void bearers_detach(struct _GAttrib *attrib);
+
+static void attrib_destroy(GAttrib *attrib)
+{
+	GSList *l;
+	struct command *c;
+
+	attrib->pressure_func = NULL;
+
+	bearers_detach(attrib);
+
+	if (attrib->submit_watch > 0)
+		io_loop_remove(attrib->loop, attrib->submit_watch);
+
+	if (attrib->submit_fd >= 0)
+		close(attrib->submit_fd);
+
+	submitted_free(__atomic_exchange_n(&attrib->submitted, NULL,
+							__ATOMIC_ACQUIRE));
+
+	while ((c = command_pop_head(attrib->requests)))
+		command_destroy(attrib, c);
+
+	while ((c = command_pop_head(attrib->responses)))
+		command_destroy(attrib, c);
+
+	while ((c = command_pop_head(&attrib->hits)))
+		command_destroy(attrib, c);
+
+	if (attrib->hits_source > 0)
+		io_loop_remove(attrib->loop, attrib->hits_source);
+
+	g_hash_table_destroy(attrib->reads);
+	attrib->reads = NULL;
+
+	g_hash_table_destroy(attrib->read_ttl);
+	attrib->read_ttl = NULL;
+
+	g_hash_table_destroy(attrib->read_cache);
+	attrib->read_cache = NULL;
+
+	if (attrib->routes)
+		g_hash_table_destroy(attrib->routes);
+	attrib->routes = NULL;
+
+	g_queue_free(attrib->requests);
+	attrib->requests = NULL;
+
+	g_queue_free(attrib->responses);
+	attrib->responses = NULL;
+
+	g_queue_clear(&attrib->held);
+
+	for (l = attrib->events; l; l = l->next)
+		event_destroy(l->data);
+
+	g_slist_free(attrib->events);
+	attrib->events = NULL;
+
+	g_slist_free(attrib->any_events);
+	attrib->any_events = NULL;
+
+	g_hash_table_destroy(attrib->event_table);
+	attrib->event_table = NULL;
+
+	g_hash_table_destroy(attrib->notify_timing);
+	attrib->notify_timing = NULL;
+
+	g_hash_table_destroy(attrib->commands);
+	attrib->commands = NULL;
+
+	if (attrib->wheel.source > 0)
+		io_loop_remove(attrib->loop, attrib->wheel.source);
+
+	if (attrib->write_watch > 0)
+		io_loop_remove(attrib->loop, attrib->write_watch);
+
+	if (attrib->read_watch > 0)
+		io_loop_remove(attrib->loop, attrib->read_watch);
+
+	if (attrib->io)
+		g_io_channel_unref(attrib->io);
+
+	g_free(attrib->buf);
+	g_free(attrib->rx);
+	command_pool_flush(attrib);
+
+	if (attrib->destroy)
+		attrib->destroy(attrib->destroy_user_data);
+
+	g_free(attrib);
+}
+
+void g_attrib_unref(GAttrib *attrib)
+{
+	int refs;
+
+	if (!attrib)
+		return;
+
+	refs = __sync_sub_and_fetch(&attrib->refs, 1);
+
+	DBG("%p: ref=%d", attrib, refs);
+
+	if (refs > 0)
+		return;
+
+	attrib_destroy(attrib);
+}
+
+GIOChannel *g_attrib_get_channel(GAttrib *attrib)
+{
+	if (!attrib)
+		return NULL;
+
+	return attrib->io;
+}
+
+gboolean g_attrib_set_destroy_function(GAttrib *attrib,
+		GDestroyNotify destroy, gpointer user_data)
+{
+	if (attrib == NULL)
+		return FALSE;
+
+	attrib->destroy = destroy;
+	attrib->destroy_user_data = user_data;
+
+	return TRUE;
+}
+
+/*
+ * The ATT transaction timeout: no further requests may be sent on a bearer
+ * whose request went unanswered, abort everything queued behind it.
+ */
+static void transaction_timeout(struct _GAttrib *attrib, struct command *cmd)
+{
+	struct command *c;
+
+	g_queue_unlink(attrib->requests, &cmd->link);
+
+	attrib->stats.timeouts++;
+
+	command_complete(attrib, cmd, ATT_ECODE_TIMEOUT, NULL, 0);
+	command_destroy(attrib, cmd);
+
+	while ((c = command_pop_head(attrib->requests))) {
+		attrib->stats.aborts++;
+
+		command_complete(attrib, c, ATT_ECODE_ABORTED, NULL, 0);
+		command_destroy(attrib, c);
+	}
+
+	attrib->stale = true;
+}
+
+static gboolean wheel_expired(gpointer data);
+
+static void wheel_schedule(struct _GAttrib *attrib)
+{
+	struct timer_wheel *w = &attrib->wheel;
+	guint64 next;
+	gint64 delay;
+
+	if (wheel_empty(w)) {
+		if (w->source > 0) {
+			io_loop_remove(attrib->loop, w->source);
+			w->source = 0;
+		}
+		return;
+	}
+
+	next = wheel_next(w);
+	if (w->source > 0 && w->source_tick <= next)
+		return;
+
+	if (w->source > 0)
+		io_loop_remove(attrib->loop, w->source);
+
+	delay = w->epoch + (gint64) next * WHEEL_TICK_US -
+						g_get_monotonic_time();
+
+	w->source = io_loop_add_timeout(attrib->loop,
+					delay > 0 ? (delay + 999) / 1000 : 0,
+					wheel_expired, attrib, NULL);
+	w->source_tick = next;
+}
+
+static void timer_arm(struct _GAttrib *attrib, struct command *cmd,
+								gint64 when)
+{
+	struct timer_wheel *w = &attrib->wheel;
+
+	timer_disarm(w, cmd);
+
+	/* An idle wheel has nothing to catch up on */
+	if (wheel_empty(w))
+		w->now = wheel_tick(w, g_get_monotonic_time());
+
+	/* Round up, a timer never fires before its time */
+	cmd->expires = wheel_tick(w, when + WHEEL_TICK_US - 1);
+	timer_insert(w, cmd);
+
+	wheel_schedule(attrib);
+}
+
+/* A request on air expires at its deadline or the transaction timeout */
+static void request_timer_arm(struct _GAttrib *attrib, struct command *cmd)
+{
+	gint64 limit = cmd->sent_at + GATT_TIMEOUT * G_USEC_PER_SEC;
+
+	if (cmd->deadline > 0 && cmd->deadline < limit)
+		timer_arm(attrib, cmd, cmd->deadline);
+	else
+		timer_arm(attrib, cmd, limit);
+}
+
+static void command_expired(struct _GAttrib *attrib, struct command *cmd)
+{
+	GAttribResultFunc func = cmd->func;
+	gint64 limit;
+
+	if (!cmd->sent) {
+		/* Nothing went on air yet, just drop it from the queue */
+		attrib->stats.deadlines++;
+
+		g_queue_unlink(is_response(cmd->opcode) ? attrib->responses :
+						attrib->requests, &cmd->link);
+
+		command_complete(attrib, cmd, ATT_ECODE_TIMEOUT, NULL, 0);
+		command_destroy(attrib, cmd);
+		return;
+	}
+
+	limit = cmd->sent_at + GATT_TIMEOUT * G_USEC_PER_SEC;
+
+	if (cmd->expired || cmd->deadline == 0 || cmd->deadline >= limit) {
+		transaction_timeout(attrib, cmd);
+		return;
+	}
+
+	/*
+	 * The request is on air: fail it now, but keep it at the head of the
+	 * queue so a late response is consumed by it rather than matched to
+	 * the next request. The transaction timeout still applies.
+	 */
+	attrib->stats.deadlines++;
+
+	cmd->expired = true;
+	cmd->func = NULL;
+	timer_arm(attrib, cmd, limit);
+
+	if (func)
+		func(ATT_ECODE_TIMEOUT, NULL, 0, cmd->user_data);
+}
+
+static void wheel_cascade(struct timer_wheel *w, int level, guint index)
+{
+	GQueue *slot = &w->slot[level][index];
+	GList *l;
+
+	while ((l = g_queue_pop_head_link(slot))) {
+		struct command *cmd = l->data;
+
+		w->pending[level]--;
+		timer_insert(w, cmd);
+	}
+}
+
+static void wheel_run(struct _GAttrib *attrib)
+{
+	struct timer_wheel *w = &attrib->wheel;
+	guint64 target = wheel_tick(w, g_get_monotonic_time());
+	GQueue work = G_QUEUE_INIT;
+	struct command *cmd;
+	GList *l;
+	int level;
+
+	while (w->now <= target && !wheel_empty(w)) {
+		guint index = w->now & WHEEL_MASK;
+
+		for (level = 1; index == 0 && level < WHEEL_LEVELS; level++) {
+			index = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+			wheel_cascade(w, level, index);
+		}
+
+		index = w->now & WHEEL_MASK;
+
+		/* Skip ahead to the next wrap when the lowest level is empty */
+		if (w->pending[0] == 0) {
+			w->now = MIN(target, w->now | WHEEL_MASK) + 1;
+			continue;
+		}
+
+		w->now++;
+
+		/*
+		 * Callbacks may disarm any of the expired timers, keep the
+		 * batch on a queue they can still be unlinked from.
+		 */
+		while ((l = g_queue_pop_head_link(&w->slot[0][index]))) {
+			cmd = l->data;
+			cmd->timer_slot = &work;
+			cmd->timer_level = WHEEL_FIRING;
+			w->pending[0]--;
+			g_queue_push_tail_link(&work, l);
+		}
+
+		while ((l = g_queue_pop_head_link(&work))) {
+			cmd = l->data;
+			cmd->timer_slot = NULL;
+
+			/* Parked beyond the wheel span */
+			if (cmd->expires >= w->now) {
+				timer_insert(w, cmd);
+				continue;
+			}
+
+			command_expired(attrib, cmd);
+		}
+	}
+
+	if (wheel_empty(w))
+		w->now = target + 1;
+}
+
+static gboolean wheel_expired(gpointer data)
+{
+	struct _GAttrib *attrib = data;
+
+	attrib->wheel.source = 0;
+
+	g_attrib_ref(attrib);
+
+	wheel_run(attrib);
+	wheel_schedule(attrib);
+
+	g_attrib_unref(attrib);
+
+	return FALSE;
+}
+
+static gboolean pending_output(struct _GAttrib *attrib)
+{
+	struct command *cmd;
+
+	if (attrib->stale)
+		return FALSE;
+
+	if (!g_queue_is_empty(attrib->responses))
+		return TRUE;
+
+	cmd = g_queue_peek_head(attrib->requests);
+
+	return cmd != NULL && !cmd->sent;
+}
+
+/*
+ * Adds the PDUs of cmd not sent yet to the batch, all of those a command
+ * from g_attrib_send_batch() holds. Returns false if they didn't all fit.
+ */
+static bool tx_gather(struct command *cmd, struct command **batch,
+						struct iovec *iov, int *n)
+{
+	const guint16 *lens = (const guint16 *) cmd->pdu;
+	guint16 offset = cmd->tx_offset;
+	guint16 i;
+
+	if (cmd->npdus == 0) {
+		if (*n == TX_BATCH_MAX)
+			return false;
+
+		batch[*n] = cmd;
+		iov[*n].iov_base = cmd->pdu;
+		iov[*n].iov_len = cmd->len;
+		(*n)++;
+		return true;
+	}
+
+	for (i = cmd->tx_next; i < cmd->npdus; i++) {
+		if (*n == TX_BATCH_MAX)
+			return false;
+
+		batch[*n] = cmd;
+		iov[*n].iov_base = cmd->pdu + offset;
+		iov[*n].iov_len = lens[i];
+		offset += lens[i];
+		(*n)++;
+	}
+
+	return true;
+}
+
+static gboolean can_write_data(int fd, GIOCondition cond, gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	struct command *batch[TX_BATCH_MAX];
+	struct iovec iov[TX_BATCH_MAX];
+	struct mmsghdr msg[TX_BATCH_MAX];
+	GQueue done = G_QUEUE_INIT;
+	struct command *cmd;
+	GList *l;
+	gint64 now;
+	int n = 0, sent, i;
+
+	if (attrib->stale)
+		return FALSE;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		return FALSE;
+
+	/* Responses never expect a reply, flush all of them */
+	for (l = g_queue_peek_head_link(attrib->responses); l; l = l->next)
+		if (!tx_gather(l->data, batch, iov, &n))
+			break;
+
+	/*
+	 * Then requests, up to and including the first one that expects a
+	 * reply. If the head was already sent we are still waiting for its
+	 * response and nothing queued behind it may go out.
+	 */
+	for (l = g_queue_peek_head_link(attrib->requests); l; l = l->next) {
+		cmd = l->data;
+
+		if (cmd->sent || !tx_gather(cmd, batch, iov, &n))
+			break;
+
+		if (cmd->expected != 0)
+			break;
+	}
+
+	if (n == 0)
+		return FALSE;
+
+	memset(msg, 0, sizeof(msg[0]) * n);
+
+	for (i = 0; i < n; i++) {
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	sent = sendmmsg(fd, msg, n, MSG_DONTWAIT);
+	attrib->stats.tx_writes++;
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return TRUE;
+
+		error("sendmmsg: %s", strerror(errno));
+		return FALSE;
+	}
+
+	now = g_get_monotonic_time();
+
+	attrib->stats.tx_wakeups++;
+	attrib->stats.tx_pdus += sent;
+	if ((guint) sent > attrib->stats.tx_max_batch)
+		attrib->stats.tx_max_batch = sent;
+
+	/*
+	 * Update the queues for the whole batch before running any destroy
+	 * notification, those may send or cancel commands.
+	 */
+	for (i = 0; i < sent; i++) {
+		cmd = batch[i];
+
+		/* A batch is done with its last PDU */
+		if (cmd->npdus > 0) {
+			cmd->tx_offset += ((guint16 *) cmd->pdu)[cmd->tx_next];
+			if (++cmd->tx_next < cmd->npdus)
+				continue;
+		}
+
+		cmd->sent_at = now;
+		hist_add(&attrib->wait[is_response(cmd->opcode)],
+							now - cmd->queued_at);
+
+		if (cmd->expected != 0) {
+			cmd->sent = true;
+			request_timer_arm(attrib, cmd);
+			continue;
+		}
+
+		g_queue_unlink(is_response(cmd->opcode) ? attrib->responses :
+						attrib->requests, &cmd->link);
+		g_queue_push_tail_link(&done, &cmd->link);
+	}
+
+	while ((cmd = command_pop_head(&done)))
+		command_destroy(attrib, cmd);
+
+	/* Partial batch: the socket is full, wait for it to drain */
+	if (sent < n)
+		return !attrib->stale;
+
+	return pending_output(attrib);
+}
+
+static void destroy_sender(gpointer data)
+{
+	struct _GAttrib *attrib = data;
+
+	attrib->write_watch = 0;
+	g_attrib_unref(attrib);
+}
+
+static void wake_up_sender(struct _GAttrib *attrib)
+{
+	if (attrib->write_watch > 0)
+		return;
+
+	attrib = g_attrib_ref(attrib);
+	attrib->write_watch = io_loop_add_watch(attrib->loop,
+				g_io_channel_unix_get_fd(attrib->io), G_IO_OUT,
+				can_write_data, attrib, destroy_sender);
+}
+
+static bool match_any_event(struct event *evt, const uint8_t *pdu)
+{
+	if (evt->expected == GATTRIB_ALL_EVENTS)
+		return true;
+
+	if (!is_response(pdu[0]) && evt->expected == GATTRIB_ALL_REQS)
+		return true;
+
+	return false;
+}
+
+/*
+ * A conflated listener keeps only the newest PDU seen during a receive
+ * batch. Whatever piled up in the socket while its consumer was busy is
+ * thus collapsed into one delivery once the batch has been drained.
+ */
+static void event_hold(struct _GAttrib *attrib, struct event *evt,
+					const uint8_t *pdu, gsize len)
+{
+	if (evt->latest_size < len) {
+		g_free(evt->latest);
+		evt->latest = g_malloc(len);
+		evt->latest_size = len;
+	}
+
+	memcpy(evt->latest, pdu, len);
+	evt->latest_len = len;
+
+	if (evt->held) {
+		evt->dropped++;
+		attrib->stats.conflated++;
+		return;
+	}
+
+	evt->held = true;
+	g_queue_push_tail(&attrib->held, evt);
+}
+
+static void events_flush(struct _GAttrib *attrib)
+{
+	struct event *evt;
+
+	/* Handlers may unregister any held event, it leaves the queue then */
+	while ((evt = g_queue_pop_head(&attrib->held))) {
+		evt->held = false;
+		evt->func(evt->latest, evt->latest_len, evt->user_data);
+	}
+}
+
+static void dispatch_list(struct _GAttrib *attrib, GSList *l,
+					const uint8_t *pdu, gsize len)
+{
+	GSList *next;
+
+	for (; l; l = next) {
+		struct event *evt = l->data;
+
+		next = l->next;
+
+		if (evt->conflate)
+			event_hold(attrib, evt, pdu, len);
+		else
+			evt->func(pdu, len, evt->user_data);
+	}
+}
+
+static void dispatch_event(struct _GAttrib *attrib, const uint8_t *pdu,
+								gsize len)
+{
+	GSList *l, *next;
+
+	for (l = attrib->any_events; l; l = next) {
+		struct event *evt = l->data;
+
+		next = l->next;
+		if (match_any_event(evt, pdu))
+			evt->func(pdu, len, evt->user_data);
+	}
+
+	if (g_hash_table_size(attrib->event_table) == 0)
+		return;
+
+	l = g_hash_table_lookup(attrib->event_table,
+				EVENT_KEY(pdu[0], GATTRIB_ALL_HANDLES));
+	dispatch_list(attrib, l, pdu, len);
+
+	if (len < 3)
+		return;
+
+	l = g_hash_table_lookup(attrib->event_table,
+				EVENT_KEY(pdu[0], att_get_u16(&pdu[1])));
+	dispatch_list(attrib, l, pdu, len);
+}
+
+static void rx_ring_reset(struct rx_ring *rx)
+{
+	int i;
+
+	/*
+	 * No name or control buffer: stale values there make recvmmsg()
+	 * fail part way through a batch, and the kernel then reports that
+	 * error as a pending socket error on the next poll.
+	 */
+	memset(rx->msg, 0, sizeof(rx->msg));
+
+	for (i = 0; i < RX_RING_SLOTS; i++) {
+		rx->iov[i].iov_base = rx->slot[i];
+		rx->iov[i].iov_len = RX_SLOT_SIZE;
+		rx->msg[i].msg_hdr.msg_iov = &rx->iov[i];
+		rx->msg[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+static void account_batch(struct _GAttrib *attrib, guint pdus)
+{
+	GAttribStats *stats = &attrib->stats;
+	guint bucket = 0;
+
+	if (pdus == 0)
+		return;
+
+	stats->rx_wakeups++;
+	stats->rx_pdus += pdus;
+
+	if (pdus > stats->rx_max_batch)
+		stats->rx_max_batch = pdus;
+
+	while ((pdus >>= 1) && bucket < GATTRIB_RX_BATCH_BUCKETS - 1)
+		bucket++;
+
+	stats->rx_batch_hist[bucket]++;
+}
+
+/*
+ * Read sharing: a read identical to one queued or on air joins its
+ * transaction instead of going out again, see command_complete(). Reads of
+ * handles with a TTL are also answered from attrib->read_cache; hits are
+ * delivered from the loop, never from within g_attrib_send().
+ */
+static void read_cache_store(struct _GAttrib *attrib, struct command *cmd,
+					const guint8 *pdu, guint16 len)
+{
+	struct cached_read *r;
+	gpointer key;
+	guint ttl;
+
+	if (!read_key(cmd->pdu, cmd->len, &key))
+		return;
+
+	ttl = GPOINTER_TO_UINT(g_hash_table_lookup(attrib->read_ttl,
+				GUINT_TO_POINTER(READ_KEY_HANDLE(key))));
+
+	/* The value may predate a Service Changed or a disconnection */
+	if (ttl == 0 || cmd->queued_at < attrib->reads_reset)
+		return;
+
+	r = g_try_malloc(sizeof(*r) + len);
+	if (r == NULL)
+		return;
+
+	r->expires = g_get_monotonic_time() + (gint64) ttl * 1000;
+	r->len = len;
+	memcpy(r->pdu, pdu, len);
+
+	g_hash_table_replace(attrib->read_cache, key, r);
+}
+
+static gboolean hits_deliver(gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	struct command *c;
+
+	attrib->hits_source = 0;
+
+	g_attrib_ref(attrib);
+
+	while ((c = command_pop_head(&attrib->hits))) {
+		command_index_remove(attrib, c);
+
+		if (c->func)
+			c->func(0, c->pdu, c->len, c->user_data);
+
+		command_destroy(attrib, c);
+	}
+
+	g_attrib_unref(attrib);
+
+	return FALSE;
+}
+
+static bool read_cached(struct _GAttrib *attrib, struct command *c,
+								gpointer key)
+{
+	struct cached_read *r;
+
+	r = g_hash_table_lookup(attrib->read_cache, key);
+	if (r == NULL)
+		return false;
+
+	/* The buffer is too small for it after an MTU change */
+	if (r->expires <= c->queued_at || r->len > c->size) {
+		g_hash_table_remove(attrib->read_cache, key);
+		return false;
+	}
+
+	memcpy(c->pdu, r->pdu, r->len);
+	c->len = r->len;
+	c->hit = true;
+
+	g_queue_push_tail_link(&attrib->hits, &c->link);
+	command_index_add(attrib, c);
+	attrib->stats.read_hits++;
+
+	if (attrib->hits_source == 0)
+		attrib->hits_source = io_loop_add_timeout(attrib->loop, 0,
+						hits_deliver, attrib, NULL);
+
+	return true;
+}
+
+static bool read_join(struct _GAttrib *attrib, struct command *c,
+								gpointer key)
+{
+	struct command *leader;
+
+	leader = g_hash_table_lookup(attrib->reads, key);
+	if (leader == NULL || leader->priority < c->priority)
+		return false;
+
+	c->leader = leader;
+	g_queue_push_tail_link(&leader->joined, &c->link);
+	command_index_add(attrib, c);
+	attrib->stats.read_shared++;
+
+	return true;
+}
+
+static void read_share(struct _GAttrib *attrib, struct command *c,
+								gpointer key)
+{
+	struct command *old;
+
+	old = g_hash_table_lookup(attrib->reads, key);
+	if (old)
+		old->shared = false;
+
+	g_hash_table_insert(attrib->reads, key, c);
+	c->shared = true;
+}
+
+static gboolean cached_in_range(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	guint16 *range = user_data;
+	guint16 handle = READ_KEY_HANDLE(key);
+
+	return handle >= range[0] && handle <= range[1];
+}
+
+static gboolean shared_in_range(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct command *cmd = value;
+
+	if (!cached_in_range(key, value, user_data))
+		return FALSE;
+
+	cmd->shared = false;
+
+	return TRUE;
+}
+
+static void reads_invalidate(struct _GAttrib *attrib, guint16 start,
+								guint16 end)
+{
+	guint16 range[2] = { start, end };
+
+	attrib->reads_reset = g_get_monotonic_time();
+
+	g_hash_table_foreach_remove(attrib->read_cache, cached_in_range,
+									range);
+	g_hash_table_foreach_remove(attrib->reads, shared_in_range, range);
+}
+
+/*
+ * A write queued after a read must not be answered by that read or by the
+ * cache. An Execute Write may write any handle prepared before it.
+ */
+static void reads_written(struct _GAttrib *attrib, const guint8 *pdu,
+								guint16 len)
+{
+	guint16 handle;
+
+	switch (pdu[0]) {
+	case ATT_OP_WRITE_REQ:
+	case ATT_OP_WRITE_CMD:
+	case ATT_OP_SIGNED_WRITE_CMD:
+	case ATT_OP_PREP_WRITE_REQ:
+		if (len < 3)
+			return;
+
+		handle = att_get_u16(&pdu[1]);
+		reads_invalidate(attrib, handle, handle);
+		break;
+	case ATT_OP_EXEC_WRITE_REQ:
+		reads_invalidate(attrib, 0x0001, 0xffff);
+		break;
+	}
+}
+
+/* Returns FALSE if the read watch should be removed */
+static gboolean process_pdu(struct _GAttrib *attrib, const uint8_t *buf,
+								gsize len)
+{
+	/* Listeners of an additional bearer are those of its parent */
+	struct _GAttrib *events = attrib->parent ? attrib->parent : attrib;
+	struct command *cmd;
+	uint8_t status;
+	gint64 now = g_get_monotonic_time();
+
+	if ((buf[0] == ATT_OP_HANDLE_NOTIFY || buf[0] == ATT_OP_HANDLE_IND) &&
+								len >= 3)
+		notify_timing_add(events, att_get_u16(&buf[1]), now);
+
+	/* The confirmation has to go back on the same bearer */
+	if (buf[0] == ATT_OP_HANDLE_IND)
+		events->ind_bearer = attrib->bearer_index;
+
+	dispatch_event(events, buf, len);
+
+	if (!is_response(buf[0]))
+		return TRUE;
+
+	cmd = command_pop_head(attrib->requests);
+	if (cmd == NULL) {
+		/* Keep the watch if we have events to report */
+		return events->events != NULL;
+	}
+
+	if (cmd->sent_at && cmd->opcode < RTT_SLOTS)
+		hist_add(&attrib->rtt[cmd->opcode], now - cmd->sent_at);
+
+	if (buf[0] == ATT_OP_ERROR)
+		status = len > 4 ? buf[4] : ATT_ECODE_IO;
+	else if (cmd->expected != buf[0])
+		status = ATT_ECODE_IO;
+	else
+		status = 0;
+
+	if (!g_queue_is_empty(attrib->requests) ||
+					!g_queue_is_empty(attrib->responses))
+		wake_up_sender(attrib);
+
+	if (status == 0)
+		read_cache_store(attrib, cmd, buf, len);
+
+	command_complete(attrib, cmd, status, buf, len);
+	command_destroy(attrib, cmd);
+
+	return TRUE;
+}
+
+static gboolean received_data(int fd, GIOCondition cond, gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	struct _GAttrib *parent = attrib->parent;
+	struct rx_ring *rx = attrib->rx;
+	gboolean keep = TRUE;
+	guint pdus = 0;
+	int fills, n, i;
+
+	if (attrib->stale)
+		return FALSE;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)) {
+		attrib->read_watch = 0;
+		reads_invalidate(attrib, 0x0001, 0xffff);
+		return FALSE;
+	}
+
+	g_attrib_ref(attrib);
+	g_attrib_ref(parent);
+
+	for (fills = 0; keep && fills < RX_MAX_FILLS; fills++) {
+		rx_ring_reset(rx);
+
+		n = recvmmsg(fd, rx->msg, RX_RING_SLOTS, MSG_DONTWAIT, NULL);
+		attrib->stats.rx_reads++;
+		if (n <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EINTR)
+				error("recvmmsg: %s", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n && keep && !attrib->stale; i++) {
+			/* A zero length datagram means the peer went away */
+			if (rx->msg[i].msg_len == 0)
+				break;
+
+			pdus++;
+			keep = process_pdu(attrib, rx->slot[i],
+							rx->msg[i].msg_len);
+		}
+
+		if (i < n || n < RX_RING_SLOTS || attrib->stale)
+			break;
+	}
+
+	events_flush(parent ? parent : attrib);
+	account_batch(attrib, pdus);
+
+	if (attrib->stale)
+		keep = FALSE;
+
+	g_attrib_unref(parent);
+	g_attrib_unref(attrib);
+
+	return keep;
+}
+
+static guint command_next_id(struct _GAttrib *attrib)
+{
+	/* g_attrib_submit() hands out ids from other threads */
+	return __sync_add_and_fetch(&attrib->next_cmd_id, 1);
+}
+
+/*
+ * Requests are kept in priority order, FIFO within a priority. A command
+ * never goes ahead of the request on the air, whose response is matched
+ * against the head of the queue, nor into a batch partly on the air.
+ */
+static void request_insert(GQueue *queue, struct command *c)
+{
+	struct command *tail = g_queue_peek_tail(queue);
+	GList *l;
+	gint n = 0;
+
+	/* Common case, nothing of lower priority is waiting */
+	if (tail == NULL || tail->priority >= c->priority) {
+		g_queue_push_tail_link(queue, &c->link);
+		return;
+	}
+
+	for (l = queue->head; l; l = l->next, n++) {
+		struct command *cmd = l->data;
+
+		if (!cmd->sent && cmd->tx_next == 0 &&
+					cmd->priority < c->priority)
+			break;
+	}
+
+	g_queue_push_nth_link(queue, l ? n : -1, &c->link);
+}
+
+/*
+ * Follow-ups of a compound procedure go first, but never ahead of a
+ * request or batch already (partly) on air: its response would be matched
+ * to the follow-up.
+ */
+static void request_push_front(GQueue *queue, struct command *c)
+{
+	GList *l;
+	gint n = 0;
+
+	for (l = queue->head; l; l = l->next, n++) {
+		struct command *cmd = l->data;
+
+		if (!cmd->sent && cmd->tx_next == 0)
+			break;
+	}
+
+	g_queue_push_nth_link(queue, l ? n : -1, &c->link);
+}
+
+static void command_enqueue(struct _GAttrib *attrib, struct command *c,
+								bool front)
+{
+	GQueue *queue;
+
+	if (is_response(c->opcode))
+		queue = attrib->responses;
+	else
+		queue = attrib->requests;
+
+	/* Don't re-order responses even if an ID is given */
+	if (is_response(c->opcode))
+		g_queue_push_tail_link(queue, &c->link);
+	else if (front)
+		request_push_front(queue, c);
+	else
+		request_insert(queue, c);
+
+	command_index_add(attrib, c);
+	c->queued = true;
+	queue_grew(attrib, c);
+
+	/*
+	 * If a command was added to the queue and it was empty before, wake up
+	 * the sender. If the sender was already woken up by the second queue,
+	 * wake_up_sender will just return.
+	 */
+	if (g_queue_get_length(queue) == 1)
+		wake_up_sender(attrib);
+}
+
+/*
+ * g_attrib_submit() pushes onto attrib->submitted, a lock-free LIFO linked
+ * through next_free, and kicks submit_fd when it finds the stack empty.
+ * Here the IO thread takes the whole stack with one exchange and queues it
+ * in submission order.
+ */
+static gboolean submitted_data(int fd, GIOCondition cond, gpointer data)
+{
+	struct _GAttrib *attrib = data;
+	struct command *head, *c, *fifo = NULL;
+	uint64_t val;
+	guint n = 0;
+
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		error("submit eventfd: %s", strerror(errno));
+
+	head = __atomic_exchange_n(&attrib->submitted, NULL, __ATOMIC_ACQUIRE);
+
+	if (attrib->stale) {
+		submitted_free(head);
+		return TRUE;
+	}
+
+	while ((c = head)) {
+		head = c->next_free;
+		c->next_free = fifo;
+		fifo = c;
+	}
+
+	while ((c = fifo)) {
+		fifo = c->next_free;
+		c->next_free = NULL;
+		c->link.data = c;
+		c->timer.data = c;
+		reads_written(attrib, c->pdu, c->len);
+		command_enqueue(attrib, c, false);
+		n++;
+	}
+
+	if (n > 0) {
+		attrib->stats.cmd_allocs += n;
+		attrib->stats.submits += n;
+		attrib->stats.submit_batches++;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Additional bearers are GAttribs of their own, with attrib as parent.
+ * A request sent on one of them stays in attrib->delegated, under its id
+ * in attrib, while a copy is queued on the bearer. The copy reports back
+ * through bearer_result() and bearer_released().
+ */
+static bool bearer_usable(struct _GAttrib *attrib, guint8 index)
+{
+	struct _GAttrib *b;
+
+	if (index >= attrib->n_bearers)
+		return false;
+
+	b = attrib->bearers[index];
+
+	return b == attrib || (!b->stale && b->read_watch > 0);
+}
+
+static guint8 bearer_pick(struct _GAttrib *attrib, struct command *c)
+{
+	guint load, best_load = G_MAXUINT;
+	struct route *r;
+	guint16 handle;
+	guint8 i, best = 0;
+
+	if (c->opcode == ATT_OP_HANDLE_CNF)
+		return bearer_usable(attrib, attrib->ind_bearer) ?
+						attrib->ind_bearer : 0;
+
+	/*
+	 * Server responses, the MTU exchange and the prepare queue, which
+	 * is kept per bearer, belong to the first bearer. Prepared writes
+	 * don't wait for a route elsewhere, or the Execute Write would
+	 * commit another bearer's queue.
+	 */
+	switch (c->opcode) {
+	case ATT_OP_MTU_REQ:
+	case ATT_OP_PREP_WRITE_REQ:
+	case ATT_OP_EXEC_WRITE_REQ:
+		return 0;
+	}
+
+	if (is_response(c->opcode))
+		return 0;
+
+	handle = route_handle(c);
+	r = handle ? g_hash_table_lookup(attrib->routes,
+					GUINT_TO_POINTER(handle)) : NULL;
+	if (r && bearer_usable(attrib, r->bearer))
+		return r->bearer;
+
+	/* Commands don't occupy a bearer, keep them in order on the first */
+	if (c->expected == 0)
+		return 0;
+
+	for (i = 0; i < attrib->n_bearers; i++) {
+		if (!bearer_usable(attrib, i))
+			continue;
+
+		load = g_queue_get_length(attrib->bearers[i]->requests);
+		if (load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * A follow-up under the id of an earlier request goes on the same bearer,
+ * whether that request is answered and running its callback or still
+ * queued.
+ */
+static bool bearer_follow(struct _GAttrib *attrib, guint id, guint8 *bearer)
+{
+	struct command *c;
+
+	if (id == 0)
+		return false;
+
+	if (id == attrib->completing_id) {
+		*bearer = attrib->completing_bearer;
+	} else {
+		c = g_hash_table_lookup(attrib->commands, GUINT_TO_POINTER(id));
+		if (c == NULL)
+			return false;
+
+		*bearer = c->owner ? c->bearer : 0;
+	}
+
+	return bearer_usable(attrib, *bearer);
+}
+
+static void bearer_result(guint8 status, const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct command *c = user_data;
+	struct _GAttrib *attrib = c->owner;
+
+	if (status == 0)
+		read_cache_store(attrib, c, pdu, len);
+
+	command_complete(attrib, c, status, pdu, len);
+}
+
+static void bearer_released(gpointer user_data)
+{
+	struct command *c = user_data;
+	struct _GAttrib *attrib = c->owner;
+
+	g_queue_unlink(&attrib->delegated, &c->link);
+	command_destroy(attrib, c);
+}
+
+static bool bearer_delegate(struct _GAttrib *attrib, struct command *c,
+						guint8 index, bool front)
+{
+	struct _GAttrib *b = attrib->bearers[index];
+	struct command *d;
+
+	d = command_alloc(b, c->len);
+	if (d == NULL)
+		return false;
+
+	d->opcode = c->opcode;
+	d->expected = c->expected;
+	memcpy(d->pdu, c->pdu, c->len);
+	d->len = c->len;
+	d->priority = c->priority;
+	d->queued_at = c->queued_at;
+	d->deadline = c->deadline;
+	d->func = bearer_result;
+	d->user_data = c;
+	d->notify = bearer_released;
+	d->id = command_next_id(b);
+
+	c->owner = attrib;
+	c->bearer = index;
+	c->bearer_id = d->id;
+	g_queue_push_tail_link(&attrib->delegated, &c->link);
+	command_index_add(attrib, c);
+	attrib->stats.delegated++;
+
+	/* Counts against attrib's watermarks until the bearer is done */
+	c->queued = true;
+	queue_grew(attrib, c);
+
+	if (d->deadline > 0)
+		timer_arm(b, d, d->deadline);
+
+	command_enqueue(b, d, front);
+
+	return true;
+}
+
+/* attrib goes away, the bearers may still be finishing a batch */
+static void bearers_detach(struct _GAttrib *attrib)
+{
+	struct command *c, *d;
+	guint i;
+
+	while ((c = command_pop_head(&attrib->delegated))) {
+		d = g_hash_table_lookup(attrib->bearers[c->bearer]->commands,
+					GUINT_TO_POINTER(c->bearer_id));
+		if (d) {
+			d->func = NULL;
+			d->notify = NULL;
+		}
+
+		command_destroy(attrib, c);
+	}
+
+	for (i = 1; i < attrib->n_bearers; i++) {
+		attrib->bearers[i]->parent = NULL;
+		g_attrib_unref(attrib->bearers[i]);
+	}
+
+	attrib->n_bearers = 0;
+}
+
+GAttrib *g_attrib_new_with_loop(GIOChannel *io, uint16_t mtu,
+						struct io_loop *loop)
+{
+	struct _GAttrib *attrib;
+
+	if (mtu < ATT_DEFAULT_LE_MTU || loop == NULL)
+		return NULL;
+
+	g_io_channel_set_encoding(io, NULL, NULL);
+	g_io_channel_set_buffered(io, FALSE);
+	g_io_channel_set_flags(io, g_io_channel_get_flags(io) |
+					G_IO_FLAG_NONBLOCK, NULL);
+
+	attrib = g_try_new0(struct _GAttrib, 1);
+	if (attrib == NULL)
+		return NULL;
+
+	attrib->buf = g_malloc0(mtu);
+	attrib->buflen = mtu;
+	attrib->rx = g_malloc(sizeof(*attrib->rx));
+
+	attrib->io = g_io_channel_ref(io);
+	attrib->loop = loop;
+	attrib->requests = g_queue_new();
+	attrib->responses = g_queue_new();
+	attrib->event_table = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL,
+					(GDestroyNotify) g_slist_free);
+	attrib->notify_timing = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, g_free);
+	attrib->commands = g_hash_table_new(g_direct_hash, g_direct_equal);
+	attrib->reads = g_hash_table_new(g_direct_hash, g_direct_equal);
+	attrib->read_ttl = g_hash_table_new(g_direct_hash, g_direct_equal);
+	attrib->read_cache = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, g_free);
+	attrib->wheel.epoch = g_get_monotonic_time();
+
+	attrib->read_watch = io_loop_add_watch(attrib->loop,
+			g_io_channel_unix_get_fd(attrib->io),
+			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+			received_data, attrib, NULL);
+
+	attrib->submit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (attrib->submit_fd >= 0)
+		attrib->submit_watch = io_loop_add_watch(attrib->loop,
+					attrib->submit_fd, G_IO_IN,
+					submitted_data, attrib, NULL);
 
 	return g_attrib_ref(attrib);
 }
 
-guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
+GAttrib *g_attrib_new_with_mtu(GIOChannel *io, uint16_t mtu)
+{
+	return g_attrib_new_with_loop(io, mtu, io_loop_default());
+}
+
+GAttrib *g_attrib_new(GIOChannel *io)
+{
+	uint16_t imtu;
+	uint16_t cid;
+	GError *gerr = NULL;
+
+	bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &imtu,
+				BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
+	if (gerr) {
+		error("%s", gerr->message);
+		g_error_free(gerr);
+		return NULL;
+	}
+
+	return g_attrib_new_with_mtu(io,
+				(cid == ATT_CID) ? ATT_DEFAULT_LE_MTU : imtu);
+}
+
+static guint attrib_send(struct _GAttrib *attrib, guint id,
+			const guint8 *pdu, guint16 len, guint timeout_ms,
+			GAttribPriority priority, GAttribResultFunc func,
+			gpointer user_data, GDestroyNotify notify);
+
+guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify)
+{
+	return attrib_send(attrib, id, pdu, len, 0, G_ATTRIB_PRIORITY_NORMAL,
+					func, user_data, notify);
+}
+
+guint g_attrib_send_with_deadline(GAttrib *attrib, guint id,
+			const guint8 *pdu, guint16 len, guint timeout_ms,
+			GAttribResultFunc func, gpointer user_data,
+			GDestroyNotify notify)
+{
+	return attrib_send(attrib, id, pdu, len, timeout_ms,
+				G_ATTRIB_PRIORITY_NORMAL, func, user_data,
+				notify);
+}
+
+guint g_attrib_send_with_priority(GAttrib *attrib, guint id,
+			const guint8 *pdu, guint16 len,
+			GAttribPriority priority, GAttribResultFunc func,
+			gpointer user_data, GDestroyNotify notify)
+{
+	return attrib_send(attrib, id, pdu, len, 0, priority, func, user_data,
+								notify);
+}
+
+static guint attrib_send(struct _GAttrib *attrib, guint id,
+			const guint8 *pdu, guint16 len, guint timeout_ms,
+			GAttribPriority priority, GAttribResultFunc func,
+			gpointer user_data, GDestroyNotify notify)
+{
+	struct command *c;
+	uint8_t opcode;
+	guint8 bearer;
+	gpointer key;
+
+	if (attrib->stale)
+		return 0;
+
+	c = command_alloc(attrib, len);
+	if (c == NULL)
+		return 0;
+
+	opcode = pdu[0];
+
+	c->opcode = opcode;
+	c->expected = opcode2expected(opcode);
+	memcpy(c->pdu, pdu, len);
+	c->len = len;
+	c->func = func;
+	c->user_data = user_data;
+	c->notify = notify;
+	c->priority = priority;
+	c->queued_at = g_get_monotonic_time();
+	c->id = id ? id : command_next_id(attrib);
+
+	if (timeout_ms > 0)
+		c->deadline = c->queued_at + (gint64) timeout_ms * 1000;
+
+	reads_written(attrib, pdu, len);
+
+	if (read_key(pdu, len, &key)) {
+		if (read_cached(attrib, c, key))
+			return c->id;
+
+		/* A deadline of its own can't be met by another's request */
+		if (timeout_ms == 0 && read_join(attrib, c, key))
+			return c->id;
+
+		if (timeout_ms == 0)
+			read_share(attrib, c, key);
+
+		attrib->stats.read_misses++;
+	}
+
+	if (attrib->n_bearers > 1) {
+		if (!bearer_follow(attrib, id, &bearer))
+			bearer = bearer_pick(attrib, c);
+		route_hold(attrib, c, bearer);
+
+		if (bearer > 0) {
+			if (bearer_delegate(attrib, c, bearer, id != 0))
+				return c->id;
+
+			if (c->routed)
+				route_release(attrib, c);
+			route_hold(attrib, c, 0);
+		}
+	}
+
+	if (c->deadline > 0)
+		timer_arm(attrib, c, c->deadline);
+
+	command_enqueue(attrib, c, id != 0);
+
+	return c->id;
+}
+
+/*
+ * The command holds the PDU lengths, then the PDUs back to back, encoded
+ * straight into it. can_write_data() hands them to the socket in as few
+ * sendmmsg() calls as fit, and nothing queued later gets in between.
+ */
+guint g_attrib_send_batch(GAttrib *attrib, const struct att_write *writes,
+				guint n, GDestroyNotify notify,
+				gpointer user_data)
+{
+	struct command *c;
+	size_t len, lens;
+	guint i;
+
+	if (attrib == NULL || attrib->stale || n == 0 || n > G_MAXUINT16)
+		return 0;
+
+	len = enc_write_cmd_batch(writes, n, attrib->buflen, NULL, 0, NULL);
+	lens = n * sizeof(guint16);
+	if (len == 0 || len + lens > G_MAXUINT16)
+		return 0;
+
+	c = command_alloc(attrib, len + lens);
+	if (c == NULL)
+		return 0;
+
+	enc_write_cmd_batch(writes, n, attrib->buflen, c->pdu + lens, len,
+						(guint16 *) c->pdu);
+
+	c->opcode = ATT_OP_WRITE_CMD;
+	c->len = len;
+	c->npdus = n;
+	c->tx_offset = lens;
+	c->user_data = user_data;
+	c->notify = notify;
+	c->priority = G_ATTRIB_PRIORITY_NORMAL;
+	c->queued_at = g_get_monotonic_time();
+	c->id = command_next_id(attrib);
+
+	attrib->stats.batched += n;
+
+	for (i = 0; i < n; i++)
+		reads_invalidate(attrib, writes[i].handle, writes[i].handle);
+
+	command_enqueue(attrib, c, false);
+
+	return c->id;
+}
+
+guint g_attrib_submit(GAttrib *attrib, const guint8 *pdu, guint16 len,
 			GAttribResultFunc func, gpointer user_data,
 			GDestroyNotify notify)
 {
-	struct command *c;
-	GQueue *queue;
-	uint8_t opcode;
+	struct command *c, *head;
+	uint64_t val = 1;
 
-	if (attrib->stale)
+	if (attrib == NULL || attrib->submit_fd < 0 || len == 0)
 		return 0;
 
-	c = g_try_new0(struct command, 1);
+	/* Not from the pool, that belongs to the IO thread */
+	c = g_try_malloc0(sizeof(*c) + len);
 	if (c == NULL)
 		return 0;
 
-	opcode = pdu[0];
-
-	c->opcode = opcode;
-	c->expected = opcode2expected(opcode);
-	c->pdu = g_malloc(len);
+	c->size = len;
+	c->opcode = pdu[0];
+	c->expected = opcode2expected(pdu[0]);
 	memcpy(c->pdu, pdu, len);
 	c->len = len;
 	c->func = func;
 	c->user_data = user_data;
 	c->notify = notify;
+	c->queued_at = g_get_monotonic_time();
+	c->priority = G_ATTRIB_PRIORITY_NORMAL;
+	c->id = command_next_id(attrib);
 
-	if (is_response(opcode))
-		queue = attrib->responses;
-	else
-		queue = attrib->requests;
-
-	if (id) {
-		c->id = id;
-		if (!is_response(opcode))
-			g_queue_push_head(queue, c);
-		else
-			/* Don't re-order responses even if an ID is given */
-			g_queue_push_tail(queue, c);
-	} else {
-		c->id = ++attrib->next_cmd_id;
-		g_queue_push_tail(queue, c);
-	}
+	head = __atomic_load_n(&attrib->submitted, __ATOMIC_RELAXED);
+	do {
+		c->next_free = head;
+	} while (!__atomic_compare_exchange_n(&attrib->submitted, &head, c,
+					true, __ATOMIC_RELEASE,
+					__ATOMIC_RELAXED));
 
-	/*
-	 * If a command was added to the queue and it was empty before, wake up
-	 * the sender. If the sender was already woken up by the second queue,
-	 * wake_up_sender will just return.
-	 */
-	if (g_queue_get_length(queue) == 1)
-		wake_up_sender(attrib);
+	/* Only the push that found the stack empty needs to wake the loop */
+	if (head == NULL && write(attrib->submit_fd, &val, sizeof(val)) < 0)
+		error("submit eventfd: %s", strerror(errno));
 
 	return c->id;
 }
 
-static int command_cmp_by_id(gconstpointer a, gconstpointer b)
+static struct command *command_find(struct _GAttrib *attrib, guint id,
+							GQueue **queue)
 {
-	const struct command *cmd = a;
-	guint id = GPOINTER_TO_UINT(b);
+	struct command *cmd;
+
+	cmd = g_hash_table_lookup(attrib->commands, GUINT_TO_POINTER(id));
+	if (cmd == NULL)
+		return NULL;
 
-	return cmd->id - id;
+	if (cmd->leader)
+		*queue = &cmd->leader->joined;
+	else if (cmd->owner)
+		*queue = &attrib->delegated;
+	else if (cmd->hit)
+		*queue = &attrib->hits;
+	else
+		*queue = is_response(cmd->opcode) ? attrib->responses :
+							attrib->requests;
+
+	return cmd;
 }
 
-gboolean g_attrib_cancel(GAttrib *attrib, guint id)
+gboolean g_attrib_set_deadline(GAttrib *attrib, guint id, guint timeout_ms)
 {
-	GList *l = NULL;
 	struct command *cmd;
 	GQueue *queue;
 
 	if (attrib == NULL)
 		return FALSE;
 
-	queue = attrib->requests;
-	if (queue)
-		l = g_queue_find_custom(queue, GUINT_TO_POINTER(id),
-					command_cmp_by_id);
-	if (l == NULL) {
-		queue = attrib->responses;
-		if (!queue)
-			return FALSE;
-		l = g_queue_find_custom(queue, GUINT_TO_POINTER(id),
-					command_cmp_by_id);
-	}
+	cmd = command_find(attrib, id, &queue);
+	if (cmd == NULL || cmd->expired || cmd->leader || cmd->hit)
+		return FALSE;
 
-	if (l == NULL)
+	if (cmd->shared)
+		read_unshare(attrib, cmd);
+
+	if (cmd->owner)
+		return g_attrib_set_deadline(attrib->bearers[cmd->bearer],
+						cmd->bearer_id, timeout_ms);
+
+	if (timeout_ms > 0)
+		cmd->deadline = g_get_monotonic_time() +
+						(gint64) timeout_ms * 1000;
+	else
+		cmd->deadline = 0;
+
+	if (cmd->sent)
+		request_timer_arm(attrib, cmd);
+	else if (cmd->deadline > 0)
+		timer_arm(attrib, cmd, cmd->deadline);
+	else
+		timer_disarm(&attrib->wheel, cmd);
+
+	return TRUE;
+}
+
+gboolean g_attrib_cancel(GAttrib *attrib, guint id)
+{
+	struct command *cmd;
+	GQueue *queue;
+
+	if (attrib == NULL)
+		return FALSE;
+
+	cmd = command_find(attrib, id, &queue);
+	if (cmd == NULL)
 		return FALSE;
 
-	cmd = l->data;
+	if (cmd->owner) {
+		cmd->func = NULL;
+
+		/* The bearer releases it, now or once it is answered */
+		if (g_queue_is_empty(&cmd->joined))
+			g_attrib_cancel(attrib->bearers[cmd->bearer],
+							cmd->bearer_id);
+		return TRUE;
+	}
 
 	if (cmd == g_queue_peek_head(queue) && cmd->sent)
 		cmd->func = NULL;
+	else if (!g_queue_is_empty(&cmd->joined))
+		/* Still needed by the reads sharing it */
+		cmd->func = NULL;
 	else {
-		g_queue_remove(queue, cmd);
-		command_destroy(cmd);
+		g_queue_unlink(queue, &cmd->link);
+		command_destroy(attrib, cmd);
 	}
 
 	return TRUE;
 }
 
-static gboolean cancel_all_per_queue(GQueue *queue)
+static gboolean cancel_all_per_queue(struct _GAttrib *attrib, GQueue *queue)
 {
-	struct command *c, *head = NULL;
+	struct command *c, *j, *head = NULL;
 	gboolean first = TRUE;
 
 	if (queue == NULL)
 		return FALSE;
 
-	while ((c = g_queue_pop_head(queue))) {
+	while ((c = command_pop_head(queue))) {
 		if (first && c->sent) {
 			/* If the command was sent ignore its callback ... */
 			c->func = NULL;
 			head = c;
+
+			while ((j = command_pop_head(&c->joined)))
+				command_destroy(attrib, j);
 			continue;
 		}
 
 		first = FALSE;
-		command_destroy(c);
+		command_destroy(attrib, c);
 	}
 
 	if (head) {
 		/* ... and put it back in the queue */
-		g_queue_push_head(queue, head);
+		g_queue_push_head_link(queue, &head->link);
 	}
 
 	return TRUE;
@@ -631,17 +2454,170 @@ static gboolean cancel_all_per_queue(GQueue *queue)
 
 gboolean g_attrib_cancel_all(GAttrib *attrib)
 {
+	struct command *c, *j;
+	GList *l, *next;
 	gboolean ret;
 
 	if (attrib == NULL)
 		return FALSE;
 
-	ret = cancel_all_per_queue(attrib->requests);
-	ret = cancel_all_per_queue(attrib->responses) && ret;
+	ret = cancel_all_per_queue(attrib, attrib->requests);
+	ret = cancel_all_per_queue(attrib, attrib->responses) && ret;
+
+	for (l = attrib->delegated.head; l; l = next) {
+		c = l->data;
+		next = l->next;
+
+		c->func = NULL;
+		while ((j = command_pop_head(&c->joined)))
+			command_destroy(attrib, j);
+
+		g_attrib_cancel(attrib->bearers[c->bearer], c->bearer_id);
+	}
+
+	while ((c = command_pop_head(&attrib->hits)))
+		command_destroy(attrib, c);
 
 	return ret;
 }
 
+gboolean g_attrib_set_watermarks(GAttrib *attrib, guint high_pdus,
+				guint low_pdus, gsize high_bytes,
+				gsize low_bytes, GAttribPressureFunc func,
+				gpointer user_data)
+{
+	if (attrib == NULL || low_pdus > high_pdus || low_bytes > high_bytes)
+		return FALSE;
+
+	attrib->high_pdus = high_pdus;
+	attrib->low_pdus = low_pdus;
+	attrib->high_bytes = high_bytes;
+	attrib->low_bytes = low_bytes;
+	attrib->pressure_func = func;
+	attrib->pressure_data = user_data;
+
+	return TRUE;
+}
+
+gboolean g_attrib_get_pressure(GAttrib *attrib, guint *pdus, gsize *bytes)
+{
+	if (attrib == NULL)
+		return FALSE;
+
+	if (pdus)
+		*pdus = attrib->queued_pdus;
+	if (bytes)
+		*bytes = attrib->queued_bytes;
+
+	return attrib->pressure;
+}
+
+guint g_attrib_add_bearer(GAttrib *attrib, GIOChannel *io)
+{
+	struct _GAttrib *b;
+
+	if (attrib == NULL || io == NULL || attrib->stale || attrib->parent)
+		return 0;
+
+	if (attrib->n_bearers >= GATTRIB_MAX_BEARERS)
+		return 0;
+
+	b = g_attrib_new_with_loop(io, attrib->buflen, attrib->loop);
+	if (b == NULL)
+		return 0;
+
+	if (attrib->n_bearers == 0) {
+		attrib->routes = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, g_free);
+		attrib->bearers[0] = attrib;
+		attrib->n_bearers = 1;
+	}
+
+	b->parent = attrib;
+	b->bearer_index = attrib->n_bearers;
+	attrib->bearers[attrib->n_bearers] = b;
+
+	return attrib->n_bearers++;
+}
+
+guint g_attrib_get_bearers(GAttrib *attrib)
+{
+	guint i, n = 0;
+
+	if (attrib == NULL)
+		return 0;
+
+	if (attrib->n_bearers == 0)
+		return 1;
+
+	for (i = 0; i < attrib->n_bearers; i++)
+		if (bearer_usable(attrib, i))
+			n++;
+
+	return n;
+}
+
+gboolean g_attrib_set_read_ttl(GAttrib *attrib, guint16 handle, guint ttl_ms)
+{
+	guint16 range[2] = { handle, handle };
+
+	if (attrib == NULL || handle == 0)
+		return FALSE;
+
+	if (ttl_ms > 0) {
+		g_hash_table_insert(attrib->read_ttl, GUINT_TO_POINTER(handle),
+						GUINT_TO_POINTER(ttl_ms));
+		return TRUE;
+	}
+
+	g_hash_table_remove(attrib->read_ttl, GUINT_TO_POINTER(handle));
+	g_hash_table_foreach_remove(attrib->read_cache, cached_in_range,
+									range);
+
+	return TRUE;
+}
+
+void g_attrib_invalidate_reads(GAttrib *attrib, guint16 start, guint16 end)
+{
+	if (attrib == NULL || start > end)
+		return;
+
+	reads_invalidate(attrib, start, end);
+}
+
+static void service_changed(const guint8 *pdu, guint16 len,
+							gpointer user_data)
+{
+	struct _GAttrib *attrib = user_data;
+
+	/* Opcode, handle, then the first and last affected handle */
+	if (len < 7) {
+		reads_invalidate(attrib, 0x0001, 0xffff);
+		return;
+	}
+
+	reads_invalidate(attrib, att_get_u16(&pdu[3]), att_get_u16(&pdu[5]));
+}
+
+gboolean g_attrib_watch_service_changed(GAttrib *attrib, guint16 handle)
+{
+	if (attrib == NULL)
+		return FALSE;
+
+	if (attrib->sc_event > 0) {
+		g_attrib_unregister(attrib, attrib->sc_event);
+		attrib->sc_event = 0;
+	}
+
+	if (handle == 0)
+		return TRUE;
+
+	attrib->sc_event = g_attrib_register(attrib, ATT_OP_HANDLE_IND, handle,
+						service_changed, attrib, NULL);
+
+	return attrib->sc_event > 0;
+}
+
 gboolean g_attrib_set_debug(GAttrib *attrib,
 		GAttribDebugFunc func, gpointer user_data)
 {
@@ -667,28 +2643,88 @@ gboolean g_attrib_set_mtu(GAttrib *attrib, int mtu)
 
 	attrib->buflen = mtu;
 
+	/* Pooled commands were sized for the old MTU */
+	command_pool_flush(attrib);
+
 	return TRUE;
 }
 
+static void event_index_add(struct _GAttrib *attrib, struct event *evt)
+{
+	gpointer key;
+	GSList *l;
+
+	if (evt->expected == GATTRIB_ALL_EVENTS ||
+					evt->expected == GATTRIB_ALL_REQS) {
+		attrib->any_events = g_slist_append(attrib->any_events, evt);
+		return;
+	}
+
+	key = EVENT_KEY(evt->expected, evt->handle);
+	l = g_hash_table_lookup(attrib->event_table, key);
+	g_hash_table_steal(attrib->event_table, key);
+	g_hash_table_insert(attrib->event_table, key, g_slist_append(l, evt));
+}
+
+static void event_index_remove(struct _GAttrib *attrib, struct event *evt)
+{
+	gpointer key;
+	GSList *l;
+
+	if (evt->expected == GATTRIB_ALL_EVENTS ||
+					evt->expected == GATTRIB_ALL_REQS) {
+		attrib->any_events = g_slist_remove(attrib->any_events, evt);
+		return;
+	}
+
+	key = EVENT_KEY(evt->expected, evt->handle);
+	l = g_hash_table_lookup(attrib->event_table, key);
+	g_hash_table_steal(attrib->event_table, key);
+
+	l = g_slist_remove(l, evt);
+	if (l)
+		g_hash_table_insert(attrib->event_table, key, l);
+}
+
 guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 				GAttribNotifyFunc func, gpointer user_data,
 				GDestroyNotify notify)
+{
+	return g_attrib_register_full(attrib, opcode, handle, 0, func,
+							user_data, notify);
+}
+
+guint g_attrib_register_full(GAttrib *attrib, guint8 opcode, guint16 handle,
+				GAttribRegisterFlags flags,
+				GAttribNotifyFunc func, gpointer user_data,
+				GDestroyNotify notify)
 {
 	static guint next_evt_id = 0;
 	struct event *event;
 
+	/*
+	 * Only notifications of one handle can be conflated: indications
+	 * need a confirmation each, and across handles "newest" means nothing.
+	 */
+	if ((flags & G_ATTRIB_CONFLATE) && (opcode != ATT_OP_HANDLE_NOTIFY ||
+					handle == GATTRIB_ALL_HANDLES))
+		return 0;
+
 	event = g_try_new0(struct event, 1);
 	if (event == NULL)
 		return 0;
 
 	event->expected = opcode;
 	event->handle = handle;
+	event->conflate = (flags & G_ATTRIB_CONFLATE) != 0;
 	event->func = func;
 	event->user_data = user_data;
 	event->notify = notify;
-	event->id = ++next_evt_id;
+	/* Connections may live on different IO threads */
+	event->id = __sync_add_and_fetch(&next_evt_id, 1);
 
 	attrib->events = g_slist_append(attrib->events, event);
+	event_index_add(attrib, event);
 
 	return event->id;
 }
@@ -731,11 +2767,29 @@ gboolean g_attrib_unregister(GAttrib *attrib, guint id)
 	evt = l->data;
 
 	attrib->events = g_slist_remove(attrib->events, evt);
+	event_index_remove(attrib, evt);
 
-	if (evt->notify)
-		evt->notify(evt->user_data);
+	if (evt->held)
+		g_queue_remove(&attrib->held, evt);
 
-	g_free(evt);
+	event_destroy(evt);
+
+	return TRUE;
+}
+
+gboolean g_attrib_get_conflated(GAttrib *attrib, guint id, guint64 *dropped)
+{
+	GSList *l;
+
+	if (attrib == NULL)
+		return FALSE;
+
+	l = g_slist_find_custom(attrib->events, GUINT_TO_POINTER(id),
+							event_cmp_by_id);
+	if (l == NULL || dropped == NULL)
+		return FALSE;
+
+	*dropped = ((struct event *) l->data)->dropped;
 
 	return TRUE;
 }
@@ -747,17 +2801,114 @@ gboolean g_attrib_unregister_all(GAttrib *attrib)
 	if (attrib->events == NULL)
 		return FALSE;
 
-	for (l = attrib->events; l; l = l->next) {
-		struct event *evt = l->data;
-
-		if (evt->notify)
-			evt->notify(evt->user_data);
+	g_queue_clear(&attrib->held);
 
-		g_free(evt);
-	}
+	for (l = attrib->events; l; l = l->next)
+		event_destroy(l->data);
 
 	g_slist_free(attrib->events);
 	attrib->events = NULL;
 
+	g_slist_free(attrib->any_events);
+	attrib->any_events = NULL;
+
+	g_hash_table_remove_all(attrib->event_table);
+
+	return TRUE;
+}
+
+gboolean g_attrib_get_stats(GAttrib *attrib, GAttribStats *stats)
+{
+	if (attrib == NULL || stats == NULL)
+		return FALSE;
+
+	*stats = attrib->stats;
+
+	return TRUE;
+}
+
+void g_attrib_reset_stats(GAttrib *attrib)
+{
+	if (attrib == NULL)
+		return;
+
+	memset(&attrib->stats, 0, sizeof(attrib->stats));
+	memset(attrib->rtt, 0, sizeof(attrib->rtt));
+	memset(attrib->wait, 0, sizeof(attrib->wait));
+	g_hash_table_remove_all(attrib->notify_timing);
+}
+
+gboolean g_attrib_get_rtt(GAttrib *attrib, guint8 opcode,
+						GAttribHistogram *hist)
+{
+	if (attrib == NULL || hist == NULL || opcode >= RTT_SLOTS)
+		return FALSE;
+
+	*hist = attrib->rtt[opcode];
+
+	return TRUE;
+}
+
+gboolean g_attrib_get_queue_wait(GAttrib *attrib, GAttribQueue queue,
+						GAttribHistogram *hist)
+{
+	if (attrib == NULL || hist == NULL)
+		return FALSE;
+
+	*hist = attrib->wait[queue == G_ATTRIB_QUEUE_RESPONSES];
+
+	return TRUE;
+}
+
+gboolean g_attrib_get_notify_timing(GAttrib *attrib, guint16 handle,
+						GAttribNotifyTiming *timing)
+{
+	struct notify_timing *t;
+
+	if (attrib == NULL || timing == NULL)
+		return FALSE;
+
+	t = g_hash_table_lookup(attrib->notify_timing,
+						GUINT_TO_POINTER(handle));
+	if (t == NULL)
+		return FALSE;
+
+	memset(timing, 0, sizeof(*timing));
+	timing->count = t->count;
+
+	if (t->count < 2)
+		return TRUE;
+
+	timing->mean_interval_us = t->sum_interval / (t->count - 1);
+	timing->min_interval_us = t->min_interval;
+	timing->max_interval_us = t->max_interval;
+	timing->jitter_us = t->jitter16 >> 4;
+
 	return TRUE;
 }
+
+guint64 g_attrib_histogram_percentile(const GAttribHistogram *hist,
+								double pct)
+{
+	guint64 rank, seen = 0;
+	int i;
+
+	if (hist == NULL || hist->count == 0)
+		return 0;
+
+	rank = (guint64) (hist->count * pct / 100.0);
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < GATTRIB_HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+
+	/* Upper bound of the bucket, but never above the largest sample */
+	if (i >= GATTRIB_HIST_BUCKETS - 1)
+		return hist->max_us;
+
+	return MIN((G_GUINT64_CONSTANT(2) << i) - 1, hist->max_us);
+}
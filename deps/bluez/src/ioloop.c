@@ -0,0 +1,645 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2015  Nod Labs
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <glib.h>
+#include <glib-unix.h>
+
+#include <bluez/bluetooth/ioloop.h>
+
+#include "log.h"
+
+#define MAX_EPOLL_EVENTS 16
+
+/* Watches a single dispatch round can run for one fd */
+#define MAX_FD_WATCHES 8
+
+struct epoll_watch {
+	guint id;
+	int fd;
+	GIOCondition cond;
+	IOLoopFunc func;
+	gpointer user_data;
+	GDestroyNotify destroy;
+};
+
+/* epoll takes an fd once, all watches on it share the registration */
+struct epoll_fd {
+	int fd;
+	uint32_t events;
+	GSList *watches;
+};
+
+struct epoll_timeout {
+	guint id;
+	guint ms;
+	gint64 expires;
+	GSourceFunc func;
+	gpointer user_data;
+	GDestroyNotify destroy;
+};
+
+struct epoll_loop {
+	struct io_loop loop;
+	int epoll_fd;
+	int timer_fd;
+	int event_fd;
+	guint next_id;
+	GHashTable *watches;
+	GHashTable *fds;
+	GHashTable *timeouts;
+	GList *timeout_list;	/* sorted by expiry */
+	gint64 armed;		/* expiry timer_fd is set for, 0 if idle */
+};
+
+static guint glib_add_watch(struct io_loop *loop, int fd, GIOCondition cond,
+				IOLoopFunc func, gpointer user_data,
+				GDestroyNotify destroy)
+{
+	return g_unix_fd_add_full(G_PRIORITY_DEFAULT, fd, cond, func,
+							user_data, destroy);
+}
+
+static guint glib_add_timeout(struct io_loop *loop, guint ms,
+				GSourceFunc func, gpointer user_data,
+				GDestroyNotify destroy)
+{
+	return g_timeout_add_full(G_PRIORITY_DEFAULT, ms, func, user_data,
+								destroy);
+}
+
+static void glib_remove(struct io_loop *loop, guint id)
+{
+	g_source_remove(id);
+}
+
+static int glib_get_fd(struct io_loop *loop)
+{
+	return -1;
+}
+
+static gboolean glib_dispatch_expired(gpointer user_data)
+{
+	return FALSE;
+}
+
+static int glib_dispatch(struct io_loop *loop, int timeout)
+{
+	GSource *source;
+	gboolean ret;
+
+	if (timeout <= 0)
+		return g_main_context_iteration(NULL, timeout != 0);
+
+	/* GLib has no timeout for one iteration, a source for it ends it */
+	source = g_timeout_source_new(timeout);
+	g_source_set_callback(source, glib_dispatch_expired, NULL, NULL);
+	g_source_attach(source, NULL);
+
+	ret = g_main_context_iteration(NULL, TRUE);
+
+	g_source_destroy(source);
+	g_source_unref(source);
+
+	return ret;
+}
+
+static void glib_wakeup(struct io_loop *loop)
+{
+	g_main_context_wakeup(NULL);
+}
+
+static void glib_free(struct io_loop *loop)
+{
+}
+
+static const struct io_loop_ops glib_ops = {
+	.add_watch	= glib_add_watch,
+	.add_timeout	= glib_add_timeout,
+	.remove		= glib_remove,
+	.get_fd		= glib_get_fd,
+	.dispatch	= glib_dispatch,
+	.wakeup		= glib_wakeup,
+	.free		= glib_free,
+};
+
+static struct io_loop glib_loop = {
+	.ops = &glib_ops,
+};
+
+struct io_loop *io_loop_default(void)
+{
+	return &glib_loop;
+}
+
+static uint32_t cond_to_epoll(GIOCondition cond)
+{
+	uint32_t events = 0;
+
+	if (cond & G_IO_IN)
+		events |= EPOLLIN;
+	if (cond & G_IO_OUT)
+		events |= EPOLLOUT;
+	if (cond & G_IO_PRI)
+		events |= EPOLLPRI;
+
+	return events;
+}
+
+static GIOCondition epoll_to_cond(uint32_t events)
+{
+	GIOCondition cond = 0;
+
+	if (events & EPOLLIN)
+		cond |= G_IO_IN;
+	if (events & EPOLLOUT)
+		cond |= G_IO_OUT;
+	if (events & EPOLLPRI)
+		cond |= G_IO_PRI;
+	if (events & EPOLLERR)
+		cond |= G_IO_ERR;
+	if (events & EPOLLHUP)
+		cond |= G_IO_HUP;
+
+	return cond;
+}
+
+static void epoll_fd_update(struct epoll_loop *el, struct epoll_fd *efd)
+{
+	struct epoll_event ev;
+	uint32_t events = 0;
+	GSList *l;
+	int op;
+
+	for (l = efd->watches; l; l = l->next) {
+		struct epoll_watch *w = l->data;
+
+		events |= cond_to_epoll(w->cond);
+	}
+
+	if (efd->watches == NULL) {
+		epoll_ctl(el->epoll_fd, EPOLL_CTL_DEL, efd->fd, NULL);
+		g_hash_table_remove(el->fds, GINT_TO_POINTER(efd->fd));
+		return;
+	}
+
+	if (events == efd->events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = efd->fd;
+
+	op = efd->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	/* The fd may have been closed and reused behind our back */
+	if (epoll_ctl(el->epoll_fd, op, efd->fd, &ev) < 0) {
+		op = (op == EPOLL_CTL_ADD) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		if (epoll_ctl(el->epoll_fd, op, efd->fd, &ev) < 0)
+			error("epoll_ctl(%d): %s", efd->fd, strerror(errno));
+	}
+
+	efd->events = events;
+}
+
+static guint epoll_add_watch(struct io_loop *loop, int fd, GIOCondition cond,
+				IOLoopFunc func, gpointer user_data,
+				GDestroyNotify destroy)
+{
+	struct epoll_loop *el = (struct epoll_loop *) loop;
+	struct epoll_watch *w;
+	struct epoll_fd *efd;
+
+	efd = g_hash_table_lookup(el->fds, GINT_TO_POINTER(fd));
+	if (efd == NULL) {
+		efd = g_new0(struct epoll_fd, 1);
+		efd->fd = fd;
+		g_hash_table_insert(el->fds, GINT_TO_POINTER(fd), efd);
+	}
+
+	w = g_new0(struct epoll_watch, 1);
+	w->id = ++el->next_id;
+	w->fd = fd;
+	w->cond = cond;
+	w->func = func;
+	w->user_data = user_data;
+	w->destroy = destroy;
+
+	g_hash_table_insert(el->watches, GUINT_TO_POINTER(w->id), w);
+	efd->watches = g_slist_append(efd->watches, w);
+
+	epoll_fd_update(el, efd);
+
+	return w->id;
+}
+
+static void epoll_timer_arm(struct epoll_loop *el)
+{
+	struct epoll_timeout *t;
+	struct itimerspec its;
+
+	t = el->timeout_list ? el->timeout_list->data : NULL;
+	if (t ? t->expires == el->armed : el->armed == 0)
+		return;
+
+	memset(&its, 0, sizeof(its));
+
+	if (t) {
+		its.it_value.tv_sec = t->expires / G_USEC_PER_SEC;
+		its.it_value.tv_nsec = (t->expires % G_USEC_PER_SEC) * 1000;
+	}
+
+	/* Monotonic time is never zero, an all zero value disarms */
+	if (timerfd_settime(el->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		error("timerfd_settime: %s", strerror(errno));
+
+	el->armed = t ? t->expires : 0;
+}
+
+static gint timeout_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct epoll_timeout *ta = a, *tb = b;
+
+	if (ta->expires != tb->expires)
+		return ta->expires < tb->expires ? -1 : 1;
+
+	return ta->id < tb->id ? -1 : 1;
+}
+
+static void epoll_timeout_schedule(struct epoll_loop *el,
+						struct epoll_timeout *t)
+{
+	t->expires = g_get_monotonic_time() + (gint64) t->ms * 1000;
+	el->timeout_list = g_list_insert_sorted(el->timeout_list, t,
+								timeout_cmp);
+}
+
+static guint epoll_add_timeout(struct io_loop *loop, guint ms,
+				GSourceFunc func, gpointer user_data,
+				GDestroyNotify destroy)
+{
+	struct epoll_loop *el = (struct epoll_loop *) loop;
+	struct epoll_timeout *t;
+
+	t = g_new0(struct epoll_timeout, 1);
+	t->id = ++el->next_id;
+	t->ms = ms;
+	t->func = func;
+	t->user_data = user_data;
+	t->destroy = destroy;
+
+	g_hash_table_insert(el->timeouts, GUINT_TO_POINTER(t->id), t);
+	epoll_timeout_schedule(el, t);
+
+	if (el->armed == 0 || t->expires < el->armed)
+		epoll_timer_arm(el);
+
+	return t->id;
+}
+
+static void epoll_remove(struct io_loop *loop, guint id)
+{
+	struct epoll_loop *el = (struct epoll_loop *) loop;
+	gpointer key = GUINT_TO_POINTER(id);
+	struct epoll_watch *w;
+	struct epoll_timeout *t;
+	struct epoll_fd *efd;
+
+	w = g_hash_table_lookup(el->watches, key);
+	if (w) {
+		g_hash_table_remove(el->watches, key);
+
+		efd = g_hash_table_lookup(el->fds, GINT_TO_POINTER(w->fd));
+		efd->watches = g_slist_remove(efd->watches, w);
+		epoll_fd_update(el, efd);
+
+		if (w->destroy)
+			w->destroy(w->user_data);
+
+		g_free(w);
+		return;
+	}
+
+	t = g_hash_table_lookup(el->timeouts, key);
+	if (t == NULL)
+		return;
+
+	/* timer_fd is left armed, a spurious wakeup re-arms it */
+	g_hash_table_remove(el->timeouts, key);
+	el->timeout_list = g_list_remove(el->timeout_list, t);
+
+	if (t->destroy)
+		t->destroy(t->user_data);
+
+	g_free(t);
+}
+
+static int epoll_get_fd(struct io_loop *loop)
+{
+	struct epoll_loop *el = (struct epoll_loop *) loop;
+
+	return el->epoll_fd;
+}
+
+static void dispatch_fd(struct epoll_loop *el, int fd, uint32_t events)
+{
+	GIOCondition cond = epoll_to_cond(events);
+	guint ids[MAX_FD_WATCHES];
+	struct epoll_fd *efd;
+	GSList *l;
+	int i, n = 0;
+
+	efd = g_hash_table_lookup(el->fds, GINT_TO_POINTER(fd));
+	if (efd == NULL)
+		return;
+
+	/* Callbacks may remove any watch, only keep their ids */
+	for (l = efd->watches; l && n < MAX_FD_WATCHES; l = l->next) {
+		struct epoll_watch *w = l->data;
+
+		ids[n++] = w->id;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct epoll_watch *w;
+
+		w = g_hash_table_lookup(el->watches, GUINT_TO_POINTER(ids[i]));
+		if (w == NULL)
+			continue;
+
+		if (!(cond & (w->cond | G_IO_ERR | G_IO_HUP)))
+			continue;
+
+		if (!w->func(fd, cond, w->user_data))
+			epoll_remove(&el->loop, ids[i]);
+	}
+}
+
+static void dispatch_timeouts(struct epoll_loop *el)
+{
+	gint64 now = g_get_monotonic_time();
+	GArray *ids = NULL;
+	GList *l;
+	guint i;
+
+	/* Timeouts re-armed by their callback wait for the next round */
+	for (l = el->timeout_list; l; l = l->next) {
+		struct epoll_timeout *t = l->data;
+
+		if (t->expires > now)
+			break;
+
+		if (ids == NULL)
+			ids = g_array_new(FALSE, FALSE, sizeof(guint));
+
+		g_array_append_val(ids, t->id);
+	}
+
+	for (i = 0; ids && i < ids->len; i++) {
+		guint id = g_array_index(ids, guint, i);
+		struct epoll_timeout *t;
+
+		t = g_hash_table_lookup(el->timeouts, GUINT_TO_POINTER(id));
+		if (t == NULL)
+			continue;
+
+		if (!t->func(t->user_data)) {
+			epoll_remove(&el->loop, id);
+			continue;
+		}
+
+		/* Still there and periodic: move it to its next expiry */
+		t = g_hash_table_lookup(el->timeouts, GUINT_TO_POINTER(id));
+		if (t == NULL)
+			continue;
+
+		el->timeout_list = g_list_remove(el->timeout_list, t);
+		epoll_timeout_schedule(el, t);
+	}
+
+	if (ids)
+		g_array_free(ids, TRUE);
+
+	epoll_timer_arm(el);
+}
+
+static int epoll_dispatch(struct io_loop *loop, int timeout)
+{
+	struct epoll_loop *el = (struct epoll_loop *) loop;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	uint64_t val;
+	int n, i;
+
+	n = epoll_wait(el->epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	for (i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+
+		if (fd == el->timer_fd || fd == el->event_fd) {
+			if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+				error("io_loop: %s", strerror(errno));
+			continue;
+		}
+
+		dispatch_fd(el, fd, events[i].events);
+	}
+
+	if (el->timeout_list)
+		dispatch_timeouts(el);
+
+	return n;
+}
+
+static void epoll_wakeup(struct io_loop *loop)
+{
+	struct epoll_loop *el = (struct epoll_loop *) loop;
+	uint64_t val = 1;
+
+	if (write(el->event_fd, &val, sizeof(val)) < 0)
+		error("io_loop wakeup: %s", strerror(errno));
+}
+
+static void epoll_free(struct io_loop *loop)
+{
+	struct epoll_loop *el = (struct epoll_loop *) loop;
+	GList *ids, *l;
+
+	ids = g_hash_table_get_keys(el->watches);
+	ids = g_list_concat(ids, g_hash_table_get_keys(el->timeouts));
+
+	for (l = ids; l; l = l->next)
+		epoll_remove(loop, GPOINTER_TO_UINT(l->data));
+
+	g_list_free(ids);
+
+	g_hash_table_destroy(el->watches);
+	g_hash_table_destroy(el->fds);
+	g_hash_table_destroy(el->timeouts);
+
+	close(el->event_fd);
+	close(el->timer_fd);
+	close(el->epoll_fd);
+
+	g_free(el);
+}
+
+static const struct io_loop_ops epoll_ops = {
+	.add_watch	= epoll_add_watch,
+	.add_timeout	= epoll_add_timeout,
+	.remove		= epoll_remove,
+	.get_fd		= epoll_get_fd,
+	.dispatch	= epoll_dispatch,
+	.wakeup		= epoll_wakeup,
+	.free		= epoll_free,
+};
+
+static int epoll_add_internal(struct epoll_loop *el, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	return epoll_ctl(el->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+struct io_loop *io_loop_epoll_new(void)
+{
+	struct epoll_loop *el;
+
+	el = g_try_new0(struct epoll_loop, 1);
+	if (el == NULL)
+		return NULL;
+
+	el->loop.ops = &epoll_ops;
+	el->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	el->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	el->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (el->epoll_fd < 0 || el->timer_fd < 0 || el->event_fd < 0 ||
+				epoll_add_internal(el, el->timer_fd) < 0 ||
+				epoll_add_internal(el, el->event_fd) < 0) {
+		error("io_loop: %s", strerror(errno));
+		if (el->event_fd >= 0)
+			close(el->event_fd);
+		if (el->timer_fd >= 0)
+			close(el->timer_fd);
+		if (el->epoll_fd >= 0)
+			close(el->epoll_fd);
+		g_free(el);
+		return NULL;
+	}
+
+	el->watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+	el->fds = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+								NULL, g_free);
+	el->timeouts = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	return &el->loop;
+}
+
+void io_loop_free(struct io_loop *loop)
+{
+	if (loop == NULL)
+		return;
+
+	loop->ops->free(loop);
+}
+
+guint io_loop_add_watch(struct io_loop *loop, int fd, GIOCondition cond,
+				IOLoopFunc func, gpointer user_data,
+				GDestroyNotify destroy)
+{
+	return loop->ops->add_watch(loop, fd, cond, func, user_data, destroy);
+}
+
+guint io_loop_add_timeout(struct io_loop *loop, guint ms, GSourceFunc func,
+				gpointer user_data, GDestroyNotify destroy)
+{
+	return loop->ops->add_timeout(loop, ms, func, user_data, destroy);
+}
+
+void io_loop_remove(struct io_loop *loop, guint id)
+{
+	loop->ops->remove(loop, id);
+}
+
+int io_loop_get_fd(struct io_loop *loop)
+{
+	return loop->ops->get_fd(loop);
+}
+
+int io_loop_dispatch(struct io_loop *loop, int timeout)
+{
+	return loop->ops->dispatch(loop, timeout);
+}
+
+void io_loop_run(struct io_loop *loop)
+{
+	loop->quit = 0;
+
+	while (!loop->quit) {
+		if (loop->ops->dispatch(loop, -1) < 0)
+			break;
+	}
+}
+
+void io_loop_quit(struct io_loop *loop)
+{
+	loop->quit = 1;
+	loop->ops->wakeup(loop);
+}
+
+static gboolean attached_dispatch(int fd, GIOCondition cond,
+							gpointer user_data)
+{
+	struct io_loop *loop = user_data;
+
+	loop->ops->dispatch(loop, 0);
+
+	return TRUE;
+}
+
+guint io_loop_attach(struct io_loop *loop)
+{
+	int fd = io_loop_get_fd(loop);
+
+	if (fd < 0)
+		return 0;
+
+	return g_unix_fd_add(fd, G_IO_IN, attached_dispatch, loop);
+}
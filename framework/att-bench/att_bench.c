@@ -0,0 +1,188 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Micro benchmarks for the stripped down bluez ATT/GATT stack. Run as
+ *
+ *   att-bench <name> [args]   run a single benchmark
+ *   att-bench all             run every benchmark with default arguments
+ *
+ * Results are printed one per line so that runs from two branches can be
+ * diffed directly.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "att_bench.h"
+
+struct bench_entry {
+  const char *name;
+  const char *desc;
+  int (*run)(int argc, char **argv);
+};
+
+static const struct bench_entry benches[] = {
+  {"dispatch", "notification dispatch cost vs. registered handlers", bench_dispatch},
+  {"rx",       "notification bursts, PDUs handled per wakeup", bench_rx},
+  {"cmdpool",  "write command queueing and allocations per command", bench_cmdpool},
+  {"tx",       "write-without-response throughput to a socketpair peer", bench_tx},
+  {"cancel",   "g_attrib_cancel() cost vs. queue depth", bench_cancel},
+  {"loop",     "wakeup latency and CPU cost of the event loop backends", bench_loop},
+  {"reactor",  "notifications/s and p99 latency vs. IO threads and peers", bench_reactor},
+  {"submit",   "g_attrib_submit() vs. a locked queue with 1-8 producer threads", bench_submit},
+  {"priority", "control write latency with and without a bulk transfer", bench_priority},
+  {"pressure", "queue depth and wait with watermarks vs. a slow reader", bench_pressure},
+  {"journal",  "restore time after a reconnect, journal replay vs. one by one", bench_journal},
+  {"bearers",  "discovery and bulk reads spread over 1, 2 and 4 ATT bearers", bench_bearers},
+  {"decode",   "discovery response decoding, att_data_list vs. iterator", bench_decode},
+  {"codec",    "every ATT encoder and decoder, optionally against a baseline run", bench_codec},
+  {"batch",    "CCC write burst, one command per write vs. g_attrib_send_batch()", bench_batch},
+  {"cache",    "connect to first notification, full discovery vs. cached database", bench_cache},
+  {"discover", "whole database discovery, chained procedures vs. gatt_discover_all()", bench_discover},
+  {"multi",    "polling N values, gatt_read_char() each vs. gatt_read_multi()", bench_multi},
+  {"long",     "multi-kilobyte long reads, growing buffer vs. length hint", bench_long},
+  {"write",    "OTA-sized long writes, prepared write window of 1 vs. N", bench_write},
+  /* nothing below this line pls */
+  {NULL, NULL, NULL},
+};
+
+/* glibc entry points behind the counting wrappers below */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t allocs;
+
+void *malloc(size_t size)
+{
+  __sync_fetch_and_add(&allocs, 1);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  __sync_fetch_and_add(&allocs, 1);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  __sync_fetch_and_add(&allocs, 1);
+  return __libc_realloc(ptr, size);
+}
+
+uint64_t bench_allocs(void)
+{
+  return __sync_fetch_and_add(&allocs, 0);
+}
+
+uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int bench_peer_open(struct bench_peer *peer, uint16_t mtu)
+{
+  return bench_peer_open_with_loop(peer, mtu, io_loop_default());
+}
+
+int bench_peer_open_with_loop(struct bench_peer *peer, uint16_t mtu,
+                              struct io_loop *loop)
+{
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    perror("socketpair");
+    return -1;
+  }
+
+  peer->fd = sv[1];
+  peer->io = g_io_channel_unix_new(sv[0]);
+  g_io_channel_set_close_on_unref(peer->io, TRUE);
+
+  peer->attrib = g_attrib_new_with_loop(peer->io, mtu, loop);
+  if (peer->attrib == NULL) {
+    g_io_channel_unref(peer->io);
+    close(peer->fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+void bench_peer_close(struct bench_peer *peer)
+{
+  g_attrib_unref(peer->attrib);
+  g_io_channel_unref(peer->io);
+  close(peer->fd);
+
+  /* let the removed watches go away */
+  while (g_main_context_iteration(NULL, FALSE));
+}
+
+int bench_peer_drain(struct bench_peer *peer)
+{
+  uint8_t buf[ATT_MAX_MTU];
+  int n = 0;
+
+  while (recv(peer->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    n++;
+  }
+
+  return n;
+}
+
+void bench_run_until(const int *done)
+{
+  while (!*done)
+    g_main_context_iteration(NULL, TRUE);
+}
+
+void bench_report(const char *name, const char *param, uint64_t ops,
+                  uint64_t elapsed_ns)
+{
+  printf("%-12s %-24s %10llu ops %10.1f ns/op\n", name, param,
+         (unsigned long long)ops, ops ? (double)elapsed_ns / ops : 0.0);
+}
+
+static void usage(void)
+{
+  int i;
+
+  printf("usage: att-bench <name|all> [args]\n");
+  for (i = 0; benches[i].name; i++)
+    printf("  %-12s %s\n", benches[i].name, benches[i].desc);
+}
+
+int main(int argc, char **argv)
+{
+  int i, ret = 0;
+
+  if (argc < 2) {
+    usage();
+    return -1;
+  }
+
+  for (i = 0; benches[i].name; i++) {
+    if (strcmp(argv[1], "all") == 0) {
+      ret |= benches[i].run(0, NULL);
+    } else if (strcmp(argv[1], benches[i].name) == 0) {
+      return benches[i].run(argc - 2, argv + 2);
+    }
+  }
+
+  if (strcmp(argv[1], "all") != 0) {
+    printf("Unknown benchmark %s\n", argv[1]);
+    usage();
+    return -1;
+  }
+
+  return ret;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Shared helpers for the ATT/GATT micro benchmarks. Every benchmark runs
+ * against a local socketpair peer, so no ring or HCI adapter is needed.
+ */
+#ifndef __NOD_ATT_BENCH_H__
+#define __NOD_ATT_BENCH_H__
+
+#include <stdint.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/ioloop.h>
+#include <bluez/gatt/gattrib.h>
+
+/* largest PDU the benchmarks put on the wire */
+#define ATT_MAX_MTU    512
+
+struct bench_peer {
+  GAttrib *attrib;
+  GIOChannel *io;
+  int fd;         /* remote end, plays the ring */
+};
+
+/* monotonic clock in nanoseconds */
+uint64_t bench_now_ns(void);
+
+/* heap allocations so far, glib and bluez included */
+uint64_t bench_allocs(void);
+
+/* GAttrib on one end of a SOCK_SEQPACKET socketpair */
+int bench_peer_open(struct bench_peer *peer, uint16_t mtu);
+int bench_peer_open_with_loop(struct bench_peer *peer, uint16_t mtu,
+                              struct io_loop *loop);
+void bench_peer_close(struct bench_peer *peer);
+
+/* read and discard everything the GAttrib side sent, returns PDU count */
+int bench_peer_drain(struct bench_peer *peer);
+
+/* run the default main context until *done becomes non-zero */
+void bench_run_until(const int *done);
+
+/*
+ * Emulated ring database served on fd from a thread, see bench_server.c.
+ * BENCH_SERVICES of BENCH_CHARS characteristics is the size of the ring.
+ * Stopping it shuts fd down.
+ */
+#define BENCH_SERVICES  6
+#define BENCH_CHARS     5
+
+struct bench_server;
+
+struct bench_server *bench_server_start(int fd, unsigned int service_us,
+                                        int services, int chars);
+uint16_t bench_server_attrs(const struct bench_server *srv);
+int bench_server_indicate_changed(struct bench_server *srv);
+/* len octets counting up at handle, set before the first request for it */
+int bench_server_long_value(struct bench_server *srv, uint16_t handle,
+                            uint16_t len);
+void bench_server_stop(struct bench_server *srv);
+
+void bench_report(const char *name, const char *param, uint64_t ops,
+                  uint64_t elapsed_ns);
+
+/* benchmark entry points, see att_bench.c for the registry */
+int bench_dispatch(int argc, char **argv);
+int bench_rx(int argc, char **argv);
+int bench_cmdpool(int argc, char **argv);
+int bench_tx(int argc, char **argv);
+int bench_cancel(int argc, char **argv);
+int bench_loop(int argc, char **argv);
+int bench_reactor(int argc, char **argv);
+int bench_submit(int argc, char **argv);
+int bench_priority(int argc, char **argv);
+int bench_pressure(int argc, char **argv);
+int bench_journal(int argc, char **argv);
+int bench_bearers(int argc, char **argv);
+int bench_decode(int argc, char **argv);
+int bench_codec(int argc, char **argv);
+int bench_batch(int argc, char **argv);
+int bench_cache(int argc, char **argv);
+int bench_discover(int argc, char **argv);
+int bench_multi(int argc, char **argv);
+int bench_long(int argc, char **argv);
+int bench_write(int argc, char **argv);
+
+#endif
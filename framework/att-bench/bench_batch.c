@@ -0,0 +1,121 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * A startup mode switch: enabling notifications on N CCC handles with write
+ * commands. Reported are the time per burst until the last PDU has been
+ * sent, and the socket writes and heap allocations it took, for
+ *
+ *   single  gatt_write_cmd() per handle, as control_service() used to
+ *   batch   g_attrib_send_batch() with all of them
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define MAX_WRITES 64
+
+enum {
+  MODE_SINGLE,
+  MODE_BATCH,
+};
+
+static const char *mode_names[] = {"single", "batch"};
+
+static void burst_sent(gpointer user_data)
+{
+  int *done = user_data;
+
+  *done = 1;
+}
+
+static int run_one(int mode, int writes, int rounds)
+{
+  static const uint8_t enable[] = {0x01, 0x00};
+  struct att_write batch[MAX_WRITES];
+  struct bench_peer peer;
+  GAttribStats stats;
+  uint64_t start, elapsed = 0, allocs = 0, a;
+  char param[32];
+  int i, j, done, received = 0;
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  for (j = 0; j < writes; j++) {
+    batch[j].handle = 0x0004 + 4 * j;
+    batch[j].value = enable;
+    batch[j].vlen = sizeof(enable);
+  }
+
+  for (i = 0; i < rounds; i++) {
+    done = 0;
+
+    a = bench_allocs();
+    start = bench_now_ns();
+
+    if (mode == MODE_BATCH) {
+      g_attrib_send_batch(peer.attrib, batch, writes, burst_sent, &done);
+    } else {
+      for (j = 0; j < writes; j++) {
+        gatt_write_cmd(peer.attrib, batch[j].handle, (uint8_t *)enable,
+                       sizeof(enable), j == writes - 1 ? burst_sent : NULL,
+                       &done);
+      }
+    }
+
+    bench_run_until(&done);
+
+    elapsed += bench_now_ns() - start;
+    allocs += bench_allocs() - a;
+
+    received += bench_peer_drain(&peer);
+  }
+
+  g_attrib_get_stats(peer.attrib, &stats);
+  bench_peer_close(&peer);
+
+  if (received != rounds * writes) {
+    printf("%s: peer got %d of %d writes\n", mode_names[mode], received,
+           rounds * writes);
+    return -1;
+  }
+
+  snprintf(param, sizeof(param), "%s writes=%d", mode_names[mode], writes);
+  bench_report("batch", param, rounds, elapsed);
+  printf("%-12s %-24s %.1f socket writes, %.1f allocs per burst\n", "", "",
+         (double)stats.tx_writes / rounds, (double)allocs / rounds);
+
+  return 0;
+}
+
+int bench_batch(int argc, char **argv)
+{
+  static const int writes[] = {9, 32, MAX_WRITES};
+  int rounds = argc > 0 ? atoi(argv[0]) : 20000;
+  unsigned int w;
+  int mode;
+
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  for (w = 0; w < G_N_ELEMENTS(writes); w++) {
+    for (mode = MODE_SINGLE; mode <= MODE_BATCH; mode++) {
+      if (run_one(mode, writes[w], rounds) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Independent requests spread over several ATT bearers to the same peer.
+ * The peer emulator serves one socketpair per bearer from its own thread and
+ * answers every request after a fixed service time, standing in for the
+ * connection interval. Its database holds SERVICES services with CHARS
+ * characteristics each. Reported is the time for
+ *
+ *   discovery  gatt_discover_char() on every service range at once
+ *   reads      gatt_read_char() on every characteristic value at once
+ *
+ * with 1, 2 and 4 bearers added through g_attrib_add_bearer().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define SERVICES     8
+#define CHARS        8
+#define SERVICE_US   500
+#define MAX_BEARERS  4
+
+/* service declaration, then declaration and value per characteristic */
+#define SERVICE_SPAN         (1 + 2 * CHARS)
+#define SERVICE_START(s)     (1 + (s) * SERVICE_SPAN)
+#define SERVICE_END(s)       (SERVICE_START(s) + SERVICE_SPAN - 1)
+#define CHAR_DECL(s, c)      (SERVICE_START(s) + 1 + 2 * (c))
+
+enum {
+  MODE_DISCOVERY,
+  MODE_READS,
+};
+
+static const char *mode_names[] = {"discovery", "reads"};
+
+struct bearer_end {
+  GIOChannel *io;
+  int fd;           /* remote end, served by the emulator */
+  pthread_t thread;
+};
+
+struct bearers_run {
+  struct bench_peer peer;
+  struct bearer_end extra[MAX_BEARERS - 1];
+  int n_extra;
+  int pending;
+  int done;
+  uint8_t status;
+};
+
+static void request_done(struct bearers_run *run, guint8 status)
+{
+  if (status != 0 && run->status == 0) {
+    run->status = status;
+  }
+
+  if (--run->pending == 0) {
+    run->done = 1;
+  }
+}
+
+static void discover_cb(GSList *characteristics, guint8 status,
+                        gpointer user_data)
+{
+  struct bearers_run *run = user_data;
+
+  if (status == 0 && g_slist_length(characteristics) != CHARS) {
+    status = ATT_ECODE_UNLIKELY;
+  }
+
+  request_done(run, status);
+}
+
+static void read_cb(guint8 status, const guint8 *pdu, guint16 len,
+                    gpointer user_data)
+{
+  request_done(user_data, status);
+}
+
+/* READ_BY_TYPE for characteristic declarations, READ for values */
+static uint16_t emulate(const uint8_t *req, ssize_t len, uint8_t *rsp)
+{
+  uint16_t start, end, h;
+  uint16_t rlen = 2;
+  int s, c;
+
+  if (req[0] == ATT_OP_READ_REQ && len == 3) {
+    rsp[0] = ATT_OP_READ_RESP;
+    memset(&rsp[1], req[1], ATT_DEFAULT_LE_MTU - 1);
+    return ATT_DEFAULT_LE_MTU;
+  }
+
+  if (req[0] != ATT_OP_READ_BY_TYPE_REQ || len != 7) {
+    return enc_error_resp(req[0], 0, ATT_ECODE_REQ_NOT_SUPP, rsp,
+                          ATT_DEFAULT_LE_MTU);
+  }
+
+  start = att_get_u16(&req[1]);
+  end = att_get_u16(&req[3]);
+
+  rsp[0] = ATT_OP_READ_BY_TYPE_RESP;
+  rsp[1] = 7;
+
+  for (s = 0; s < SERVICES; s++) {
+    for (c = 0; c < CHARS; c++) {
+      h = CHAR_DECL(s, c);
+      if (h < start || h > end || rlen + 7 > ATT_DEFAULT_LE_MTU) {
+        continue;
+      }
+
+      att_put_u16(h, &rsp[rlen]);
+      rsp[rlen + 2] = ATT_CHAR_PROPER_READ;
+      att_put_u16(h + 1, &rsp[rlen + 3]);
+      att_put_u16(0xfff0 + c, &rsp[rlen + 5]);
+      rlen += 7;
+    }
+  }
+
+  if (rlen == 2) {
+    return enc_error_resp(req[0], start, ATT_ECODE_ATTR_NOT_FOUND, rsp,
+                          ATT_DEFAULT_LE_MTU);
+  }
+
+  return rlen;
+}
+
+/* one emulator thread per bearer, they share the database */
+static void *emulator_thread(void *data)
+{
+  int fd = GPOINTER_TO_INT(data);
+  uint8_t buf[ATT_MAX_MTU];
+  uint8_t rsp[ATT_DEFAULT_LE_MTU];
+  uint16_t rlen;
+  ssize_t len;
+
+  while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    rlen = emulate(buf, len, rsp);
+
+    usleep(SERVICE_US);
+
+    if (send(fd, rsp, rlen, 0) < 0) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static int bearer_open(struct bearers_run *run)
+{
+  struct bearer_end *b = &run->extra[run->n_extra];
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+    perror("socketpair");
+    return -1;
+  }
+
+  b->fd = sv[1];
+  b->io = g_io_channel_unix_new(sv[0]);
+  g_io_channel_set_close_on_unref(b->io, TRUE);
+
+  if (g_attrib_add_bearer(run->peer.attrib, b->io) == 0) {
+    g_io_channel_unref(b->io);
+    close(b->fd);
+    return -1;
+  }
+
+  if (pthread_create(&b->thread, NULL, emulator_thread,
+                     GINT_TO_POINTER(b->fd)) != 0) {
+    return -1;
+  }
+
+  run->n_extra++;
+
+  return 0;
+}
+
+static void run_close(struct bearers_run *run, pthread_t thread)
+{
+  int i;
+
+  shutdown(run->peer.fd, SHUT_RDWR);
+  pthread_join(thread, NULL);
+
+  for (i = 0; i < run->n_extra; i++) {
+    shutdown(run->extra[i].fd, SHUT_RDWR);
+    pthread_join(run->extra[i].thread, NULL);
+  }
+
+  /* the bearers go away with the GAttrib */
+  bench_peer_close(&run->peer);
+
+  for (i = 0; i < run->n_extra; i++) {
+    g_io_channel_unref(run->extra[i].io);
+    close(run->extra[i].fd);
+  }
+}
+
+static void issue(struct bearers_run *run, int mode)
+{
+  int s, c;
+
+  for (s = 0; s < SERVICES; s++) {
+    if (mode == MODE_DISCOVERY) {
+      gatt_discover_char(run->peer.attrib, SERVICE_START(s), SERVICE_END(s),
+                         NULL, discover_cb, run);
+      run->pending++;
+      continue;
+    }
+
+    for (c = 0; c < CHARS; c++) {
+      gatt_read_char(run->peer.attrib, CHAR_DECL(s, c) + 1, read_cb, run);
+      run->pending++;
+    }
+  }
+}
+
+static int run_one(int mode, int bearers, int rounds, uint64_t *base_ns)
+{
+  struct bearers_run run;
+  GAttribStats stats;
+  pthread_t thread;
+  uint64_t start, elapsed = 0;
+  char param[32];
+  int i;
+
+  memset(&run, 0, sizeof(run));
+
+  if (bench_peer_open(&run.peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  if (pthread_create(&thread, NULL, emulator_thread,
+                     GINT_TO_POINTER(run.peer.fd)) != 0) {
+    bench_peer_close(&run.peer);
+    return -1;
+  }
+
+  for (i = 1; i < bearers; i++) {
+    if (bearer_open(&run) < 0) {
+      run_close(&run, thread);
+      return -1;
+    }
+  }
+
+  for (i = 0; i < rounds; i++) {
+    run.done = 0;
+
+    start = bench_now_ns();
+    issue(&run, mode);
+    bench_run_until(&run.done);
+    elapsed += bench_now_ns() - start;
+
+    if (run.status != 0) {
+      printf("%s failed: %s\n", mode_names[mode], att_ecode2str(run.status));
+      run_close(&run, thread);
+      return -1;
+    }
+  }
+
+  g_attrib_get_stats(run.peer.attrib, &stats);
+
+  snprintf(param, sizeof(param), "%s bearers=%d", mode_names[mode], bearers);
+  bench_report("bearers", param, rounds, elapsed);
+
+  if (bearers == 1) {
+    *base_ns = elapsed;
+  }
+
+  printf("%-12s %-24s %.2fx vs. one bearer, %llu requests delegated\n",
+         "", "", elapsed ? (double)*base_ns / elapsed : 0.0,
+         (unsigned long long)stats.delegated);
+
+  run_close(&run, thread);
+
+  return 0;
+}
+
+int bench_bearers(int argc, char **argv)
+{
+  static const int bearers[] = {1, 2, MAX_BEARERS};
+  int rounds = argc > 0 ? atoi(argv[0]) : 20;
+  uint64_t base_ns = 0;
+  unsigned int b;
+  int mode;
+
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  for (mode = MODE_DISCOVERY; mode <= MODE_READS; mode++) {
+    for (b = 0; b < G_N_ELEMENTS(bearers); b++) {
+      if (run_one(mode, bearers[b], rounds, &base_ns) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Connect to first notification. Every round plays a fresh connection to
+ * the emulated ring of bench_server.c: a new GAttrib, the database made
+ * available through gatt_cache_attach(), then the CCC of the first data
+ * characteristic enabled, whose notification ends the round. Reported is
+ * the time per connection and the PDUs it sent, for
+ *
+ *   discovery  the cache invalidated before every round
+ *   cached     the database from the cache file of the previous round
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/bluetooth/gattcache.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define SERVICE_US  1000
+
+enum {
+  MODE_DISCOVERY,
+  MODE_CACHED,
+};
+
+static const char *mode_names[] = {"discovery", "cached"};
+
+/* the cache file name, in a directory of its own */
+static const bdaddr_t ring_addr = {{0x01, 0x02, 0x03, 0x04, 0x05, 0x06}};
+
+struct cache_run {
+  struct bench_peer peer;
+  struct gatt_cache *cache;
+  int ready;
+  int notified;
+  uint8_t status;
+};
+
+static void ready_cb(guint8 status, gpointer user_data)
+{
+  struct cache_run *run = user_data;
+
+  run->status = status;
+  run->ready = 1;
+}
+
+static void notify_cb(const guint8 *pdu, guint16 len, gpointer user_data)
+{
+  struct cache_run *run = user_data;
+
+  run->notified = 1;
+}
+
+/* the CCC of the first characteristic past GATT and GAP that notifies */
+static uint16_t first_data_ccc(struct gatt_cache *cache)
+{
+  const struct gatt_char *chars;
+  const struct gatt_desc *descs;
+  guint i, j, n_chars, n_descs;
+
+  chars = gatt_cache_chars(cache, &n_chars);
+  descs = gatt_cache_descs(cache, &n_descs);
+
+  for (i = 0; i < n_chars; i++) {
+    if (!(chars[i].properties & ATT_CHAR_PROPER_NOTIFY)) {
+      continue;
+    }
+
+    for (j = 0; j < n_descs; j++) {
+      if (descs[j].handle > chars[i].value_handle) {
+        return descs[j].handle;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int connect_once(struct cache_run *run, const char *dir, int mode,
+                        uint64_t *pdus)
+{
+  static const uint8_t enable[] = {0x01, 0x00};
+  struct bench_server *srv;
+  GAttribStats stats;
+  uint16_t ccc;
+  int ret = -1;
+
+  if (bench_peer_open(&run->peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  srv = bench_server_start(run->peer.fd, SERVICE_US, BENCH_SERVICES,
+                           BENCH_CHARS);
+  if (srv == NULL) {
+    bench_peer_close(&run->peer);
+    return -1;
+  }
+
+  run->cache = gatt_cache_open(dir, &ring_addr);
+  if (run->cache == NULL) {
+    goto done;
+  }
+
+  if (mode == MODE_DISCOVERY) {
+    gatt_cache_invalidate(run->cache);
+  }
+
+  run->ready = 0;
+  run->notified = 0;
+  run->status = 0;
+
+  g_attrib_register(run->peer.attrib, ATT_OP_HANDLE_NOTIFY,
+                    GATTRIB_ALL_HANDLES, notify_cb, run, NULL);
+
+  gatt_cache_attach(run->cache, run->peer.attrib, ready_cb, run);
+  bench_run_until(&run->ready);
+
+  if (run->status != 0) {
+    printf("discovery failed: %s\n", att_ecode2str(run->status));
+    goto done;
+  }
+
+  ccc = first_data_ccc(run->cache);
+  if (ccc == 0) {
+    printf("no data CCC in the cached database\n");
+    goto done;
+  }
+
+  gatt_write_cmd(run->peer.attrib, ccc, (uint8_t *)enable, sizeof(enable),
+                 NULL, NULL);
+  bench_run_until(&run->notified);
+
+  g_attrib_get_stats(run->peer.attrib, &stats);
+  *pdus += stats.tx_pdus;
+  ret = 0;
+
+done:
+  gatt_cache_close(run->cache);
+  bench_server_stop(srv);
+  bench_peer_close(&run->peer);
+
+  return ret;
+}
+
+static int run_one(const char *dir, int mode, int rounds)
+{
+  struct cache_run run;
+  uint64_t start, elapsed = 0, pdus = 0;
+  int i;
+
+  memset(&run, 0, sizeof(run));
+
+  for (i = 0; i < rounds; i++) {
+    start = bench_now_ns();
+
+    if (connect_once(&run, dir, mode, &pdus) < 0) {
+      return -1;
+    }
+
+    elapsed += bench_now_ns() - start;
+  }
+
+  bench_report("cache", mode_names[mode], rounds, elapsed);
+  printf("%-12s %-24s %.1f ms to first notification, %.1f PDUs sent\n",
+         "", "", (double)elapsed / rounds / 1000000, (double)pdus / rounds);
+
+  return 0;
+}
+
+int bench_cache(int argc, char **argv)
+{
+  char dir[] = "/tmp/att-bench-cache-XXXXXX";
+  struct gatt_cache *cache;
+  int rounds = argc > 0 ? atoi(argv[0]) : 20;
+  int mode, ret = 0;
+
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return -1;
+  }
+
+  /* discovery goes first and leaves the file for the cached rounds */
+  for (mode = MODE_DISCOVERY; mode <= MODE_CACHED && ret == 0; mode++) {
+    ret = run_one(dir, mode, rounds);
+  }
+
+  cache = gatt_cache_open(dir, &ring_addr);
+  gatt_cache_invalidate(cache);
+  gatt_cache_close(cache);
+  rmdir(dir);
+
+  return ret;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Cost of g_attrib_cancel() against deep queues of write commands, as
+ * seen when a ring changes mode and everything in flight for the old mode
+ * is dropped. Commands are cancelled newest first, which is the worst
+ * case for a scan from the head of the queue.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define LED_HANDLE  0x0062
+#define MIN_CANCELS 64000
+
+static const int depths[] = {16, 256, 1024, 4096};
+
+static int run_one(int depth)
+{
+  struct bench_peer peer;
+  uint8_t value[2] = {0x01, 0x00};
+  guint *ids;
+  uint64_t elapsed = 0, start;
+  uint64_t cancels = 0;
+  char param[32];
+  int i;
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  ids = g_new0(guint, depth);
+
+  /*
+   * The main loop is not run while queueing, so nothing reaches the
+   * socket and every command is still cancellable.
+   */
+  while (cancels < MIN_CANCELS) {
+    for (i = 0; i < depth; i++) {
+      ids[i] = gatt_write_cmd(peer.attrib, LED_HANDLE, value, sizeof(value),
+                              NULL, NULL);
+    }
+
+    start = bench_now_ns();
+    for (i = depth - 1; i >= 0; i--) {
+      if (!g_attrib_cancel(peer.attrib, ids[i])) {
+        fprintf(stderr, "cancel: id %u not found\n", ids[i]);
+        g_free(ids);
+        bench_peer_close(&peer);
+        return -1;
+      }
+    }
+    elapsed += bench_now_ns() - start;
+    cancels += depth;
+  }
+
+  snprintf(param, sizeof(param), "depth=%d", depth);
+  bench_report("cancel", param, cancels, elapsed);
+
+  g_free(ids);
+  bench_peer_close(&peer);
+
+  return 0;
+}
+
+int bench_cancel(int argc, char **argv)
+{
+  unsigned int i;
+
+  if (argc > 0) {
+    return run_one(atoi(argv[0]));
+  }
+
+  for (i = 0; i < G_N_ELEMENTS(depths); i++) {
+    if (run_one(depths[i]) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
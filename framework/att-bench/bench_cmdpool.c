@@ -0,0 +1,86 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Steady state cost of queueing write commands through GAttrib, and how
+ * many of those commands needed a fresh heap allocation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define LED_HANDLE  0x0062
+#define BURST       32
+
+static int sent;
+
+static void write_done(gpointer user_data)
+{
+  sent++;
+}
+
+static int run_one(uint16_t mtu, int cmds)
+{
+  struct bench_peer peer;
+  GAttribStats stats;
+  uint8_t value[mtu - 3];
+  uint64_t start;
+  char param[32];
+  int i, j;
+
+  if (bench_peer_open(&peer, mtu) < 0) {
+    return -1;
+  }
+
+  memset(value, 0x5a, sizeof(value));
+  sent = 0;
+
+  start = bench_now_ns();
+  for (i = 0; i < cmds; i += BURST) {
+    for (j = 0; j < BURST; j++) {
+      gatt_write_cmd(peer.attrib, LED_HANDLE, value, sizeof(value),
+                     write_done, NULL);
+    }
+    while (sent < i + BURST) {
+      g_main_context_iteration(NULL, FALSE);
+      bench_peer_drain(&peer);
+    }
+  }
+
+  snprintf(param, sizeof(param), "mtu=%u", mtu);
+  bench_report("cmdpool", param, sent, bench_now_ns() - start);
+
+  g_attrib_get_stats(peer.attrib, &stats);
+  printf("%-12s %-24s %10llu allocs %6.4f allocs/cmd, %llu reused\n", "", "",
+         (unsigned long long)stats.cmd_allocs,
+         sent ? (double)stats.cmd_allocs / sent : 0.0,
+         (unsigned long long)stats.cmd_reuses);
+
+  bench_peer_close(&peer);
+
+  return 0;
+}
+
+int bench_cmdpool(int argc, char **argv)
+{
+  int cmds = argc > 0 ? atoi(argv[0]) : 64000;
+
+  cmds -= cmds % BURST;
+  if (cmds <= 0) {
+    cmds = BURST;
+  }
+
+  if (run_one(ATT_DEFAULT_LE_MTU, cmds) < 0) {
+    return -1;
+  }
+
+  return run_one(247, cmds);
+}
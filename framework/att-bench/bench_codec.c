@@ -0,0 +1,697 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Every ATT encoder and decoder in att.c, with payloads filled to the MTU:
+ * full attribute values for reads, writes and notifications, as many
+ * entries as fit for the list responses. Each runs at the default LE MTU
+ * and at two large ones, reported are ns/op, the best of ROUNDS rounds, and
+ * heap allocations/op. A case that fails to encode or decode aborts the
+ * run.
+ *
+ *   att-bench codec [iterations] [baseline]
+ *
+ * With a baseline, the saved output of an earlier run, every line also
+ * shows the change against it. Cases more than REGRESSION_PCT slower or
+ * allocating more are flagged and the run returns non-zero, so two
+ * branches can be compared by running one against the other's output.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define VALUE_HANDLE    0x0025
+#define ROUNDS          5
+#define REGRESSION_PCT  10.0
+/* differences below this are timer noise on the cheapest cases */
+#define REGRESSION_NS   2.0
+
+struct codec_ctx {
+  uint16_t mtu;
+  uint8_t value[ATT_MAX_MTU];
+  uint8_t out[ATT_MAX_MTU];
+  uint8_t in[ATT_MAX_MTU];
+  uint16_t in_len;
+  bt_uuid_t prim_uuid;
+  bt_uuid_t char_uuid;
+  struct att_data_list *grp;
+  struct att_data_list *type;
+  struct att_data_list *info;
+  GSList *ranges;
+};
+
+/* returns the PDU or value length, 0 on failure */
+typedef uint16_t (*codec_fn)(struct codec_ctx *ctx, uint8_t *pdu);
+
+struct codec_case {
+  const char *name;
+  codec_fn input;   /* encodes the PDU a decoder runs on */
+  codec_fn run;
+};
+
+struct baseline_entry {
+  double ns;
+  double allocs;
+};
+
+/* MTU exchange */
+
+static uint16_t e_mtu_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_mtu_req(ctx->mtu, pdu, ctx->mtu);
+}
+
+static uint16_t d_mtu_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t mtu;
+
+  return dec_mtu_req(ctx->in, ctx->in_len, &mtu);
+}
+
+static uint16_t e_mtu_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_mtu_resp(ctx->mtu, pdu, ctx->mtu);
+}
+
+static uint16_t d_mtu_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t mtu;
+
+  return dec_mtu_resp(ctx->in, ctx->in_len, &mtu);
+}
+
+/* Find information */
+
+static uint16_t e_find_info_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_find_info_req(0x0001, 0xffff, pdu, ctx->mtu);
+}
+
+static uint16_t d_find_info_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t start, end;
+
+  return dec_find_info_req(ctx->in, ctx->in_len, &start, &end);
+}
+
+static uint16_t e_find_info_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_find_info_resp(ATT_FIND_INFO_RESP_FMT_16BIT, ctx->info, pdu,
+                            ctx->mtu);
+}
+
+static uint16_t d_find_info_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  struct att_data_list *list;
+  uint8_t format;
+  uint16_t num;
+
+  list = dec_find_info_resp(ctx->in, ctx->in_len, &format);
+  if (list == NULL) {
+    return 0;
+  }
+
+  num = list->num;
+  att_data_list_free(list);
+
+  return num;
+}
+
+static uint16_t walk(struct att_list_iter *iter)
+{
+  uint16_t sum = 0;
+  const uint8_t *entry;
+
+  while ((entry = att_list_iter_next(iter))) {
+    sum += entry[0];
+  }
+
+  return sum | 1;
+}
+
+static uint16_t d_find_info_iter(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  struct att_list_iter iter;
+  uint8_t format;
+
+  if (dec_find_info_resp_iter(ctx->in, ctx->in_len, &format, &iter) == 0) {
+    return 0;
+  }
+
+  return walk(&iter);
+}
+
+/* Find by type value, primary service discovery by UUID */
+
+static uint16_t e_find_by_type_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_find_by_type_req(0x0001, 0xffff, &ctx->prim_uuid, ctx->value, 16,
+                              pdu, ctx->mtu);
+}
+
+static uint16_t d_find_by_type_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t start, end;
+  bt_uuid_t uuid;
+  size_t vlen;
+
+  return dec_find_by_type_req(ctx->in, ctx->in_len, &start, &end, &uuid,
+                              pdu, &vlen);
+}
+
+static uint16_t e_find_by_type_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_find_by_type_resp(ctx->ranges, pdu, ctx->mtu);
+}
+
+static uint16_t d_find_by_type_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  GSList *ranges;
+  uint16_t num;
+
+  ranges = dec_find_by_type_resp(ctx->in, ctx->in_len);
+  num = g_slist_length(ranges);
+  g_slist_free_full(ranges, g_free);
+
+  return num;
+}
+
+/* Read by type, characteristic discovery */
+
+static uint16_t e_read_by_type_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_read_by_type_req(0x0001, 0xffff, &ctx->char_uuid, pdu,
+                              ctx->mtu);
+}
+
+static uint16_t d_read_by_type_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t start, end;
+  bt_uuid_t uuid;
+
+  return dec_read_by_type_req(ctx->in, ctx->in_len, &start, &end, &uuid);
+}
+
+static uint16_t e_read_by_type_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_read_by_type_resp(ctx->type, pdu, ctx->mtu);
+}
+
+static uint16_t d_read_by_type_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  struct att_data_list *list;
+  uint16_t num;
+
+  list = dec_read_by_type_resp(ctx->in, ctx->in_len);
+  if (list == NULL) {
+    return 0;
+  }
+
+  num = list->num;
+  att_data_list_free(list);
+
+  return num;
+}
+
+static uint16_t d_read_by_type_iter(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  struct att_list_iter iter;
+
+  if (dec_read_by_type_resp_iter(ctx->in, ctx->in_len, &iter) == 0) {
+    return 0;
+  }
+
+  return walk(&iter);
+}
+
+/* Read by group type, primary service discovery */
+
+static uint16_t e_read_by_grp_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_read_by_grp_req(0x0001, 0xffff, &ctx->prim_uuid, pdu, ctx->mtu);
+}
+
+static uint16_t d_read_by_grp_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t start, end;
+  bt_uuid_t uuid;
+
+  return dec_read_by_grp_req(ctx->in, ctx->in_len, &start, &end, &uuid);
+}
+
+static uint16_t e_read_by_grp_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_read_by_grp_resp(ctx->grp, pdu, ctx->mtu);
+}
+
+static uint16_t d_read_by_grp_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  struct att_data_list *list;
+  uint16_t num;
+
+  list = dec_read_by_grp_resp(ctx->in, ctx->in_len);
+  if (list == NULL) {
+    return 0;
+  }
+
+  num = list->num;
+  att_data_list_free(list);
+
+  return num;
+}
+
+static uint16_t d_read_by_grp_iter(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  struct att_list_iter iter;
+
+  if (dec_read_by_grp_resp_iter(ctx->in, ctx->in_len, &iter) == 0) {
+    return 0;
+  }
+
+  return walk(&iter);
+}
+
+/* Read and read blob */
+
+static uint16_t e_read_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_read_req(VALUE_HANDLE, pdu, ctx->mtu);
+}
+
+static uint16_t d_read_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t handle;
+
+  return dec_read_req(ctx->in, ctx->in_len, &handle);
+}
+
+static uint16_t e_read_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_read_resp(ctx->value, ctx->mtu - 1, pdu, ctx->mtu);
+}
+
+static uint16_t d_read_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return dec_read_resp(ctx->in, ctx->in_len, pdu, ATT_MAX_MTU);
+}
+
+static uint16_t e_read_blob_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_read_blob_req(VALUE_HANDLE, ctx->mtu - 1, pdu, ctx->mtu);
+}
+
+static uint16_t d_read_blob_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t handle, offset;
+
+  return dec_read_blob_req(ctx->in, ctx->in_len, &handle, &offset);
+}
+
+static uint16_t e_read_blob_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_read_blob_resp(ctx->value, ctx->mtu - 1, 0, pdu, ctx->mtu);
+}
+
+/* Write request, write command */
+
+static uint16_t e_write_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_write_req(VALUE_HANDLE, ctx->value, ctx->mtu - 3, pdu,
+                       ctx->mtu);
+}
+
+static uint16_t d_write_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t handle;
+  size_t vlen;
+
+  return dec_write_req(ctx->in, ctx->in_len, &handle, pdu, &vlen);
+}
+
+static uint16_t e_write_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_write_resp(pdu);
+}
+
+static uint16_t d_write_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return dec_write_resp(ctx->in, ctx->in_len);
+}
+
+static uint16_t e_write_cmd(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_write_cmd(VALUE_HANDLE, ctx->value, ctx->mtu - 3, pdu,
+                       ctx->mtu);
+}
+
+static uint16_t d_write_cmd(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t handle;
+  size_t vlen;
+
+  return dec_write_cmd(ctx->in, ctx->in_len, &handle, pdu, &vlen);
+}
+
+/* Prepare and execute write */
+
+static uint16_t e_prep_write_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_prep_write_req(VALUE_HANDLE, ctx->mtu - 5, ctx->value,
+                            ctx->mtu - 5, pdu, ctx->mtu);
+}
+
+static uint16_t d_prep_write_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t handle, offset;
+  size_t vlen;
+
+  return dec_prep_write_req(ctx->in, ctx->in_len, &handle, &offset, pdu,
+                            &vlen);
+}
+
+static uint16_t e_prep_write_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_prep_write_resp(VALUE_HANDLE, ctx->mtu - 5, ctx->value,
+                             ctx->mtu - 5, pdu, ctx->mtu);
+}
+
+static uint16_t d_prep_write_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t handle, offset;
+  size_t vlen;
+
+  return dec_prep_write_resp(ctx->in, ctx->in_len, &handle, &offset, pdu,
+                             &vlen);
+}
+
+static uint16_t e_exec_write_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_exec_write_req(ATT_WRITE_ALL_PREP_WRITES, pdu, ctx->mtu);
+}
+
+static uint16_t d_exec_write_req(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint8_t flags;
+
+  return dec_exec_write_req(ctx->in, ctx->in_len, &flags);
+}
+
+static uint16_t e_exec_write_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_exec_write_resp(pdu);
+}
+
+static uint16_t d_exec_write_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return dec_exec_write_resp(ctx->in, ctx->in_len);
+}
+
+/* Notification, indication, errors */
+
+static uint16_t e_notification(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_notification(VALUE_HANDLE, ctx->value, ctx->mtu - 3, pdu,
+                          ctx->mtu);
+}
+
+static uint16_t e_indication(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_indication(VALUE_HANDLE, ctx->value, ctx->mtu - 3, pdu,
+                        ctx->mtu);
+}
+
+static uint16_t d_indication(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  uint16_t handle;
+
+  return dec_indication(ctx->in, ctx->in_len, &handle, pdu, ATT_MAX_MTU);
+}
+
+static uint16_t e_confirmation(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_confirmation(pdu, ctx->mtu);
+}
+
+static uint16_t e_error_resp(struct codec_ctx *ctx, uint8_t *pdu)
+{
+  return enc_error_resp(ATT_OP_READ_REQ, VALUE_HANDLE,
+                        ATT_ECODE_ATTR_NOT_FOUND, pdu, ctx->mtu);
+}
+
+static const struct codec_case cases[] = {
+  {"enc_mtu_req",                NULL,                e_mtu_req},
+  {"dec_mtu_req",                e_mtu_req,           d_mtu_req},
+  {"enc_mtu_resp",               NULL,                e_mtu_resp},
+  {"dec_mtu_resp",               e_mtu_resp,          d_mtu_resp},
+  {"enc_find_info_req",          NULL,                e_find_info_req},
+  {"dec_find_info_req",          e_find_info_req,     d_find_info_req},
+  {"enc_find_info_resp",         NULL,                e_find_info_resp},
+  {"dec_find_info_resp",         e_find_info_resp,    d_find_info_resp},
+  {"dec_find_info_resp_iter",    e_find_info_resp,    d_find_info_iter},
+  {"enc_find_by_type_req",       NULL,                e_find_by_type_req},
+  {"dec_find_by_type_req",       e_find_by_type_req,  d_find_by_type_req},
+  {"enc_find_by_type_resp",      NULL,                e_find_by_type_resp},
+  {"dec_find_by_type_resp",      e_find_by_type_resp, d_find_by_type_resp},
+  {"enc_read_by_type_req",       NULL,                e_read_by_type_req},
+  {"dec_read_by_type_req",       e_read_by_type_req,  d_read_by_type_req},
+  {"enc_read_by_type_resp",      NULL,                e_read_by_type_resp},
+  {"dec_read_by_type_resp",      e_read_by_type_resp, d_read_by_type_resp},
+  {"dec_read_by_type_resp_iter", e_read_by_type_resp, d_read_by_type_iter},
+  {"enc_read_by_grp_req",        NULL,                e_read_by_grp_req},
+  {"dec_read_by_grp_req",        e_read_by_grp_req,   d_read_by_grp_req},
+  {"enc_read_by_grp_resp",       NULL,                e_read_by_grp_resp},
+  {"dec_read_by_grp_resp",       e_read_by_grp_resp,  d_read_by_grp_resp},
+  {"dec_read_by_grp_resp_iter",  e_read_by_grp_resp,  d_read_by_grp_iter},
+  {"enc_read_req",               NULL,                e_read_req},
+  {"dec_read_req",               e_read_req,          d_read_req},
+  {"enc_read_resp",              NULL,                e_read_resp},
+  {"dec_read_resp",              e_read_resp,         d_read_resp},
+  {"enc_read_blob_req",          NULL,                e_read_blob_req},
+  {"dec_read_blob_req",          e_read_blob_req,     d_read_blob_req},
+  {"enc_read_blob_resp",         NULL,                e_read_blob_resp},
+  {"enc_write_req",              NULL,                e_write_req},
+  {"dec_write_req",              e_write_req,         d_write_req},
+  {"enc_write_resp",             NULL,                e_write_resp},
+  {"dec_write_resp",             e_write_resp,        d_write_resp},
+  {"enc_write_cmd",              NULL,                e_write_cmd},
+  {"dec_write_cmd",              e_write_cmd,         d_write_cmd},
+  {"enc_prep_write_req",         NULL,                e_prep_write_req},
+  {"dec_prep_write_req",         e_prep_write_req,    d_prep_write_req},
+  {"enc_prep_write_resp",        NULL,                e_prep_write_resp},
+  {"dec_prep_write_resp",        e_prep_write_resp,   d_prep_write_resp},
+  {"enc_exec_write_req",         NULL,                e_exec_write_req},
+  {"dec_exec_write_req",         e_exec_write_req,    d_exec_write_req},
+  {"enc_exec_write_resp",        NULL,                e_exec_write_resp},
+  {"dec_exec_write_resp",        e_exec_write_resp,   d_exec_write_resp},
+  {"enc_notification",           NULL,                e_notification},
+  {"enc_indication",             NULL,                e_indication},
+  {"dec_indication",             e_indication,        d_indication},
+  {"enc_confirmation",           NULL,                e_confirmation},
+  {"enc_error_resp",             NULL,                e_error_resp},
+};
+
+/* list responses with as many entries as fit the MTU */
+static struct att_data_list *list_fill(uint16_t mtu, uint16_t elen)
+{
+  struct att_data_list *list;
+  uint16_t i;
+
+  list = att_data_list_alloc((mtu - 2) / elen, elen);
+
+  for (i = 0; i < list->num; i++) {
+    memset(list->data[i], 0x5a, elen);
+    att_put_u16(1 + 2 * i, list->data[i]);
+  }
+
+  return list;
+}
+
+static void ctx_init(struct codec_ctx *ctx, uint16_t mtu)
+{
+  struct att_range *range;
+  int i;
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->mtu = mtu;
+
+  for (i = 0; i < ATT_MAX_MTU; i++) {
+    ctx->value[i] = i;
+  }
+
+  bt_uuid16_create(&ctx->prim_uuid, GATT_PRIM_SVC_UUID);
+  bt_uuid16_create(&ctx->char_uuid, GATT_CHARAC_UUID);
+
+  /* 16 bit service UUIDs, declarations with 16 bit UUIDs, descriptors */
+  ctx->grp = list_fill(mtu, 6);
+  ctx->type = list_fill(mtu, 7);
+  ctx->info = list_fill(mtu, 4);
+
+  for (i = 0; i < (mtu - 1) / 4; i++) {
+    range = g_new0(struct att_range, 1);
+    range->start = 1 + 16 * i;
+    range->end = range->start + 15;
+    ctx->ranges = g_slist_append(ctx->ranges, range);
+  }
+}
+
+static void ctx_clear(struct codec_ctx *ctx)
+{
+  att_data_list_free(ctx->grp);
+  att_data_list_free(ctx->type);
+  att_data_list_free(ctx->info);
+  g_slist_free_full(ctx->ranges, g_free);
+}
+
+static GHashTable *baseline_load(const char *path)
+{
+  struct baseline_entry *entry;
+  GHashTable *baseline;
+  char line[256], name[64];
+  double ns, allocs;
+  FILE *f;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return NULL;
+  }
+
+  baseline = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "codec %63s %*u ops %lf ns/op %lf allocs/op", name, &ns,
+               &allocs) != 3) {
+      continue;
+    }
+
+    entry = g_new0(struct baseline_entry, 1);
+    entry->ns = ns;
+    entry->allocs = allocs;
+    g_hash_table_replace(baseline, g_strdup(name), entry);
+  }
+
+  fclose(f);
+
+  return baseline;
+}
+
+/* returns 1 if the case regressed against the baseline */
+static int run_one(struct codec_ctx *ctx, const struct codec_case *cc,
+                   int iters, GHashTable *baseline)
+{
+  struct baseline_entry *base = NULL;
+  uint64_t start, elapsed, best, allocs;
+  double ns, per_op, delta;
+  char name[64];
+  int i, r, regressed = 0;
+
+  if (cc->input) {
+    ctx->in_len = cc->input(ctx, ctx->in);
+    if (ctx->in_len == 0) {
+      printf("codec        %s/%u: no input\n", cc->name, ctx->mtu);
+      return -1;
+    }
+  }
+
+  /* once outside the clock, also checks the case works at all */
+  if (cc->run(ctx, ctx->out) == 0) {
+    printf("codec        %s/%u: failed\n", cc->name, ctx->mtu);
+    return -1;
+  }
+
+  /* the fastest of a few rounds, the others were disturbed */
+  best = UINT64_MAX;
+  allocs = bench_allocs();
+
+  for (r = 0; r < ROUNDS; r++) {
+    start = bench_now_ns();
+
+    for (i = 0; i < iters; i++) {
+      cc->run(ctx, ctx->out);
+    }
+
+    elapsed = bench_now_ns() - start;
+    if (elapsed < best) {
+      best = elapsed;
+    }
+  }
+
+  allocs = bench_allocs() - allocs;
+
+  ns = (double)best / iters;
+  per_op = (double)allocs / ((uint64_t)iters * ROUNDS);
+
+  snprintf(name, sizeof(name), "%s/%u", cc->name, ctx->mtu);
+  printf("%-12s %-32s %10d ops %10.1f ns/op %6.2f allocs/op", "codec", name,
+         iters, ns, per_op);
+
+  if (baseline) {
+    base = g_hash_table_lookup(baseline, name);
+  }
+
+  if (base) {
+    delta = base->ns > 0 ? (ns - base->ns) * 100.0 / base->ns : 0.0;
+    regressed = (delta > REGRESSION_PCT && ns - base->ns > REGRESSION_NS) ||
+                per_op > base->allocs + 0.005;
+    printf(" %+7.1f%%%s", delta, regressed ? " REGRESSION" : "");
+  }
+
+  printf("\n");
+
+  return regressed;
+}
+
+int bench_codec(int argc, char **argv)
+{
+  static const uint16_t mtus[] = {ATT_DEFAULT_LE_MTU, 247, ATT_MAX_MTU};
+  int iters = argc > 0 ? atoi(argv[0]) : 50000;
+  GHashTable *baseline = NULL;
+  struct codec_ctx ctx;
+  unsigned int c, m;
+  int ret, regressions = 0;
+
+  if (iters <= 0) {
+    iters = 1;
+  }
+
+  if (argc > 1) {
+    baseline = baseline_load(argv[1]);
+    if (baseline == NULL) {
+      return -1;
+    }
+  }
+
+  for (m = 0; m < G_N_ELEMENTS(mtus); m++) {
+    ctx_init(&ctx, mtus[m]);
+
+    for (c = 0; c < G_N_ELEMENTS(cases); c++) {
+      ret = run_one(&ctx, &cases[c], iters, baseline);
+      if (ret < 0) {
+        ctx_clear(&ctx);
+        if (baseline) {
+          g_hash_table_destroy(baseline);
+        }
+        return -1;
+      }
+
+      regressions += ret;
+    }
+
+    ctx_clear(&ctx);
+  }
+
+  if (baseline) {
+    printf("%d regressions against %s\n", regressions, argv[1]);
+    g_hash_table_destroy(baseline);
+  }
+
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Decoding the responses of primary service, characteristic and descriptor
+ * discovery, each filled to the MTU. Reported are the time and the heap
+ * allocations per PDU, for
+ *
+ *   list  a struct att_data_list, decoded and freed
+ *   iter  a struct att_list_iter walked over every entry, as gatt.c does
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/att.h>
+
+#include "att_bench.h"
+
+struct decode_case {
+  const char *name;
+  uint8_t opcode;
+  uint8_t elen;     /* entry length, or find info format */
+};
+
+static const struct decode_case cases[] = {
+  {"grp16",   ATT_OP_READ_BY_GROUP_RESP, 6},
+  {"grp128",  ATT_OP_READ_BY_GROUP_RESP, 20},
+  {"type",    ATT_OP_READ_BY_TYPE_RESP,  7},
+  {"info16",  ATT_OP_FIND_INFO_RESP,     ATT_FIND_INFO_RESP_FMT_16BIT},
+  {"info128", ATT_OP_FIND_INFO_RESP,     ATT_FIND_INFO_RESP_FMT_128BIT},
+};
+
+/* a response with as many entries as fit the MTU */
+static uint16_t build_pdu(const struct decode_case *dc, uint16_t mtu,
+                          uint8_t *pdu)
+{
+  uint16_t elen = dc->elen;
+  uint16_t len = 2, handle = 1;
+
+  if (dc->opcode == ATT_OP_FIND_INFO_RESP) {
+    elen = dc->elen == ATT_FIND_INFO_RESP_FMT_16BIT ? 4 : 18;
+  }
+
+  pdu[0] = dc->opcode;
+  pdu[1] = dc->elen;
+
+  while (len + elen <= mtu) {
+    memset(&pdu[len], 0x5a, elen);
+    att_put_u16(handle, &pdu[len]);
+    len += elen;
+    handle += 2;
+  }
+
+  return len;
+}
+
+enum {
+  MODE_LIST,
+  MODE_ITER,
+};
+
+static const char *mode_names[] = {"list", "iter"};
+
+/* keeps the decoded entries from being optimized away */
+static volatile uint8_t sink;
+
+static uint16_t decode_iter(const struct decode_case *dc, const uint8_t *pdu,
+                            uint16_t len, struct att_list_iter *iter)
+{
+  uint8_t format;
+
+  switch (dc->opcode) {
+  case ATT_OP_READ_BY_GROUP_RESP:
+    return dec_read_by_grp_resp_iter(pdu, len, iter);
+  case ATT_OP_READ_BY_TYPE_RESP:
+    return dec_read_by_type_resp_iter(pdu, len, iter);
+  default:
+    return dec_find_info_resp_iter(pdu, len, &format, iter);
+  }
+}
+
+static struct att_data_list *decode(const struct decode_case *dc,
+                                    const uint8_t *pdu, uint16_t len)
+{
+  uint8_t format;
+
+  switch (dc->opcode) {
+  case ATT_OP_READ_BY_GROUP_RESP:
+    return dec_read_by_grp_resp(pdu, len);
+  case ATT_OP_READ_BY_TYPE_RESP:
+    return dec_read_by_type_resp(pdu, len);
+  default:
+    return dec_find_info_resp(pdu, len, &format);
+  }
+}
+
+static int run_one(const struct decode_case *dc, int mode, uint16_t mtu,
+                   int iters)
+{
+  struct att_data_list *list;
+  struct att_list_iter iter;
+  const uint8_t *entry;
+  uint8_t pdu[ATT_MAX_MTU];
+  uint64_t start, elapsed, allocs;
+  uint16_t len, num = 0;
+  char param[32];
+  int i, j;
+
+  len = build_pdu(dc, mtu, pdu);
+
+  allocs = bench_allocs();
+  start = bench_now_ns();
+
+  for (i = 0; i < iters; i++) {
+    if (mode == MODE_ITER) {
+      num = decode_iter(dc, pdu, len, &iter);
+      if (num == 0) {
+        return -1;
+      }
+
+      while ((entry = att_list_iter_next(&iter))) {
+        sink = entry[0];
+      }
+      continue;
+    }
+
+    list = decode(dc, pdu, len);
+    if (list == NULL) {
+      return -1;
+    }
+
+    num = list->num;
+    for (j = 0; j < num; j++) {
+      sink = list->data[j][0];
+    }
+    att_data_list_free(list);
+  }
+
+  elapsed = bench_now_ns() - start;
+  allocs = bench_allocs() - allocs;
+
+  snprintf(param, sizeof(param), "%s %s mtu=%u", mode_names[mode], dc->name,
+           mtu);
+  bench_report("decode", param, iters, elapsed);
+  printf("%-12s %-24s %10.2f allocs/op, %u entries\n", "", "",
+         (double)allocs / iters, num);
+
+  return 0;
+}
+
+int bench_decode(int argc, char **argv)
+{
+  static const uint16_t mtus[] = {ATT_DEFAULT_LE_MTU, ATT_MAX_MTU};
+  int iters = argc > 0 ? atoi(argv[0]) : 200000;
+  unsigned int c, m;
+  int mode;
+
+  if (iters <= 0) {
+    iters = 1;
+  }
+
+  for (c = 0; c < G_N_ELEMENTS(cases); c++) {
+    for (m = 0; m < G_N_ELEMENTS(mtus); m++) {
+      for (mode = MODE_LIST; mode <= MODE_ITER; mode++) {
+        if (run_one(&cases[c], mode, mtus[m], iters) < 0) {
+          return -1;
+        }
+      }
+    }
+  }
+
+  return 0;
+}
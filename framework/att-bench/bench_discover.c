@@ -0,0 +1,268 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Discovering a whole database from the emulated peripheral of
+ * bench_server.c, once of the size of the ring and once with a large
+ * attribute table. Reported are the time per discovery and the PDUs it
+ * sent, for
+ *
+ *   chained    primary services, the included services of each, all
+ *              characteristics, then Find Information over the whole
+ *              range, every step started from the callback of the last
+ *   pipelined  gatt_discover_all()
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define SERVICE_US  1000
+
+enum {
+  MODE_CHAINED,
+  MODE_PIPELINED,
+};
+
+static const char *mode_names[] = {"chained", "pipelined"};
+
+struct disc_size {
+  const char *name;
+  int services;
+  int chars;
+};
+
+static const struct disc_size sizes[] = {
+  {"ring",  BENCH_SERVICES, BENCH_CHARS},
+  {"large", 64,             8},
+};
+
+struct disc_run {
+  GAttrib *attrib;
+  GSList *services;   /* left to look for included services in */
+  guint n_services;
+  guint n_includes;
+  guint n_chars;
+  guint n_descs;
+  uint8_t status;
+  int done;
+};
+
+static void chain_finish(struct disc_run *run, uint8_t status)
+{
+  g_slist_free_full(run->services, g_free);
+  run->services = NULL;
+  run->status = status;
+  run->done = 1;
+}
+
+static void descs_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                     gpointer user_data)
+{
+  struct disc_run *run = user_data;
+  struct att_list_iter iter;
+  const uint8_t *entry;
+  uint16_t last = 0;
+  uint8_t format;
+
+  if (status == ATT_ECODE_ATTR_NOT_FOUND) {
+    chain_finish(run, 0);
+    return;
+  }
+
+  if (status != 0 || dec_find_info_resp_iter(pdu, plen, &format,
+                                             &iter) == 0) {
+    chain_finish(run, status ? status : ATT_ECODE_IO);
+    return;
+  }
+
+  while ((entry = att_list_iter_next(&iter))) {
+    last = att_get_u16(entry);
+    run->n_descs++;
+  }
+
+  if (last == 0xffff) {
+    chain_finish(run, 0);
+    return;
+  }
+
+  gatt_discover_char_desc(run->attrib, last + 1, 0xffff, descs_cb, run);
+}
+
+static void chars_cb(GSList *chars, guint8 status, gpointer user_data)
+{
+  struct disc_run *run = user_data;
+
+  if (status != 0) {
+    chain_finish(run, status);
+    return;
+  }
+
+  run->n_chars = g_slist_length(chars);
+  gatt_discover_char_desc(run->attrib, 0x0001, 0xffff, descs_cb, run);
+}
+
+static void includes_next(struct disc_run *run);
+
+static void includes_cb(GSList *includes, guint8 status, gpointer user_data)
+{
+  struct disc_run *run = user_data;
+
+  if (status != 0 && status != ATT_ECODE_ATTR_NOT_FOUND) {
+    chain_finish(run, status);
+    return;
+  }
+
+  run->n_includes += g_slist_length(includes);
+  includes_next(run);
+}
+
+static void includes_next(struct disc_run *run)
+{
+  struct gatt_primary *prim;
+
+  if (run->services == NULL) {
+    gatt_discover_char(run->attrib, 0x0001, 0xffff, NULL, chars_cb, run);
+    return;
+  }
+
+  prim = run->services->data;
+  run->services = g_slist_delete_link(run->services, run->services);
+
+  gatt_find_included(run->attrib, prim->range.start, prim->range.end,
+                     includes_cb, run);
+  g_free(prim);
+}
+
+static void services_cb(GSList *services, guint8 status, gpointer user_data)
+{
+  struct disc_run *run = user_data;
+
+  if (status != 0) {
+    g_slist_foreach(services, (GFunc)g_free, NULL);
+    chain_finish(run, status);
+    return;
+  }
+
+  /* the entries are ours, the list isn't */
+  run->n_services = g_slist_length(services);
+  run->services = g_slist_copy(services);
+
+  includes_next(run);
+}
+
+static void db_cb(struct gatt_db *db, guint8 status, gpointer user_data)
+{
+  struct disc_run *run = user_data;
+
+  if (db != NULL) {
+    run->n_services = db->n_services;
+    run->n_includes = db->n_includes;
+    run->n_chars = db->n_chars;
+    run->n_descs = db->n_descs;
+    gatt_db_free(db);
+  }
+
+  run->status = status;
+  run->done = 1;
+}
+
+static int discover_once(const struct disc_size *ds, int mode,
+                         struct disc_run *run, uint64_t *pdus)
+{
+  struct bench_peer peer;
+  struct bench_server *srv;
+  GAttribStats stats;
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  srv = bench_server_start(peer.fd, SERVICE_US, ds->services, ds->chars);
+  if (srv == NULL) {
+    bench_peer_close(&peer);
+    return -1;
+  }
+
+  memset(run, 0, sizeof(*run));
+  run->attrib = peer.attrib;
+
+  if (mode == MODE_PIPELINED) {
+    if (gatt_discover_all(peer.attrib, db_cb, run) == NULL) {
+      run->status = ATT_ECODE_IO;
+      run->done = 1;
+    }
+  } else {
+    gatt_discover_primary(peer.attrib, NULL, services_cb, run);
+  }
+
+  bench_run_until(&run->done);
+
+  g_attrib_get_stats(peer.attrib, &stats);
+  *pdus += stats.tx_pdus;
+
+  bench_server_stop(srv);
+  bench_peer_close(&peer);
+
+  if (run->status != 0) {
+    printf("%s: discovery failed: %s\n", mode_names[mode],
+           att_ecode2str(run->status));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int run_one(const struct disc_size *ds, int mode, int rounds)
+{
+  struct disc_run run;
+  uint64_t start, elapsed = 0, pdus = 0;
+  char param[32];
+  int i;
+
+  for (i = 0; i < rounds; i++) {
+    start = bench_now_ns();
+
+    if (discover_once(ds, mode, &run, &pdus) < 0) {
+      return -1;
+    }
+
+    elapsed += bench_now_ns() - start;
+  }
+
+  snprintf(param, sizeof(param), "%s %s", mode_names[mode], ds->name);
+  bench_report("discover", param, rounds, elapsed);
+  printf("%-12s %-24s %.1f ms, %.1f PDUs, %u services %u included "
+         "%u chars\n", "", "", (double)elapsed / rounds / 1000000,
+         (double)pdus / rounds, run.n_services, run.n_includes, run.n_chars);
+
+  return 0;
+}
+
+int bench_discover(int argc, char **argv)
+{
+  int rounds = argc > 0 ? atoi(argv[0]) : 5;
+  unsigned int s;
+  int mode;
+
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  for (s = 0; s < G_N_ELEMENTS(sizes); s++) {
+    for (mode = MODE_CHAINED; mode <= MODE_PIPELINED; mode++) {
+      if (run_one(&sizes[s], mode, rounds) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Per-PDU notification cost as the number of registered handlers grows.
+ * One handler is registered per handle; the ring side only notifies the
+ * handle registered last, which is the worst case for a linear search.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/att.h>
+
+#include "att_bench.h"
+
+#define FIRST_HANDLE   0x0100
+#define BATCH          64
+
+static int delivered;
+static int batch_done;
+
+static void notify_cb(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+  if (++delivered % BATCH == 0) {
+    batch_done = 1;
+  }
+}
+
+static int run_one(int handlers, int pdus)
+{
+  struct bench_peer peer;
+  uint8_t pdu[ATT_DEFAULT_LE_MTU];
+  uint16_t plen;
+  uint64_t start;
+  char param[32];
+  int i, j;
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < handlers; i++) {
+    g_attrib_register(peer.attrib, ATT_OP_HANDLE_NOTIFY, FIRST_HANDLE + i,
+                      notify_cb, NULL, NULL);
+  }
+
+  plen = enc_notification(FIRST_HANDLE + handlers - 1, pdu, 20, pdu,
+                          sizeof(pdu));
+  delivered = 0;
+
+  start = bench_now_ns();
+  for (i = 0; i < pdus; i += BATCH) {
+    for (j = 0; j < BATCH; j++) {
+      if (write(peer.fd, pdu, plen) != plen) {
+        perror("write");
+        bench_peer_close(&peer);
+        return -1;
+      }
+    }
+    batch_done = 0;
+    bench_run_until(&batch_done);
+  }
+
+  snprintf(param, sizeof(param), "handlers=%d", handlers);
+  bench_report("dispatch", param, delivered, bench_now_ns() - start);
+
+  bench_peer_close(&peer);
+
+  return 0;
+}
+
+int bench_dispatch(int argc, char **argv)
+{
+  static const int counts[] = {1, 8, 64, 256, 1024};
+  int pdus = argc > 0 ? atoi(argv[0]) : 100000;
+  unsigned int i;
+
+  pdus -= pdus % BATCH;
+  if (pdus <= 0) {
+    pdus = BATCH;
+  }
+
+  for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    if (run_one(counts[i], pdus) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
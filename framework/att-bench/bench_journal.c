@@ -0,0 +1,262 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Restoring the ring after a link loss. The state the app set up, CCC
+ * enables for every data and control handle, the NCONTROL mode and an LED
+ * pattern, is restored on a fresh connection for every round: the old
+ * socketpair is shut down, a new one plays the reconnected ring and
+ * answers write requests after a fixed service time, standing in for the
+ * connection interval. Reported is the time from the new GAttrib to the
+ * confirmed restore, for
+ *
+ *   sequential  each write as a request, the next one sent on its response
+ *   journal     att_journal_replay()
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/bluetooth/attjournal.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define NCONTROL_HANDLE 0x0062
+#define LIGHTS_HANDLE   0x0070
+#define LIGHTS_TAG      0x33
+#define SERVICE_US      1000
+
+enum {
+  MODE_SEQUENTIAL,
+  MODE_JOURNAL,
+};
+
+static const char *mode_names[] = {"sequential", "journal"};
+
+/* CCC handles of test-bench */
+static const uint16_t ccc_handles[] = {
+  0x00d3, 0x00d7, 0x0046, 0x004f, 0x0004, 0x000d, 0x0020, 0x0024, 0x0063,
+};
+
+struct journal_run {
+  struct bench_peer peer;
+  struct att_journal *journal;
+  guint next;
+  int done;
+  uint8_t status;
+};
+
+static void sequential_write(struct journal_run *run);
+
+static void sequential_cb(guint8 status, const guint8 *pdu, guint16 len,
+                          gpointer user_data)
+{
+  struct journal_run *run = user_data;
+
+  if (status != 0) {
+    run->status = status;
+    run->done = 1;
+    return;
+  }
+
+  sequential_write(run);
+}
+
+/* writes the same state as the journal holds, one request at a time */
+static void sequential_write(struct journal_run *run)
+{
+  static const uint8_t enable[] = {0x01, 0x00};
+  static const uint8_t mode[] = {0x0c, 0x03};
+  static const uint8_t lights[] = {0x08, LIGHTS_TAG, 0x01, 0x03, 0x00, 0x0e,
+                                   0x3c, 0x00};
+  guint n = G_N_ELEMENTS(ccc_handles);
+  guint i = run->next++;
+
+  if (i < n) {
+    gatt_write_char(run->peer.attrib, ccc_handles[i], (uint8_t *)enable,
+                    sizeof(enable), sequential_cb, run);
+  } else if (i == n) {
+    gatt_write_char(run->peer.attrib, NCONTROL_HANDLE, (uint8_t *)mode,
+                    sizeof(mode), sequential_cb, run);
+  } else if (i == n + 1) {
+    gatt_write_char(run->peer.attrib, LIGHTS_HANDLE, (uint8_t *)lights,
+                    sizeof(lights), sequential_cb, run);
+  } else {
+    run->done = 1;
+  }
+}
+
+static void replay_done(guint8 status, gpointer user_data)
+{
+  struct journal_run *run = user_data;
+
+  run->status = status;
+  run->done = 1;
+}
+
+/* the state the app built up before the link went down */
+static struct att_journal *journal_setup(void)
+{
+  static const uint8_t enable[] = {0x01, 0x00};
+  static const uint8_t mode[] = {0x0c, 0x03};
+  static const uint8_t lights[] = {0x08, LIGHTS_TAG, 0x01, 0x03, 0x00, 0x0e,
+                                   0x3c, 0x00};
+  struct att_journal *journal;
+  unsigned int i;
+
+  journal = att_journal_new();
+  if (journal == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < G_N_ELEMENTS(ccc_handles); i++) {
+    att_journal_record(journal, ccc_handles[i], 0, enable, sizeof(enable),
+                       FALSE);
+  }
+
+  att_journal_record(journal, NCONTROL_HANDLE, 0, mode, sizeof(mode), TRUE);
+  att_journal_record(journal, LIGHTS_HANDLE, LIGHTS_TAG, lights,
+                     sizeof(lights), FALSE);
+
+  return journal;
+}
+
+/* plays the reconnected ring: answers each write request after SERVICE_US */
+static void *ring_thread(void *data)
+{
+  struct journal_run *run = data;
+  uint8_t buf[ATT_MAX_MTU];
+  uint8_t rsp = ATT_OP_WRITE_RESP;
+  ssize_t len;
+
+  while ((len = recv(run->peer.fd, buf, sizeof(buf), 0)) > 0) {
+    if (buf[0] != ATT_OP_WRITE_REQ) {
+      continue;
+    }
+
+    usleep(SERVICE_US);
+
+    if (send(run->peer.fd, &rsp, sizeof(rsp), 0) < 0) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static void hist_add_us(GAttribHistogram *hist, uint64_t us)
+{
+  int bucket = 0;
+
+  hist->count++;
+  hist->sum_us += us;
+  if (us > hist->max_us) {
+    hist->max_us = us;
+  }
+
+  while ((us >>= 1) && bucket < GATTRIB_HIST_BUCKETS - 1) {
+    bucket++;
+  }
+
+  hist->bucket[bucket]++;
+}
+
+static int run_one(int mode, int rounds)
+{
+  struct journal_run run;
+  GAttribHistogram restore;
+  GAttribStats stats;
+  uint64_t start, elapsed = 0, writes = 0;
+  pthread_t ring;
+  int i;
+
+  memset(&run, 0, sizeof(run));
+  memset(&restore, 0, sizeof(restore));
+
+  run.journal = journal_setup();
+  if (run.journal == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < rounds; i++) {
+    /* reconnect: a new socketpair and GAttrib, nothing carried over */
+    if (bench_peer_open(&run.peer, ATT_DEFAULT_LE_MTU) < 0) {
+      att_journal_free(run.journal);
+      return -1;
+    }
+
+    if (pthread_create(&ring, NULL, ring_thread, &run) != 0) {
+      bench_peer_close(&run.peer);
+      att_journal_free(run.journal);
+      return -1;
+    }
+
+    run.next = 0;
+    run.done = 0;
+    run.status = 0;
+
+    start = bench_now_ns();
+
+    if (mode == MODE_JOURNAL) {
+      att_journal_replay(run.journal, run.peer.attrib, replay_done, &run);
+    } else {
+      sequential_write(&run);
+    }
+
+    bench_run_until(&run.done);
+
+    elapsed += bench_now_ns() - start;
+    hist_add_us(&restore, (bench_now_ns() - start) / 1000);
+
+    g_attrib_get_stats(run.peer.attrib, &stats);
+    writes += stats.tx_writes;
+
+    /* link loss, the ring thread exits once its end is shut down */
+    shutdown(run.peer.fd, SHUT_RDWR);
+    pthread_join(ring, NULL);
+    bench_peer_close(&run.peer);
+
+    if (run.status != 0) {
+      printf("restore failed: %s\n", att_ecode2str(run.status));
+      att_journal_free(run.journal);
+      return -1;
+    }
+  }
+
+  bench_report("journal", mode_names[mode], rounds, elapsed);
+  printf("%-12s %-24s restore p50 %llu us p99 %llu us, %.1f socket writes\n",
+         "", "",
+         (unsigned long long)g_attrib_histogram_percentile(&restore, 50),
+         (unsigned long long)g_attrib_histogram_percentile(&restore, 99),
+         (double)writes / rounds);
+
+  att_journal_free(run.journal);
+
+  return 0;
+}
+
+int bench_journal(int argc, char **argv)
+{
+  int rounds = argc > 0 ? atoi(argv[0]) : 50;
+  int mode;
+
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  for (mode = MODE_SEQUENTIAL; mode <= MODE_JOURNAL; mode++) {
+    if (run_one(mode, rounds) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Long reads of multi-kilobyte values, such as logs and OTA metadata, from
+ * the emulated ring of bench_server.c, answering without delay. Reported
+ * are the time per read and its heap allocations, for
+ *
+ *   read    gatt_read_char(), the buffer grown as blobs come in
+ *   hint    gatt_read_long_char() told the length up front
+ *   cached  hint, with the first part in GAttrib's read cache and a read
+ *           of another value on air, which the blobs must queue behind;
+ *           the peer takes SERVICE_US per request, the shortest value only
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define SERVICE_US  200
+#define VALUE_LEN   8   /* every other value of bench_server.c */
+
+enum {
+  MODE_READ,
+  MODE_HINT,
+  MODE_CACHED,
+};
+
+static const char *mode_names[] = {"read", "hint", "cached"};
+
+struct long_run {
+  uint16_t handle;
+  uint16_t other;   /* a short value, read alongside */
+  uint16_t len;
+  uint8_t status;
+  int done;
+  int other_done;
+};
+
+static void db_cb(struct gatt_db *db, guint8 status, gpointer user_data)
+{
+  struct long_run *run = user_data;
+
+  run->status = status;
+  run->done = 1;
+
+  if (db == NULL) {
+    return;
+  }
+
+  /* the last characteristic, well clear of GATT and GAP */
+  if (db->n_chars > 1) {
+    run->handle = db->chars[db->n_chars - 1].value_handle;
+    run->other = db->chars[db->n_chars - 2].value_handle;
+  }
+
+  gatt_db_free(db);
+}
+
+static void read_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                    gpointer user_data)
+{
+  struct long_run *run = user_data;
+  uint16_t i;
+
+  run->done = 1;
+  run->status = status;
+
+  if (status != 0) {
+    return;
+  }
+
+  /* the opcode, then the value bench_server_long_value() counts up */
+  if (plen != run->len + 1) {
+    run->status = ATT_ECODE_INVALID_PDU;
+    return;
+  }
+
+  for (i = 0; i < run->len; i++) {
+    if (pdu[1 + i] != (uint8_t)i) {
+      run->status = ATT_ECODE_INVALID_PDU;
+      return;
+    }
+  }
+}
+
+static void other_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                     gpointer user_data)
+{
+  struct long_run *run = user_data;
+
+  if (status == 0 && dec_read_resp(pdu, plen, NULL, 0) != VALUE_LEN) {
+    status = ATT_ECODE_INVALID_PDU;
+  }
+
+  if (status != 0) {
+    run->status = status;
+  }
+
+  run->other_done = 1;
+}
+
+/* the first part of the value goes into the read cache, the rest doesn't */
+static void prime_cache(GAttrib *attrib, struct long_run *run)
+{
+  uint8_t pdu[ATT_DEFAULT_LE_MTU];
+  uint16_t plen;
+
+  g_attrib_invalidate_reads(attrib, run->handle, run->handle);
+
+  plen = enc_read_req(run->handle, pdu, sizeof(pdu));
+  g_attrib_send(attrib, 0, pdu, plen, NULL, NULL, NULL);
+
+  /* answered in order, the cache holds the first part once this is in */
+  run->other_done = 0;
+  gatt_read_char(attrib, run->other, other_cb, run);
+  bench_run_until(&run->other_done);
+}
+
+static int run_one(int mode, uint16_t len, int rounds)
+{
+  struct bench_peer peer;
+  struct bench_server *srv;
+  struct long_run run;
+  uint64_t start, elapsed = 0, allocs = 0, a;
+  char param[32];
+  int i, ret = -1;
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  srv = bench_server_start(peer.fd, mode == MODE_CACHED ? SERVICE_US : 0,
+                           1, 2);
+  if (srv == NULL) {
+    bench_peer_close(&peer);
+    return -1;
+  }
+
+  memset(&run, 0, sizeof(run));
+  if (gatt_discover_all(peer.attrib, db_cb, &run) == NULL) {
+    goto done;
+  }
+  bench_run_until(&run.done);
+
+  if (run.status != 0 || run.handle == 0 ||
+      bench_server_long_value(srv, run.handle, len) < 0) {
+    printf("no value to read\n");
+    goto done;
+  }
+
+  run.len = len;
+
+  if (mode == MODE_CACHED) {
+    g_attrib_set_read_ttl(peer.attrib, run.handle, 60000);
+  }
+
+  for (i = 0; i < rounds; i++) {
+    if (mode == MODE_CACHED) {
+      prime_cache(peer.attrib, &run);
+    }
+
+    run.done = 0;
+    run.other_done = 1;
+
+    a = bench_allocs();
+    start = bench_now_ns();
+
+    if (mode == MODE_CACHED) {
+      run.other_done = 0;
+      gatt_read_char(peer.attrib, run.other, other_cb, &run);
+      gatt_read_long_char(peer.attrib, run.handle, len, read_cb, &run);
+    } else if (mode == MODE_HINT) {
+      gatt_read_long_char(peer.attrib, run.handle, len, read_cb, &run);
+    } else {
+      gatt_read_char(peer.attrib, run.handle, read_cb, &run);
+    }
+
+    bench_run_until(&run.done);
+    bench_run_until(&run.other_done);
+
+    elapsed += bench_now_ns() - start;
+    allocs += bench_allocs() - a;
+
+    if (run.status != 0) {
+      printf("%s: read failed: %s\n", mode_names[mode],
+             att_ecode2str(run.status));
+      goto done;
+    }
+  }
+
+  snprintf(param, sizeof(param), "%s len=%u", mode_names[mode], len);
+  bench_report("long", param, rounds, elapsed);
+  printf("%-12s %-24s %.1f allocs per read\n", "", "",
+         (double)allocs / rounds);
+  ret = 0;
+
+done:
+  bench_server_stop(srv);
+  bench_peer_close(&peer);
+
+  return ret;
+}
+
+int bench_long(int argc, char **argv)
+{
+  static const uint16_t lens[] = {512, 2048, 8192, 32768};
+  int rounds = argc > 0 ? atoi(argv[0]) : 200;
+  unsigned int l;
+  int mode;
+
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  for (l = 0; l < G_N_ELEMENTS(lens); l++) {
+    for (mode = MODE_READ; mode <= MODE_CACHED; mode++) {
+      /* paced by the service time, the shortest value proves the point */
+      if (mode == MODE_CACHED && l > 0) {
+        continue;
+      }
+
+      if (run_one(mode, lens[l], rounds) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Event loop backends under the same socketpair workload. A ring thread
+ * sends time stamped notifications and waits for the write command the
+ * handler answers with, so every PDU costs one full wakeup of the loop.
+ * Reported are the notification wakeup latency and the CPU time the loop
+ * thread spent per PDU, for
+ *
+ *   glib      GAttrib on the default GLib main context
+ *   epoll     GAttrib on its own epoll loop, run with io_loop_run()
+ *   attached  the epoll loop dispatched from the GLib main context
+ */
+#define _GNU_SOURCE   /* RUSAGE_THREAD */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define MOTION_HANDLE   0x0025
+#define ACK_HANDLE      0x0062
+
+enum {
+  BACKEND_GLIB,
+  BACKEND_EPOLL,
+  BACKEND_ATTACHED,
+};
+
+static const char *backend_names[] = {"glib", "epoll", "attached"};
+
+struct loop_run {
+  struct bench_peer peer;
+  struct io_loop *loop;   /* loop the GAttrib lives on */
+  struct io_loop *runner; /* loop the bench thread runs */
+  int pdus;
+  int seen;
+  GAttribHistogram latency;
+};
+
+static uint64_t thread_cpu_ns(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_THREAD, &ru);
+
+  return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+         (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static void hist_add_us(GAttribHistogram *hist, uint64_t us)
+{
+  int bucket = 0;
+
+  hist->count++;
+  hist->sum_us += us;
+  if (us > hist->max_us) {
+    hist->max_us = us;
+  }
+
+  while ((us >>= 1) && bucket < GATTRIB_HIST_BUCKETS - 1) {
+    bucket++;
+  }
+
+  hist->bucket[bucket]++;
+}
+
+static void motion_cb(const guint8 *pdu, guint16 len, gpointer user_data)
+{
+  struct loop_run *run = user_data;
+  uint8_t ack[2] = {0x01, 0x00};
+  uint64_t sent_ns;
+
+  if (len < 3 + sizeof(sent_ns)) {
+    return;
+  }
+
+  memcpy(&sent_ns, &pdu[3], sizeof(sent_ns));
+  hist_add_us(&run->latency, (bench_now_ns() - sent_ns) / 1000);
+
+  gatt_write_cmd(run->peer.attrib, ACK_HANDLE, ack, sizeof(ack), NULL, NULL);
+
+  if (++run->seen == run->pdus) {
+    io_loop_quit(run->runner);
+  }
+}
+
+/* plays the ring: one notification, then wait for the handler's ack */
+static void *ring_thread(void *data)
+{
+  struct loop_run *run = data;
+  uint8_t pdu[3 + sizeof(uint64_t)];
+  uint8_t buf[ATT_MAX_MTU];
+  uint64_t now;
+  int i;
+
+  pdu[0] = ATT_OP_HANDLE_NOTIFY;
+  att_put_u16(MOTION_HANDLE, &pdu[1]);
+
+  for (i = 0; i < run->pdus; i++) {
+    now = bench_now_ns();
+    memcpy(&pdu[3], &now, sizeof(now));
+
+    if (send(run->peer.fd, pdu, sizeof(pdu), 0) < 0) {
+      perror("ring send");
+      break;
+    }
+
+    /* the loop quits on the last notification, its ack is never sent */
+    if (i < run->pdus - 1 && recv(run->peer.fd, buf, sizeof(buf), 0) <= 0) {
+      perror("ring recv");
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static int run_one(int backend, int pdus)
+{
+  struct loop_run run;
+  pthread_t ring;
+  uint64_t start, cpu;
+  guint attached = 0;
+  char param[32];
+
+  memset(&run, 0, sizeof(run));
+  run.pdus = pdus;
+  run.loop = io_loop_default();
+  run.runner = run.loop;
+
+  if (backend != BACKEND_GLIB) {
+    run.loop = io_loop_epoll_new();
+    if (run.loop == NULL) {
+      return -1;
+    }
+    run.runner = run.loop;
+  }
+
+  if (backend == BACKEND_ATTACHED) {
+    attached = io_loop_attach(run.loop);
+    run.runner = io_loop_default();
+  }
+
+  if (bench_peer_open_with_loop(&run.peer, ATT_DEFAULT_LE_MTU,
+                                run.loop) < 0) {
+    goto fail;
+  }
+
+  g_attrib_register(run.peer.attrib, ATT_OP_HANDLE_NOTIFY, MOTION_HANDLE,
+                    motion_cb, &run, NULL);
+
+  if (pthread_create(&ring, NULL, ring_thread, &run) != 0) {
+    bench_peer_close(&run.peer);
+    goto fail;
+  }
+
+  start = bench_now_ns();
+  cpu = thread_cpu_ns();
+
+  io_loop_run(run.runner);
+
+  cpu = thread_cpu_ns() - cpu;
+  snprintf(param, sizeof(param), "%s", backend_names[backend]);
+  bench_report("loop", param, run.seen, bench_now_ns() - start);
+
+  printf("%-12s %-24s %10.2f us/pdu cpu, wakeup p50 %llu us p99 %llu us "
+         "max %llu us\n", "", "",
+         run.seen ? (double)cpu / run.seen / 1000.0 : 0.0,
+         (unsigned long long)g_attrib_histogram_percentile(&run.latency, 50),
+         (unsigned long long)g_attrib_histogram_percentile(&run.latency, 99),
+         (unsigned long long)run.latency.max_us);
+
+  pthread_join(ring, NULL);
+  bench_peer_close(&run.peer);
+
+  if (attached) {
+    g_source_remove(attached);
+  }
+
+  if (backend != BACKEND_GLIB) {
+    io_loop_free(run.loop);
+  }
+
+  return 0;
+
+fail:
+  if (attached) {
+    g_source_remove(attached);
+  }
+
+  if (backend != BACKEND_GLIB) {
+    io_loop_free(run.loop);
+  }
+
+  return -1;
+}
+
+int bench_loop(int argc, char **argv)
+{
+  int pdus = argc > 0 ? atoi(argv[0]) : 20000;
+  int backend;
+
+  if (pdus <= 0) {
+    pdus = 1;
+  }
+
+  for (backend = BACKEND_GLIB; backend <= BACKEND_ATTACHED; backend++) {
+    if (run_one(backend, pdus) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Polling N characteristic values of the emulated ring of bench_server.c,
+ * as the battery, version and mode state are. Reported are the time per
+ * poll and the requests it took, for
+ *
+ *   single  gatt_read_char() per handle, all of them queued at once
+ *   multi   gatt_read_multi() with all of them
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define SERVICE_US  1000
+#define MAX_HANDLES 16
+#define VALUE_LEN   8   /* every value of bench_server.c */
+
+enum {
+  MODE_SINGLE,
+  MODE_MULTI,
+};
+
+static const char *mode_names[] = {"single", "multi"};
+
+struct multi_run {
+  uint16_t handles[MAX_HANDLES];
+  uint16_t lens[MAX_HANDLES];
+  int n;
+  int pending;
+  int done;
+  uint8_t status;
+};
+
+static void db_cb(struct gatt_db *db, guint8 status, gpointer user_data)
+{
+  struct multi_run *run = user_data;
+  guint i;
+
+  run->status = status;
+  run->done = 1;
+
+  if (db == NULL) {
+    return;
+  }
+
+  for (i = 0; i < db->n_chars && run->n < MAX_HANDLES; i++) {
+    if (db->chars[i].properties & ATT_CHAR_PROPER_READ) {
+      run->handles[run->n] = db->chars[i].value_handle;
+      run->lens[run->n] = VALUE_LEN;
+      run->n++;
+    }
+  }
+
+  gatt_db_free(db);
+}
+
+static void read_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                    gpointer user_data)
+{
+  struct multi_run *run = user_data;
+
+  if (status == 0 && dec_read_resp(pdu, plen, NULL, 0) != VALUE_LEN) {
+    status = ATT_ECODE_INVALID_PDU;
+  }
+
+  if (status != 0) {
+    run->status = status;
+  }
+
+  if (--run->pending == 0) {
+    run->done = 1;
+  }
+}
+
+static void read_multi_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                          gpointer user_data)
+{
+  struct multi_run *run = user_data;
+
+  if (status == 0 &&
+      dec_read_multi_resp(pdu, plen, NULL, 0) != run->pending * VALUE_LEN) {
+    status = ATT_ECODE_INVALID_PDU;
+  }
+
+  run->status = status;
+  run->done = 1;
+}
+
+static int run_one(struct bench_peer *peer, struct multi_run *run, int mode,
+                   int handles, int rounds)
+{
+  GAttribStats before, after;
+  uint64_t start, elapsed = 0;
+  char param[32];
+  int i, j;
+
+  g_attrib_get_stats(peer->attrib, &before);
+
+  for (i = 0; i < rounds; i++) {
+    run->done = 0;
+    run->status = 0;
+    run->pending = handles;
+
+    start = bench_now_ns();
+
+    if (mode == MODE_MULTI) {
+      gatt_read_multi(peer->attrib, run->handles, run->lens, handles,
+                      read_multi_cb, run);
+    } else {
+      for (j = 0; j < handles; j++) {
+        gatt_read_char(peer->attrib, run->handles[j], read_cb, run);
+      }
+    }
+
+    bench_run_until(&run->done);
+    elapsed += bench_now_ns() - start;
+
+    if (run->status != 0) {
+      printf("%s: read failed: %s\n", mode_names[mode],
+             att_ecode2str(run->status));
+      return -1;
+    }
+  }
+
+  g_attrib_get_stats(peer->attrib, &after);
+
+  snprintf(param, sizeof(param), "%s handles=%d", mode_names[mode], handles);
+  bench_report("multi", param, rounds, elapsed);
+  printf("%-12s %-24s %.2f ms, %.1f requests per poll\n", "", "",
+         (double)elapsed / rounds / 1000000,
+         (double)(after.tx_pdus - before.tx_pdus) / rounds);
+
+  return 0;
+}
+
+int bench_multi(int argc, char **argv)
+{
+  static const int handles[] = {2, 4, 8, MAX_HANDLES};
+  struct bench_peer peer;
+  struct bench_server *srv;
+  struct multi_run run;
+  int rounds = argc > 0 ? atoi(argv[0]) : 50;
+  unsigned int h;
+  int mode, ret = 0;
+
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  srv = bench_server_start(peer.fd, SERVICE_US, BENCH_SERVICES, BENCH_CHARS);
+  if (srv == NULL) {
+    bench_peer_close(&peer);
+    return -1;
+  }
+
+  /* the handles to poll, from the database */
+  memset(&run, 0, sizeof(run));
+  if (gatt_discover_all(peer.attrib, db_cb, &run) == NULL) {
+    ret = -1;
+  } else {
+    bench_run_until(&run.done);
+  }
+
+  if (ret == 0 && (run.status != 0 || run.n < MAX_HANDLES)) {
+    printf("discovery found %d readable values\n", run.n);
+    ret = -1;
+  }
+
+  for (h = 0; h < G_N_ELEMENTS(handles) && ret == 0; h++) {
+    for (mode = MODE_SINGLE; mode <= MODE_MULTI && ret == 0; mode++) {
+      ret = run_one(&peer, &run, mode, handles[h], rounds);
+    }
+  }
+
+  bench_server_stop(srv);
+  bench_peer_close(&peer);
+
+  return ret;
+}
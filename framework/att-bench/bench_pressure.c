@@ -0,0 +1,190 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Stress for the queue watermarks. A producer pushes write commands from an
+ * idle callback as fast as the main loop lets it, while the ring thread is
+ * a deliberately slow reader behind a small socket buffer. Reported are the
+ * peak queue depth, the time commands spent queued and the throughput, for
+ *
+ *   unbounded  the producer ignores queue pressure
+ *   pdus       throttled by PDU count watermarks
+ *   bytes      throttled by byte watermarks
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define LIGHTS_HANDLE   0x0070
+#define BURST           64
+#define READER_DELAY_US 20
+#define SOCKET_BUFFER   4096
+
+enum {
+  MODE_UNBOUNDED,
+  MODE_PDUS,
+  MODE_BYTES,
+};
+
+static const char *mode_names[] = {"unbounded", "pdus", "bytes"};
+
+struct pressure_run {
+  struct bench_peer peer;
+  int total;
+  int produced;
+  guint idle;
+  guint throttled;
+  volatile int done;
+};
+
+static gboolean produce(gpointer user_data)
+{
+  struct pressure_run *run = user_data;
+  uint8_t value[16];
+  int i;
+
+  memset(value, 0x5a, sizeof(value));
+
+  for (i = 0; i < BURST && run->produced < run->total; i++) {
+    gatt_write_cmd(run->peer.attrib, LIGHTS_HANDLE, value, sizeof(value),
+                   NULL, NULL);
+    run->produced++;
+
+    /* the watermark callback ran from inside gatt_write_cmd() */
+    if (run->idle == 0) {
+      return FALSE;
+    }
+  }
+
+  if (run->produced < run->total) {
+    return TRUE;
+  }
+
+  run->idle = 0;
+
+  return FALSE;
+}
+
+static void pressure_cb(GAttrib *attrib, gboolean high, gpointer user_data)
+{
+  struct pressure_run *run = user_data;
+
+  if (high) {
+    run->throttled++;
+    if (run->idle) {
+      g_source_remove(run->idle);
+      run->idle = 0;
+    }
+    return;
+  }
+
+  if (run->idle == 0 && run->produced < run->total) {
+    run->idle = g_idle_add(produce, run);
+  }
+}
+
+/* plays a slow ring */
+static void *reader_thread(void *data)
+{
+  struct pressure_run *run = data;
+  uint8_t buf[ATT_MAX_MTU];
+  int seen = 0;
+
+  while (seen < run->total && recv(run->peer.fd, buf, sizeof(buf), 0) > 0) {
+    seen++;
+    usleep(READER_DELAY_US);
+  }
+
+  run->done = 1;
+  g_main_context_wakeup(NULL);
+
+  return NULL;
+}
+
+static int run_one(int mode, int total)
+{
+  struct pressure_run run;
+  GAttribHistogram wait;
+  GAttribStats stats;
+  pthread_t reader;
+  uint64_t start, elapsed;
+  int size = SOCKET_BUFFER;
+
+  memset(&run, 0, sizeof(run));
+  run.total = total;
+
+  if (bench_peer_open(&run.peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  setsockopt(g_io_channel_unix_get_fd(run.peer.io), SOL_SOCKET, SO_SNDBUF,
+             &size, sizeof(size));
+  setsockopt(run.peer.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  if (mode == MODE_PDUS) {
+    g_attrib_set_watermarks(run.peer.attrib, 64, 16, 0, 0, pressure_cb, &run);
+  } else if (mode == MODE_BYTES) {
+    g_attrib_set_watermarks(run.peer.attrib, 0, 0, 2048, 512, pressure_cb,
+                            &run);
+  }
+
+  if (pthread_create(&reader, NULL, reader_thread, &run) != 0) {
+    bench_peer_close(&run.peer);
+    return -1;
+  }
+
+  start = bench_now_ns();
+  run.idle = g_idle_add(produce, &run);
+  bench_run_until((const int *)&run.done);
+  elapsed = bench_now_ns() - start;
+
+  pthread_join(reader, NULL);
+
+  g_attrib_get_stats(run.peer.attrib, &stats);
+  g_attrib_get_queue_wait(run.peer.attrib, G_ATTRIB_QUEUE_REQUESTS, &wait);
+
+  bench_report("pressure", mode_names[mode], total, elapsed);
+  printf("%-12s %-24s peak %u pdus %zu bytes, wait p50 %llu us "
+         "p99 %llu us, throttled %u times\n", "", "",
+         stats.queue_max_pdus, stats.queue_max_bytes,
+         (unsigned long long)g_attrib_histogram_percentile(&wait, 50),
+         (unsigned long long)g_attrib_histogram_percentile(&wait, 99),
+         run.throttled);
+
+  if (run.idle) {
+    g_source_remove(run.idle);
+  }
+
+  bench_peer_close(&run.peer);
+
+  return 0;
+}
+
+int bench_pressure(int argc, char **argv)
+{
+  int total = argc > 0 ? atoi(argv[0]) : 20000;
+  int mode;
+
+  if (total <= 0) {
+    total = 1;
+  }
+
+  for (mode = MODE_UNBOUNDED; mode <= MODE_BYTES; mode++) {
+    if (run_one(mode, total) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Latency of short control writes (NCONTROL mode switches) while a bulk
+ * transfer keeps the request queue full. The ring thread answers every
+ * write request after a fixed service time, standing in for the
+ * connection interval. Reported is the control write latency from queueing
+ * to response, for
+ *
+ *   idle      no bulk transfer
+ *   fifo      bulk and control writes at the same priority, as before
+ *   priority  bulk at G_ATTRIB_PRIORITY_BULK, control writes URGENT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define NCONTROL_HANDLE 0x0062
+#define BULK_HANDLE     0x0070
+#define BULK_DEPTH      32
+#define SERVICE_US      200
+#define CONTROL_MS      5
+
+enum {
+  MODE_IDLE,
+  MODE_FIFO,
+  MODE_PRIORITY,
+};
+
+static const char *mode_names[] = {"idle", "fifo", "priority"};
+
+struct priority_run {
+  struct bench_peer peer;
+  int mode;
+  int controls;
+  int done_controls;
+  int stopping;
+  int done;
+  int bulk_queued;
+  uint64_t bulk_writes;
+  GAttribHistogram latency;
+};
+
+struct control_write {
+  struct priority_run *run;
+  uint64_t queued_ns;
+};
+
+static void hist_add_us(GAttribHistogram *hist, uint64_t us)
+{
+  int bucket = 0;
+
+  hist->count++;
+  hist->sum_us += us;
+  if (us > hist->max_us) {
+    hist->max_us = us;
+  }
+
+  while ((us >>= 1) && bucket < GATTRIB_HIST_BUCKETS - 1) {
+    bucket++;
+  }
+
+  hist->bucket[bucket]++;
+}
+
+static void bulk_write(struct priority_run *run);
+
+static void bulk_cb(guint8 status, const guint8 *pdu, guint16 len,
+                    gpointer user_data)
+{
+  struct priority_run *run = user_data;
+
+  run->bulk_queued--;
+  run->bulk_writes++;
+
+  if (!run->stopping) {
+    bulk_write(run);
+  }
+}
+
+static void bulk_write(struct priority_run *run)
+{
+  uint8_t buf[ATT_DEFAULT_LE_MTU];
+  uint8_t value[ATT_DEFAULT_LE_MTU - 3];
+  guint16 plen;
+
+  memset(value, 0xa5, sizeof(value));
+  plen = enc_write_req(BULK_HANDLE, value, sizeof(value), buf, sizeof(buf));
+
+  g_attrib_send_with_priority(run->peer.attrib, 0, buf, plen,
+                              run->mode == MODE_PRIORITY ?
+                              G_ATTRIB_PRIORITY_BULK :
+                              G_ATTRIB_PRIORITY_NORMAL,
+                              bulk_cb, run, NULL);
+  run->bulk_queued++;
+}
+
+static void control_cb(guint8 status, const guint8 *pdu, guint16 len,
+                       gpointer user_data)
+{
+  struct control_write *cw = user_data;
+  struct priority_run *run = cw->run;
+
+  hist_add_us(&run->latency, (bench_now_ns() - cw->queued_ns) / 1000);
+
+  if (++run->done_controls == run->controls) {
+    run->stopping = 1;
+  }
+}
+
+static gboolean control_tick(gpointer user_data)
+{
+  struct priority_run *run = user_data;
+  struct control_write *cw;
+  uint8_t buf[ATT_DEFAULT_LE_MTU];
+  uint8_t mode[2] = {0x01, 0x00};
+  guint16 plen;
+
+  if (run->stopping) {
+    /* let the outstanding bulk writes drain */
+    if (run->bulk_queued == 0) {
+      run->done = 1;
+      return FALSE;
+    }
+
+    return TRUE;
+  }
+
+  cw = g_new0(struct control_write, 1);
+  cw->run = run;
+  cw->queued_ns = bench_now_ns();
+
+  plen = enc_write_req(NCONTROL_HANDLE, mode, sizeof(mode), buf, sizeof(buf));
+  g_attrib_send_with_priority(run->peer.attrib, 0, buf, plen,
+                              run->mode == MODE_PRIORITY ?
+                              G_ATTRIB_PRIORITY_URGENT :
+                              G_ATTRIB_PRIORITY_NORMAL,
+                              control_cb, cw, g_free);
+
+  return TRUE;
+}
+
+/* plays the ring: answers each write request after SERVICE_US */
+static void *ring_thread(void *data)
+{
+  struct priority_run *run = data;
+  uint8_t buf[ATT_MAX_MTU];
+  uint8_t rsp = ATT_OP_WRITE_RESP;
+  ssize_t len;
+
+  while ((len = recv(run->peer.fd, buf, sizeof(buf), 0)) > 0) {
+    if (buf[0] != ATT_OP_WRITE_REQ) {
+      continue;
+    }
+
+    usleep(SERVICE_US);
+
+    if (send(run->peer.fd, &rsp, sizeof(rsp), 0) < 0) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+static int run_one(int mode, int controls)
+{
+  struct priority_run run;
+  pthread_t ring;
+  uint64_t start, elapsed;
+  char param[32];
+  int i;
+
+  memset(&run, 0, sizeof(run));
+  run.mode = mode;
+  run.controls = controls;
+
+  if (bench_peer_open(&run.peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  if (pthread_create(&ring, NULL, ring_thread, &run) != 0) {
+    bench_peer_close(&run.peer);
+    return -1;
+  }
+
+  if (mode != MODE_IDLE) {
+    for (i = 0; i < BULK_DEPTH; i++) {
+      bulk_write(&run);
+    }
+  }
+
+  g_timeout_add(CONTROL_MS, control_tick, &run);
+
+  start = bench_now_ns();
+  bench_run_until(&run.done);
+  elapsed = bench_now_ns() - start;
+
+  /* the ring thread exits once its end of the socketpair is shut down */
+  shutdown(run.peer.fd, SHUT_RDWR);
+  pthread_join(ring, NULL);
+
+  snprintf(param, sizeof(param), "%s", mode_names[mode]);
+  bench_report("priority", param, run.done_controls, elapsed);
+
+  printf("%-12s %-24s control p50 %llu us p99 %llu us max %llu us, "
+         "%.0f bulk writes/s\n", "", "",
+         (unsigned long long)g_attrib_histogram_percentile(&run.latency, 50),
+         (unsigned long long)g_attrib_histogram_percentile(&run.latency, 99),
+         (unsigned long long)run.latency.max_us,
+         elapsed ? run.bulk_writes * 1e9 / elapsed : 0.0);
+
+  bench_peer_close(&run.peer);
+
+  return 0;
+}
+
+int bench_priority(int argc, char **argv)
+{
+  int controls = argc > 0 ? atoi(argv[0]) : 200;
+  int mode;
+
+  if (controls <= 0) {
+    controls = 1;
+  }
+
+  for (mode = MODE_IDLE; mode <= MODE_PRIORITY; mode++) {
+    if (run_one(mode, controls) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Scaling of the multi-connection reactor. 1-64 simulated peripherals sit
+ * behind socketpairs and are spread over 1-4 IO threads, with one worker
+ * thread per IO thread. The bench thread sends time stamped notifications
+ * round robin over all peers, keeping a fixed window in flight, and every
+ * delivery on a worker is timed against its stamp.
+ *
+ * Reported per thread/peer count are notifications/s and the p99 latency
+ * from send() on the peer to the worker callback.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/bluetooth/attreactor.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+
+#include "att_bench.h"
+
+#define MOTION_HANDLE   0x0025
+#define WINDOW          256
+
+struct reactor_peer {
+  guint conn;
+  int fd;                     /* remote end, plays the ring */
+  GAttribHistogram latency;   /* only touched by the peer's worker */
+};
+
+static volatile gint delivered;
+
+static void hist_add_us(GAttribHistogram *hist, uint64_t us)
+{
+  int bucket = 0;
+
+  hist->count++;
+  hist->sum_us += us;
+  if (us > hist->max_us) {
+    hist->max_us = us;
+  }
+
+  while ((us >>= 1) && bucket < GATTRIB_HIST_BUCKETS - 1) {
+    bucket++;
+  }
+
+  hist->bucket[bucket]++;
+}
+
+static void hist_merge(GAttribHistogram *dst, const GAttribHistogram *src)
+{
+  int i;
+
+  dst->count += src->count;
+  dst->sum_us += src->sum_us;
+  if (src->max_us > dst->max_us) {
+    dst->max_us = src->max_us;
+  }
+
+  for (i = 0; i < GATTRIB_HIST_BUCKETS; i++) {
+    dst->bucket[i] += src->bucket[i];
+  }
+}
+
+static void motion_cb(guint conn, const uint8_t *pdu, uint16_t len,
+                      gpointer user_data)
+{
+  struct reactor_peer *peer = user_data;
+  uint64_t sent_ns;
+
+  if (len < 3 + sizeof(sent_ns)) {
+    return;
+  }
+
+  memcpy(&sent_ns, &pdu[3], sizeof(sent_ns));
+  hist_add_us(&peer->latency, (bench_now_ns() - sent_ns) / 1000);
+
+  g_atomic_int_inc(&delivered);
+}
+
+static int run_one(unsigned int threads, int n_peers, int pdus)
+{
+  struct att_reactor *reactor;
+  struct reactor_peer *peers;
+  GAttribHistogram total;
+  uint8_t pdu[3 + sizeof(uint64_t)];
+  uint64_t start, now;
+  char param[32];
+  int i, sent, ret = -1;
+
+  reactor = att_reactor_new(threads, threads);
+  if (reactor == NULL) {
+    return -1;
+  }
+
+  peers = g_new0(struct reactor_peer, n_peers);
+  for (i = 0; i < n_peers; i++) {
+    GIOChannel *io;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+      perror("socketpair");
+      n_peers = i;
+      goto done;
+    }
+
+    peers[i].fd = sv[1];
+    io = g_io_channel_unix_new(sv[0]);
+    g_io_channel_set_close_on_unref(io, TRUE);
+
+    /* the reactor holds its own reference */
+    peers[i].conn = att_reactor_add(reactor, io, ATT_DEFAULT_LE_MTU,
+                                    motion_cb, &peers[i], NULL);
+    g_io_channel_unref(io);
+  }
+
+  pdu[0] = ATT_OP_HANDLE_NOTIFY;
+  att_put_u16(MOTION_HANDLE, &pdu[1]);
+  g_atomic_int_set(&delivered, 0);
+
+  start = bench_now_ns();
+
+  for (sent = 0; sent < pdus; sent++) {
+    while (sent - g_atomic_int_get(&delivered) >= WINDOW) {
+      sched_yield();
+    }
+
+    now = bench_now_ns();
+    memcpy(&pdu[3], &now, sizeof(now));
+
+    if (send(peers[sent % n_peers].fd, pdu, sizeof(pdu), 0) < 0) {
+      perror("peer send");
+      goto done;
+    }
+  }
+
+  while (g_atomic_int_get(&delivered) < pdus) {
+    sched_yield();
+  }
+
+  now = bench_now_ns() - start;
+  ret = 0;
+
+done:
+  /* joins the workers, the histograms are stable after this */
+  att_reactor_free(reactor);
+
+  if (ret == 0) {
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < n_peers; i++) {
+      hist_merge(&total, &peers[i].latency);
+    }
+
+    snprintf(param, sizeof(param), "threads=%u peers=%d", threads, n_peers);
+    bench_report("reactor", param, pdus, now);
+    printf("%-12s %-24s %10.0f notif/s, p50 %llu us p99 %llu us\n", "", "",
+           now ? pdus * 1e9 / now : 0.0,
+           (unsigned long long)g_attrib_histogram_percentile(&total, 50),
+           (unsigned long long)g_attrib_histogram_percentile(&total, 99));
+  }
+
+  for (i = 0; i < n_peers; i++) {
+    close(peers[i].fd);
+  }
+
+  g_free(peers);
+
+  return ret;
+}
+
+int bench_reactor(int argc, char **argv)
+{
+  static const unsigned int threads[] = {1, 2, 4};
+  static const int peers[] = {1, 8, 64};
+  int pdus = argc > 0 ? atoi(argv[0]) : 200000;
+  unsigned int t;
+  unsigned int p;
+
+  if (pdus <= 0) {
+    pdus = 1;
+  }
+
+  for (t = 0; t < G_N_ELEMENTS(threads); t++) {
+    for (p = 0; p < G_N_ELEMENTS(peers); p++) {
+      if (run_one(threads[t], peers[p], pdus) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
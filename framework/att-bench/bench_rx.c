@@ -0,0 +1,93 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Receive path throughput for bursts of notifications, together with the
+ * number of PDUs GAttrib handled per G_IO_IN wakeup.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/att.h>
+
+#include "att_bench.h"
+
+#define POSE6D_HANDLE  0x0042
+
+static int delivered;
+static int wanted;
+static int burst_done;
+
+static void notify_cb(const uint8_t *pdu, uint16_t len, gpointer user_data)
+{
+  if (++delivered == wanted) {
+    burst_done = 1;
+  }
+}
+
+static int run_one(int burst, int pdus)
+{
+  struct bench_peer peer;
+  GAttribStats stats;
+  uint8_t pdu[ATT_DEFAULT_LE_MTU];
+  uint16_t plen;
+  uint64_t start;
+  char param[32];
+  int i, j;
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  g_attrib_register(peer.attrib, ATT_OP_HANDLE_NOTIFY, POSE6D_HANDLE,
+                    notify_cb, NULL, NULL);
+
+  plen = enc_notification(POSE6D_HANDLE, pdu, 20, pdu, sizeof(pdu));
+  delivered = 0;
+  wanted = 0;
+
+  start = bench_now_ns();
+  for (i = 0; i < pdus; i += burst) {
+    for (j = 0; j < burst; j++) {
+      if (write(peer.fd, pdu, plen) != plen) {
+        perror("write");
+        bench_peer_close(&peer);
+        return -1;
+      }
+    }
+    wanted += burst;
+    burst_done = 0;
+    bench_run_until(&burst_done);
+  }
+
+  snprintf(param, sizeof(param), "burst=%d", burst);
+  bench_report("rx", param, delivered, bench_now_ns() - start);
+
+  g_attrib_get_stats(peer.attrib, &stats);
+  printf("%-12s %-24s %10llu wakeups %6.1f pdus/wakeup, max %u, "
+         "%llu reads\n", "", "", (unsigned long long)stats.rx_wakeups,
+         stats.rx_wakeups ? (double)stats.rx_pdus / stats.rx_wakeups : 0.0,
+         stats.rx_max_batch, (unsigned long long)stats.rx_reads);
+
+  bench_peer_close(&peer);
+
+  return 0;
+}
+
+int bench_rx(int argc, char **argv)
+{
+  static const int bursts[] = {1, 4, 16, 64};
+  int pdus = argc > 0 ? atoi(argv[0]) : 64000;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(bursts) / sizeof(bursts[0]); i++) {
+    if (run_one(bursts[i], pdus - pdus % bursts[i]) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
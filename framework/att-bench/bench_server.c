@@ -0,0 +1,573 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * An emulated ring database for the discovery benchmarks. A thread serves
+ * the remote end of a bench_peer and answers every request after a fixed
+ * service time, standing in for the connection interval. The database has
+ * the GATT service with Service Changed, its CCC at 0x0004 as on the ring,
+ * GAP, and a given number of services of notifying characteristics, every
+ * other one with 128-bit UUIDs and including the one before it. Values are
+ * 8 octets unless made long, by a prepared write among others. Enabling a
+ * CCC is answered with a notification of its value.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+struct attr {
+  uint16_t handle;
+  uint8_t type[16];
+  uint8_t tlen;
+  uint8_t value[20];
+  uint8_t vlen;
+  uint8_t *blob;      /* a long value in place of value */
+  uint16_t blen;
+};
+
+struct bench_server {
+  struct attr *attrs;
+  uint16_t n;
+  uint8_t *prep;            /* the prepare queue, one handle at a time */
+  uint16_t prep_handle;
+  size_t prep_len;
+  int fd;
+  unsigned int service_us;
+  pthread_t thread;
+};
+
+/* vendor base of the OpenSpatial services, the last two bytes vary */
+static const uint8_t vendor_base[16] = {
+  0x00, 0x00, 0x5a, 0x5a, 0x00, 0x10, 0x8c, 0x4e,
+  0x9b, 0x2a, 0x1c, 0x3e, 0x00, 0x00, 0x00, 0x00,
+};
+
+static struct attr *attr_add(struct bench_server *srv, uint16_t type,
+                             const uint8_t *value, uint8_t vlen)
+{
+  struct attr *a = &srv->attrs[srv->n];
+
+  a->handle = ++srv->n;
+  att_put_u16(type, a->type);
+  a->tlen = 2;
+  memcpy(a->value, value, vlen);
+  a->vlen = vlen;
+
+  return a;
+}
+
+static void put_uuid(uint8_t *dst, uint16_t uuid, int wide)
+{
+  if (!wide) {
+    att_put_u16(uuid, dst);
+    return;
+  }
+
+  memcpy(dst, vendor_base, 16);
+  att_put_u16(uuid, &dst[12]);
+}
+
+static uint16_t service_add(struct bench_server *srv, uint16_t uuid, int wide)
+{
+  uint8_t value[16];
+
+  put_uuid(value, uuid, wide);
+  return attr_add(srv, GATT_PRIM_SVC_UUID, value, wide ? 16 : 2)->handle;
+}
+
+/* the service at start, ending just before the current one */
+static void include_add(struct bench_server *srv, uint16_t start)
+{
+  uint8_t value[4];
+
+  att_put_u16(start, &value[0]);
+  att_put_u16(srv->n - 1, &value[2]);
+  attr_add(srv, GATT_INCLUDE_UUID, value, sizeof(value));
+}
+
+/* declaration, value and, if it notifies or indicates, CCC */
+static void char_add(struct bench_server *srv, uint16_t uuid, int wide,
+                     uint8_t props)
+{
+  uint8_t decl[19];
+  struct attr *a;
+
+  decl[0] = props;
+  att_put_u16(srv->n + 2, &decl[1]);
+  put_uuid(&decl[3], uuid, wide);
+  attr_add(srv, GATT_CHARAC_UUID, decl, wide ? 19 : 5);
+
+  a = attr_add(srv, 0, decl, 0);
+  put_uuid(a->type, uuid, wide);
+  a->tlen = wide ? 16 : 2;
+  memset(a->value, 0x5a, 8);
+  a->vlen = 8;
+
+  if (props & (ATT_CHAR_PROPER_NOTIFY | ATT_CHAR_PROPER_INDICATE)) {
+    memset(decl, 0, 2);
+    attr_add(srv, GATT_CLIENT_CHARAC_CFG_UUID, decl, 2);
+  }
+}
+
+/* the attributes db_build() adds */
+static int db_size(int services, int chars)
+{
+  return 9 + services * (2 + 3 * chars);
+}
+
+static void db_build(struct bench_server *srv, int services, int chars)
+{
+  uint16_t prev = 0;
+  int s, c;
+
+  service_add(srv, 0x1801, 0);
+  char_add(srv, GATT_CHARAC_SERVICE_CHANGED, 0, ATT_CHAR_PROPER_INDICATE);
+
+  service_add(srv, 0x1800, 0);
+  char_add(srv, GATT_CHARAC_DEVICE_NAME, 0, ATT_CHAR_PROPER_READ);
+  char_add(srv, GATT_CHARAC_APPEARANCE, 0, ATT_CHAR_PROPER_READ);
+
+  for (s = 0; s < services; s++) {
+    uint16_t start = service_add(srv, 0x1000 + (s << 4), s & 1);
+
+    /* a 128-bit one, which takes a read to learn the UUID of */
+    if (prev != 0 && !(s & 1)) {
+      include_add(srv, prev);
+    }
+    prev = start;
+
+    for (c = 0; c < chars; c++) {
+      char_add(srv, 0x1001 + (s << 4) + c, s & 1,
+               ATT_CHAR_PROPER_READ | ATT_CHAR_PROPER_NOTIFY);
+    }
+  }
+}
+
+static int type_is(const struct attr *a, uint16_t type)
+{
+  return a->tlen == 2 && att_get_u16(a->type) == type;
+}
+
+/* the last handle of the service declared at index i */
+static uint16_t group_end(const struct bench_server *srv, int i)
+{
+  for (i++; i < srv->n; i++) {
+    if (type_is(&srv->attrs[i], GATT_PRIM_SVC_UUID)) {
+      return srv->attrs[i].handle - 1;
+    }
+  }
+
+  return 0xffff;
+}
+
+static uint16_t error_rsp(const uint8_t *req, uint16_t handle, uint8_t ecode,
+                          uint8_t *rsp)
+{
+  return enc_error_resp(req[0], handle, ecode, rsp, ATT_DEFAULT_LE_MTU);
+}
+
+/*
+ * READ_BY_GROUP, READ_BY_TYPE and FIND_INFO: every attribute of the range
+ * that matches, as long as it has the length of the first and fits.
+ */
+static uint16_t list_rsp(const struct bench_server *srv, const uint8_t *req,
+                         ssize_t len, uint8_t *rsp)
+{
+  uint16_t start, end, type = 0, rlen = 2, elen = 0;
+  const struct attr *a;
+  int i;
+
+  if (len < 5) {
+    return error_rsp(req, 0, ATT_ECODE_INVALID_PDU, rsp);
+  }
+
+  start = att_get_u16(&req[1]);
+  end = att_get_u16(&req[3]);
+
+  if (req[0] != ATT_OP_FIND_INFO_REQ) {
+    if (len != 7) {
+      return error_rsp(req, start, ATT_ECODE_UNSUPP_GRP_TYPE, rsp);
+    }
+    type = att_get_u16(&req[5]);
+  }
+
+  rsp[0] = req[0] + 1;
+
+  for (i = 0; i < srv->n; i++) {
+    uint8_t entry[24];
+    uint16_t n;
+
+    a = &srv->attrs[i];
+    if (a->handle < start || a->handle > end) {
+      continue;
+    }
+
+    att_put_u16(a->handle, entry);
+
+    if (req[0] == ATT_OP_FIND_INFO_REQ) {
+      memcpy(&entry[2], a->type, a->tlen);
+      n = 2 + a->tlen;
+    } else if (!type_is(a, type)) {
+      continue;
+    } else if (req[0] == ATT_OP_READ_BY_GROUP_REQ) {
+      att_put_u16(group_end(srv, i), &entry[2]);
+      memcpy(&entry[4], a->value, a->vlen);
+      n = 4 + a->vlen;
+    } else {
+      memcpy(&entry[2], a->value, a->vlen);
+      n = 2 + a->vlen;
+    }
+
+    if (elen == 0) {
+      elen = n;
+      rsp[1] = elen;
+      if (req[0] == ATT_OP_FIND_INFO_REQ) {
+        rsp[1] = a->tlen == 2 ? ATT_FIND_INFO_RESP_FMT_16BIT :
+                                ATT_FIND_INFO_RESP_FMT_128BIT;
+      }
+    }
+
+    if (n != elen || rlen + n > ATT_DEFAULT_LE_MTU) {
+      break;
+    }
+
+    memcpy(&rsp[rlen], entry, n);
+    rlen += n;
+  }
+
+  if (rlen == 2) {
+    return error_rsp(req, start, ATT_ECODE_ATTR_NOT_FOUND, rsp);
+  }
+
+  return rlen;
+}
+
+static struct attr *attr_find(struct bench_server *srv, uint16_t handle)
+{
+  if (handle == 0 || handle > srv->n) {
+    return NULL;
+  }
+
+  return &srv->attrs[handle - 1];
+}
+
+/* a CCC write; enabling notifications is answered with one */
+static void ccc_write(struct bench_server *srv, struct attr *a,
+                      const uint8_t *value, ssize_t vlen)
+{
+  uint8_t pdu[ATT_DEFAULT_LE_MTU];
+  struct attr *v;
+  uint16_t plen;
+
+  if (vlen != 2) {
+    return;
+  }
+
+  memcpy(a->value, value, 2);
+
+  v = attr_find(srv, a->handle - 1);
+  if (!(value[0] & GATT_CLIENT_CHARAC_CFG_NOTIF_BIT) || v == NULL) {
+    return;
+  }
+
+  plen = enc_notification(v->handle, v->value, v->vlen, pdu, sizeof(pdu));
+  if (send(srv->fd, pdu, plen, 0) < 0) {
+    perror("send");
+  }
+}
+
+static uint16_t read_blob_rsp(struct bench_server *srv, const uint8_t *req,
+                              ssize_t len, uint8_t *rsp)
+{
+  uint16_t handle, offset;
+  struct attr *a;
+
+  if (dec_read_blob_req(req, len, &handle, &offset) == 0) {
+    return error_rsp(req, 0, ATT_ECODE_INVALID_PDU, rsp);
+  }
+
+  a = attr_find(srv, handle);
+  if (a == NULL) {
+    return error_rsp(req, handle, ATT_ECODE_INVALID_HANDLE, rsp);
+  }
+
+  if (a->blob == NULL) {
+    return error_rsp(req, handle, ATT_ECODE_ATTR_NOT_LONG, rsp);
+  }
+
+  if (offset > a->blen) {
+    return error_rsp(req, handle, ATT_ECODE_INVALID_OFFSET, rsp);
+  }
+
+  return enc_read_blob_resp(a->blob, a->blen, offset, rsp,
+                            ATT_DEFAULT_LE_MTU);
+}
+
+/* queued and echoed; the queue only takes writes at its end */
+static uint16_t prep_write_rsp(struct bench_server *srv, const uint8_t *req,
+                               ssize_t len, uint8_t *rsp)
+{
+  uint8_t value[ATT_MAX_MTU];
+  uint16_t handle, offset;
+  size_t vlen;
+
+  if (dec_prep_write_req(req, len, &handle, &offset, value, &vlen) == 0) {
+    return error_rsp(req, 0, ATT_ECODE_INVALID_PDU, rsp);
+  }
+
+  if (attr_find(srv, handle) == NULL) {
+    return error_rsp(req, handle, ATT_ECODE_INVALID_HANDLE, rsp);
+  }
+
+  if (srv->prep_len > 0 && handle != srv->prep_handle) {
+    return error_rsp(req, handle, ATT_ECODE_PREP_QUEUE_FULL, rsp);
+  }
+
+  if (offset != srv->prep_len || offset + vlen > G_MAXUINT16) {
+    return error_rsp(req, handle, ATT_ECODE_INVALID_OFFSET, rsp);
+  }
+
+  if (srv->prep == NULL) {
+    srv->prep = malloc(G_MAXUINT16);
+    if (srv->prep == NULL) {
+      return error_rsp(req, handle, ATT_ECODE_INSUFF_RESOURCES, rsp);
+    }
+  }
+
+  memcpy(&srv->prep[offset], value, vlen);
+  srv->prep_handle = handle;
+  srv->prep_len += vlen;
+
+  return enc_prep_write_resp(handle, offset, value, vlen, rsp,
+                             ATT_DEFAULT_LE_MTU);
+}
+
+/* writing makes the prepared value the long value of its attribute */
+static uint16_t exec_write_rsp(struct bench_server *srv, const uint8_t *req,
+                               ssize_t len, uint8_t *rsp)
+{
+  struct attr *a;
+  uint8_t flags;
+
+  if (dec_exec_write_req(req, len, &flags) == 0) {
+    return error_rsp(req, 0, ATT_ECODE_INVALID_PDU, rsp);
+  }
+
+  a = attr_find(srv, srv->prep_handle);
+  if (flags == ATT_WRITE_ALL_PREP_WRITES && a != NULL && srv->prep_len > 0) {
+    free(a->blob);
+    a->blob = srv->prep;
+    a->blen = srv->prep_len;
+    srv->prep = NULL;
+  }
+
+  srv->prep_len = 0;
+
+  return enc_exec_write_resp(rsp);
+}
+
+/* the values of all handles back to back, as many octets as fit */
+static uint16_t read_multi_rsp(struct bench_server *srv, const uint8_t *req,
+                               ssize_t len, uint8_t *rsp)
+{
+  uint8_t values[ATT_MAX_MTU];
+  uint16_t handles[ATT_MAX_MTU / 2];
+  uint16_t i, n, vlen = 0;
+  struct attr *a;
+
+  n = dec_read_multi_req(req, len, handles, G_N_ELEMENTS(handles));
+  if (n == 0) {
+    return error_rsp(req, 0, ATT_ECODE_INVALID_PDU, rsp);
+  }
+
+  for (i = 0; i < n; i++) {
+    a = attr_find(srv, handles[i]);
+    if (a == NULL) {
+      return error_rsp(req, handles[i], ATT_ECODE_INVALID_HANDLE, rsp);
+    }
+
+    if (vlen + a->vlen <= sizeof(values)) {
+      memcpy(&values[vlen], a->value, a->vlen);
+      vlen += a->vlen;
+    }
+  }
+
+  return enc_read_multi_resp(values, vlen, rsp, ATT_DEFAULT_LE_MTU);
+}
+
+static uint16_t serve(struct bench_server *srv, const uint8_t *req,
+                      ssize_t len, uint8_t *rsp)
+{
+  struct attr *a;
+
+  switch (req[0]) {
+  case ATT_OP_READ_BY_GROUP_REQ:
+  case ATT_OP_READ_BY_TYPE_REQ:
+  case ATT_OP_FIND_INFO_REQ:
+    return list_rsp(srv, req, len, rsp);
+  case ATT_OP_READ_REQ:
+    a = len == 3 ? attr_find(srv, att_get_u16(&req[1])) : NULL;
+    if (a == NULL) {
+      return error_rsp(req, 0, ATT_ECODE_INVALID_HANDLE, rsp);
+    }
+    if (a->blob) {
+      return enc_read_resp(a->blob, a->blen, rsp, ATT_DEFAULT_LE_MTU);
+    }
+    return enc_read_resp(a->value, a->vlen, rsp, ATT_DEFAULT_LE_MTU);
+  case ATT_OP_READ_BLOB_REQ:
+    return read_blob_rsp(srv, req, len, rsp);
+  case ATT_OP_PREP_WRITE_REQ:
+    return prep_write_rsp(srv, req, len, rsp);
+  case ATT_OP_EXEC_WRITE_REQ:
+    return exec_write_rsp(srv, req, len, rsp);
+  case ATT_OP_READ_MULTI_REQ:
+    return read_multi_rsp(srv, req, len, rsp);
+  case ATT_OP_WRITE_CMD:
+  case ATT_OP_WRITE_REQ:
+    a = len >= 3 ? attr_find(srv, att_get_u16(&req[1])) : NULL;
+    if (a && type_is(a, GATT_CLIENT_CHARAC_CFG_UUID)) {
+      ccc_write(srv, a, &req[3], len - 3);
+    }
+    if (req[0] == ATT_OP_WRITE_CMD) {
+      return 0;
+    }
+    if (a == NULL) {
+      return error_rsp(req, 0, ATT_ECODE_INVALID_HANDLE, rsp);
+    }
+    rsp[0] = ATT_OP_WRITE_RESP;
+    return 1;
+  case ATT_OP_HANDLE_CNF:
+    return 0;
+  default:
+    return error_rsp(req, 0, ATT_ECODE_REQ_NOT_SUPP, rsp);
+  }
+}
+
+static void *server_thread(void *data)
+{
+  struct bench_server *srv = data;
+  uint8_t buf[ATT_MAX_MTU];
+  uint8_t rsp[ATT_DEFAULT_LE_MTU];
+  uint16_t rlen;
+  ssize_t len;
+
+  while ((len = recv(srv->fd, buf, sizeof(buf), 0)) > 0) {
+    rlen = serve(srv, buf, len, rsp);
+    if (rlen == 0) {
+      continue;
+    }
+
+    if (srv->service_us > 0) {
+      usleep(srv->service_us);
+    }
+
+    if (send(srv->fd, rsp, rlen, 0) < 0) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+struct bench_server *bench_server_start(int fd, unsigned int service_us,
+                                        int services, int chars)
+{
+  struct bench_server *srv;
+  int size = db_size(services, chars);
+
+  if (services < 0 || chars < 0 || size > 0xffff) {
+    return NULL;
+  }
+
+  srv = calloc(1, sizeof(*srv));
+  if (srv == NULL) {
+    return NULL;
+  }
+
+  srv->attrs = calloc(size, sizeof(struct attr));
+  if (srv->attrs == NULL) {
+    free(srv);
+    return NULL;
+  }
+
+  srv->fd = fd;
+  srv->service_us = service_us;
+  db_build(srv, services, chars);
+
+  if (pthread_create(&srv->thread, NULL, server_thread, srv) != 0) {
+    free(srv->attrs);
+    free(srv);
+    return NULL;
+  }
+
+  return srv;
+}
+
+uint16_t bench_server_attrs(const struct bench_server *srv)
+{
+  return srv->n;
+}
+
+void bench_server_stop(struct bench_server *srv)
+{
+  int i;
+
+  shutdown(srv->fd, SHUT_RDWR);
+  pthread_join(srv->thread, NULL);
+
+  for (i = 0; i < srv->n; i++) {
+    free(srv->attrs[i].blob);
+  }
+
+  free(srv->prep);
+  free(srv->attrs);
+  free(srv);
+}
+
+int bench_server_long_value(struct bench_server *srv, uint16_t handle,
+                            uint16_t len)
+{
+  struct attr *a = attr_find(srv, handle);
+  uint16_t i;
+
+  if (a == NULL || a->blob != NULL) {
+    return -1;
+  }
+
+  a->blob = malloc(len);
+  if (a->blob == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < len; i++) {
+    a->blob[i] = i;
+  }
+  a->blen = len;
+
+  return 0;
+}
+
+int bench_server_indicate_changed(struct bench_server *srv)
+{
+  uint8_t value[4], pdu[ATT_DEFAULT_LE_MTU];
+  uint16_t plen;
+
+  att_put_u16(0x0001, &value[0]);
+  att_put_u16(0xffff, &value[2]);
+
+  /* the Service Changed value follows the GATT service and its declaration */
+  plen = enc_indication(3, value, sizeof(value), pdu, sizeof(pdu));
+
+  return send(srv->fd, pdu, plen, 0) < 0 ? -1 : 0;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Write commands submitted from several producer threads while the
+ * GAttrib runs on its own epoll loop, the way application threads push
+ * mode changes and LED patterns. Two ways of getting the PDUs onto the IO
+ * thread are compared:
+ *
+ *   mutex  producers append to a locked queue and kick an eventfd, the IO
+ *          thread drains it into g_attrib_send(), as done by hand so far
+ *   submit g_attrib_submit()
+ *
+ * A reader thread plays the ring and stops the clock once every PDU has
+ * arrived on the other end of the socketpair.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+
+#include "att_bench.h"
+
+#define NCONTROL_HANDLE 0x0029
+#define MAX_PRODUCERS   8
+
+enum {
+  MODE_MUTEX,
+  MODE_SUBMIT,
+};
+
+static const char *mode_names[] = {"mutex", "submit"};
+
+struct submit_run {
+  struct bench_peer peer;
+  struct io_loop *loop;
+  int mode;
+  int per_producer;
+  int total;
+  volatile int go;
+
+  /* MODE_MUTEX */
+  GMutex lock;
+  GQueue pending;
+  int event_fd;
+};
+
+struct producer {
+  struct submit_run *run;
+  int index;
+  pthread_t thread;
+};
+
+static gboolean drain_pending(int fd, GIOCondition cond, gpointer user_data)
+{
+  struct submit_run *run = user_data;
+  GQueue batch;
+  uint8_t *pdu;
+  uint64_t val;
+
+  if (read(fd, &val, sizeof(val)) < 0) {
+    return TRUE;
+  }
+
+  g_mutex_lock(&run->lock);
+  batch = run->pending;
+  g_queue_init(&run->pending);
+  g_mutex_unlock(&run->lock);
+
+  while ((pdu = g_queue_pop_head(&batch))) {
+    g_attrib_send(run->peer.attrib, 0, pdu, 5, NULL, NULL, NULL);
+    g_free(pdu);
+  }
+
+  return TRUE;
+}
+
+static void *producer_thread(void *data)
+{
+  struct producer *p = data;
+  struct submit_run *run = p->run;
+  uint8_t pdu[5];
+  uint64_t val = 1;
+  int i;
+
+  pdu[0] = ATT_OP_WRITE_CMD;
+  att_put_u16(NCONTROL_HANDLE, &pdu[1]);
+  pdu[3] = p->index;
+
+  while (!run->go) {
+    sched_yield();
+  }
+
+  for (i = 0; i < run->per_producer; i++) {
+    pdu[4] = i;
+
+    if (run->mode == MODE_SUBMIT) {
+      g_attrib_submit(run->peer.attrib, pdu, sizeof(pdu), NULL, NULL, NULL);
+      continue;
+    }
+
+    g_mutex_lock(&run->lock);
+    g_queue_push_tail(&run->pending, g_memdup(pdu, sizeof(pdu)));
+    g_mutex_unlock(&run->lock);
+
+    if (write(run->event_fd, &val, sizeof(val)) < 0) {
+      perror("eventfd");
+    }
+  }
+
+  return NULL;
+}
+
+/* plays the ring, quits the loop once everything arrived */
+static void *reader_thread(void *data)
+{
+  struct submit_run *run = data;
+  uint8_t buf[ATT_MAX_MTU];
+  int seen = 0;
+
+  while (seen < run->total && recv(run->peer.fd, buf, sizeof(buf), 0) > 0) {
+    seen++;
+  }
+
+  io_loop_quit(run->loop);
+
+  return NULL;
+}
+
+static int run_one(int mode, int producers, int per_producer)
+{
+  struct submit_run run;
+  struct producer prod[MAX_PRODUCERS];
+  pthread_t reader;
+  GAttribStats stats;
+  uint64_t start, elapsed;
+  guint watch = 0;
+  char param[32];
+  int i;
+
+  memset(&run, 0, sizeof(run));
+  run.mode = mode;
+  run.per_producer = per_producer;
+  run.total = producers * per_producer;
+  run.event_fd = -1;
+  g_mutex_init(&run.lock);
+  g_queue_init(&run.pending);
+
+  run.loop = io_loop_epoll_new();
+  if (run.loop == NULL) {
+    return -1;
+  }
+
+  if (bench_peer_open_with_loop(&run.peer, ATT_DEFAULT_LE_MTU,
+                                run.loop) < 0) {
+    io_loop_free(run.loop);
+    return -1;
+  }
+
+  if (mode == MODE_MUTEX) {
+    run.event_fd = eventfd(0, EFD_NONBLOCK);
+    watch = io_loop_add_watch(run.loop, run.event_fd, G_IO_IN,
+                              drain_pending, &run, NULL);
+  }
+
+  pthread_create(&reader, NULL, reader_thread, &run);
+  for (i = 0; i < producers; i++) {
+    prod[i].run = &run;
+    prod[i].index = i;
+    pthread_create(&prod[i].thread, NULL, producer_thread, &prod[i]);
+  }
+
+  start = bench_now_ns();
+  run.go = 1;
+
+  io_loop_run(run.loop);
+
+  elapsed = bench_now_ns() - start;
+
+  for (i = 0; i < producers; i++) {
+    pthread_join(prod[i].thread, NULL);
+  }
+  pthread_join(reader, NULL);
+
+  snprintf(param, sizeof(param), "%s producers=%d", mode_names[mode],
+           producers);
+  bench_report("submit", param, run.total, elapsed);
+
+  if (mode == MODE_SUBMIT) {
+    g_attrib_get_stats(run.peer.attrib, &stats);
+    printf("%-12s %-24s %10.1f cmds/wakeup\n", "", "",
+           stats.submit_batches ?
+           (double)stats.submits / stats.submit_batches : 0.0);
+  }
+
+  if (watch) {
+    io_loop_remove(run.loop, watch);
+    close(run.event_fd);
+  }
+
+  bench_peer_close(&run.peer);
+  io_loop_free(run.loop);
+  g_mutex_clear(&run.lock);
+
+  return 0;
+}
+
+int bench_submit(int argc, char **argv)
+{
+  static const int producers[] = {1, 2, 4, 8};
+  int cmds = argc > 0 ? atoi(argv[0]) : 100000;
+  int mode;
+  unsigned int p;
+
+  if (cmds < MAX_PRODUCERS) {
+    cmds = MAX_PRODUCERS;
+  }
+
+  for (p = 0; p < G_N_ELEMENTS(producers); p++) {
+    for (mode = MODE_MUTEX; mode <= MODE_SUBMIT; mode++) {
+      if (run_one(mode, producers[p], cmds / producers[p]) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * Write-without-response throughput: bursts of gatt_write_cmd() are
+ * flushed to a socketpair peer that drains as fast as it can.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+#define LED_HANDLE  0x0062
+
+static int sent;
+
+static void write_done(gpointer user_data)
+{
+  sent++;
+}
+
+static int run_one(int burst, int cmds)
+{
+  struct bench_peer peer;
+  GAttribStats stats;
+  uint8_t value[ATT_DEFAULT_LE_MTU - 3];
+  uint64_t start, elapsed;
+  char param[32];
+  int i, j, received = 0;
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  memset(value, 0xa5, sizeof(value));
+  sent = 0;
+
+  start = bench_now_ns();
+  for (i = 0; i < cmds; i += burst) {
+    for (j = 0; j < burst; j++) {
+      gatt_write_cmd(peer.attrib, LED_HANDLE, value, sizeof(value),
+                     write_done, NULL);
+    }
+    while (received < i + burst) {
+      g_main_context_iteration(NULL, FALSE);
+      received += bench_peer_drain(&peer);
+    }
+  }
+  elapsed = bench_now_ns() - start;
+
+  snprintf(param, sizeof(param), "burst=%d", burst);
+  bench_report("tx", param, received, elapsed);
+
+  g_attrib_get_stats(peer.attrib, &stats);
+  printf("%-12s %-24s %10.0f pdus/s %6.1f pdus/wakeup, %llu writes\n", "", "",
+         received * 1e9 / elapsed,
+         stats.tx_wakeups ? (double)stats.tx_pdus / stats.tx_wakeups : 0.0,
+         (unsigned long long)stats.tx_writes);
+
+  bench_peer_close(&peer);
+
+  return 0;
+}
+
+int bench_tx(int argc, char **argv)
+{
+  static const int bursts[] = {1, 8, 32, 128};
+  int cmds = argc > 0 ? atoi(argv[0]) : 64000;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(bursts) / sizeof(bursts[0]); i++) {
+    if (run_one(bursts[i], cmds - cmds % bursts[i]) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
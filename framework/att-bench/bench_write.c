@@ -0,0 +1,205 @@
+/*
+ * Copyright 2014-15, Nod Labs
+ *
+ * OTA-sized long writes to the emulated ring of bench_server.c, answering
+ * without delay. Every write is read back and compared once. Reported is
+ * the throughput of gatt_write_long_char() with
+ *
+ *   window=1  one Prepare Write queued at a time, as gatt_write_char() did
+ *   window=N  N of them queued
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <bluez/bluetooth/bluetooth.h>
+#include <bluez/bluetooth/uuid.h>
+#include <bluez/gatt/gattrib.h>
+#include <bluez/gatt/att.h>
+#include <bluez/gatt/gatt.h>
+
+#include "att_bench.h"
+
+struct write_run {
+  uint16_t handle;
+  const uint8_t *value;
+  size_t vlen;
+  size_t written;   /* as progress last reported it */
+  uint8_t status;
+  int done;
+};
+
+static void db_cb(struct gatt_db *db, guint8 status, gpointer user_data)
+{
+  struct write_run *run = user_data;
+
+  run->status = status;
+  run->done = 1;
+
+  if (db == NULL) {
+    return;
+  }
+
+  if (db->n_chars > 0) {
+    run->handle = db->chars[db->n_chars - 1].value_handle;
+  }
+
+  gatt_db_free(db);
+}
+
+static void progress_cb(size_t written, size_t total, gpointer user_data)
+{
+  struct write_run *run = user_data;
+
+  run->written = written;
+}
+
+static void write_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                     gpointer user_data)
+{
+  struct write_run *run = user_data;
+
+  if (status == 0 && dec_exec_write_resp(pdu, plen) == 0) {
+    status = ATT_ECODE_INVALID_PDU;
+  }
+
+  run->status = status;
+  run->done = 1;
+}
+
+static void read_cb(guint8 status, const guint8 *pdu, guint16 plen,
+                    gpointer user_data)
+{
+  struct write_run *run = user_data;
+
+  if (status == 0 && (plen != run->vlen + 1 ||
+                      memcmp(pdu + 1, run->value, run->vlen) != 0)) {
+    status = ATT_ECODE_INVALID_PDU;
+  }
+
+  run->status = status;
+  run->done = 1;
+}
+
+static int write_once(GAttrib *attrib, struct write_run *run, guint window)
+{
+  run->done = 0;
+  run->written = 0;
+
+  if (gatt_write_long_char(attrib, run->handle, run->value, run->vlen,
+                           window, progress_cb, write_cb, run) == NULL) {
+    return -1;
+  }
+
+  bench_run_until(&run->done);
+
+  if (run->status != 0 || run->written != run->vlen) {
+    printf("write failed: %s, %zu of %zu octets\n",
+           att_ecode2str(run->status), run->written, run->vlen);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int run_one(const uint8_t *value, size_t vlen, guint window,
+                   int rounds)
+{
+  struct bench_peer peer;
+  struct bench_server *srv;
+  struct write_run run;
+  uint64_t start, elapsed = 0;
+  char param[32];
+  int i, ret = -1;
+
+  if (bench_peer_open(&peer, ATT_DEFAULT_LE_MTU) < 0) {
+    return -1;
+  }
+
+  srv = bench_server_start(peer.fd, 0, 1, 1);
+  if (srv == NULL) {
+    bench_peer_close(&peer);
+    return -1;
+  }
+
+  memset(&run, 0, sizeof(run));
+  if (gatt_discover_all(peer.attrib, db_cb, &run) == NULL) {
+    goto done;
+  }
+  bench_run_until(&run.done);
+
+  if (run.status != 0 || run.handle == 0) {
+    printf("no value to write\n");
+    goto done;
+  }
+
+  run.value = value;
+  run.vlen = vlen;
+
+  for (i = 0; i < rounds; i++) {
+    start = bench_now_ns();
+
+    if (write_once(peer.attrib, &run, window) < 0) {
+      goto done;
+    }
+
+    elapsed += bench_now_ns() - start;
+  }
+
+  /* what the peer executed has to be what was written */
+  run.done = 0;
+  gatt_read_long_char(peer.attrib, run.handle, vlen, read_cb, &run);
+  bench_run_until(&run.done);
+
+  if (run.status != 0) {
+    printf("read back failed: %s\n", att_ecode2str(run.status));
+    goto done;
+  }
+
+  snprintf(param, sizeof(param), "window=%u len=%zu", window, vlen);
+  bench_report("write", param, rounds, elapsed);
+  printf("%-12s %-24s %.1f KiB/s\n", "", "",
+         (double)vlen * rounds / 1024 / ((double)elapsed / 1000000000));
+  ret = 0;
+
+done:
+  bench_server_stop(srv);
+  bench_peer_close(&peer);
+
+  return ret;
+}
+
+int bench_write(int argc, char **argv)
+{
+  static const size_t lens[] = {4096, 16384, 61440};
+  static const guint windows[] = {1, GATT_WRITE_WINDOW, 16};
+  int rounds = argc > 0 ? atoi(argv[0]) : 10;
+  uint8_t *value;
+  unsigned int l, w;
+  size_t i;
+  int ret = 0;
+
+  if (rounds <= 0) {
+    rounds = 1;
+  }
+
+  value = malloc(lens[G_N_ELEMENTS(lens) - 1]);
+  if (value == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < lens[G_N_ELEMENTS(lens) - 1]; i++) {
+    value[i] = rand();
+  }
+
+  for (l = 0; l < G_N_ELEMENTS(lens) && ret == 0; l++) {
+    for (w = 0; w < G_N_ELEMENTS(windows) && ret == 0; w++) {
+      ret = run_one(value, lens[l], windows[w], rounds);
+    }
+  }
+
+  free(value);
+
+  return ret;
+}
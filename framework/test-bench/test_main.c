@@ -31,6 +31,8 @@
 #include <bluez/bluetooth/btio.h>
 #include <bluez/bluetooth/hci.h>
 #include <bluez/bluetooth/hci_lib.h>
+#include <bluez/bluetooth/attjournal.h>
+#include <bluez/bluetooth/gattcache.h>
 #include <bluez/gatt/gattrib.h>
 #include <bluez/gatt/att.h>
 #include <bluez/gatt/gatt.h>
@@ -47,6 +49,8 @@
 
 /* The handle which is used to control ring modes */
 #define NCONTROL_HDL      "0x0062"
+/* The handle LED patterns are written to */
+#define LIGHTS_HDL        "0x0070"
 
 #define ENABLE_NOTIFICATION   "01 00"
 #define DISABLE_NOTIFICATION  "00 00"
@@ -101,6 +105,21 @@ static uint16_t mtu;
 static GIOChannel *iochannel = NULL;
 static GMainLoop *event_loop;
 
+/* with -j, CCC, mode and LED pattern writes are journaled and restored on reconnect */
+static struct att_journal *journal = NULL;
+static char peer_addr[18];
+static int reconnecting;
+/* the replay waits for the link to be encrypted again, polled */
+#define SEC_POLL_MS   100
+#define SEC_POLL_MAX  50
+static guint replay_timer;
+static int replay_polls;
+
+/* the attribute database of the ring, discovered once and kept, see -r */
+static struct gatt_cache *db_cache = NULL;
+static int db_rediscover;
+static int db_waiting;
+
 /*
  * In the project fw, please refer to auto-generated file
  * build/erv8/fw/bcm20732/nod_db_defines.h for information on the
@@ -135,6 +154,7 @@ static int os_indexes[]      = {2, 4};
 static int non_os_indexes[]  = {8, 11};
 
 static void change_mode(gpointer data, int mode);
+static int connect_io(const char *dst, gpointer user_data);
 static int cmd_set_sec_level(char *level);
 static void control_service(const int *notify_array, const int size, const char *type);
 
@@ -247,6 +267,11 @@ void disconnect_io()
     return;
   }
 
+  if (replay_timer) {
+    g_source_remove(replay_timer);
+    replay_timer = 0;
+  }
+
   g_attrib_unref(attrib);
   attrib = NULL;
   mtu = 0;
@@ -261,9 +286,21 @@ void disconnect_io()
 static gboolean channel_hangup_watcher(GIOChannel *chan, GIOCondition cond,
                                 gpointer user_data)
 {
+  int active = (get_state() == STATE_CONNACTIVE) ||
+               (get_state() == STATE_DATARCVD);
+
   set_error(ERR_DISCONNECTED, "Disconnected\n", user_data);
   disconnect_io();
 
+  /* link loss while streaming, get the ring back in the state it was in */
+  if (journal && active) {
+    printf("Reconnecting to [%s]\n", peer_addr);
+    reconnecting = 1;
+    if (connect_io(peer_addr, user_data) < 0) {
+      reconnecting = 0;
+    }
+  }
+
   return 0;
 }
 
@@ -465,6 +502,125 @@ static int discover_services(gpointer data)
     return 0;
 }
 
+static void db_ready(guint8 status, gpointer user_data)
+{
+  if (status != 0) {
+    printf("Attribute database discovery failed: %s\n", att_ecode2str(status));
+  } else if (!db_waiting) {
+    printf("Attribute database discovered again\n");
+  }
+
+  if (db_waiting) {
+    db_waiting = 0;
+    g_main_loop_quit(event_loop);
+  }
+}
+
+/* hands the ring's database to the cache, discovery only runs on a miss;
+ * with wait, db_ready() quits the loop discover_database() runs for it
+ */
+static int attach_db_cache(gpointer data, int wait)
+{
+  GAttrib *attrib = data;
+  gchar *dir;
+  bdaddr_t dba;
+
+  gatt_cache_close(db_cache);
+
+  str2ba(peer_addr, &dba);
+  dir = g_build_filename(g_get_user_cache_dir(), "nod", "gatt", NULL);
+  db_cache = gatt_cache_open(dir, &dba);
+  g_free(dir);
+
+  if (db_cache == NULL) {
+    return -1;
+  }
+
+  if (db_rediscover) {
+    gatt_cache_invalidate(db_cache);
+    db_rediscover = 0;
+  }
+
+  db_waiting = wait && !gatt_cache_valid(db_cache);
+  if (!gatt_cache_attach(db_cache, attrib, db_ready, NULL)) {
+    db_waiting = 0;
+    return -2;
+  }
+
+  return 0;
+}
+
+static int discover_database(gpointer data)
+{
+  const struct gatt_primary *prim;
+  const struct gatt_char *chars;
+  guint i, n;
+
+  if (get_state() != STATE_CONNECTED) {
+    printf("device is already disconnected\n");
+    return -1;
+  }
+
+  if (attach_db_cache(data, 1) < 0) {
+    /* no cache directory, fall back to plain discovery */
+    printf("SERVICES:\n");
+    discover_services(data);
+    printf("\nCHARACTERISTICS:\n");
+    return discover_characteristics(data, CHAR_START, CHAR_END);
+  }
+
+  if (db_waiting) {
+    g_main_loop_run(event_loop);
+  } else {
+    printf("Using the cached attribute database\n");
+  }
+
+  printf("SERVICES:\n");
+  prim = gatt_cache_services(db_cache, &n);
+  for (i = 0; i < n; i++) {
+    printf("start handle: 0x%04x end handle: 0x%04x uuid: %s\n",
+                    prim[i].range.start, prim[i].range.end, prim[i].uuid);
+  }
+
+  printf("\nCHARACTERISTICS:\n");
+  chars = gatt_cache_chars(db_cache, &n);
+  for (i = 0; i < n; i++) {
+    printf("handle = 0x%04x, properties = 0x%02x, value handle = 0x%04x, uuid = %s\n",
+                    chars[i].handle, chars[i].properties, chars[i].value_handle, chars[i].uuid);
+  }
+
+  return 0;
+}
+
+static void journal_replayed(guint8 status, gpointer user_data)
+{
+  if (status != 0) {
+    printf("Restoring journaled writes failed: %s\n", att_ecode2str(status));
+  } else {
+    printf("Journaled writes restored\n");
+  }
+}
+
+static gboolean replay_when_secure(gpointer user_data)
+{
+  BtIOSecLevel sec = BT_IO_SEC_LOW;
+
+  bt_io_get(iochannel, NULL, BT_IO_OPT_SEC_LEVEL, &sec, BT_IO_OPT_INVALID);
+  if (sec < BT_IO_SEC_HIGH) {
+    if (++replay_polls < SEC_POLL_MAX) {
+      return TRUE;
+    }
+    printf("Link not encrypted, journaled writes not restored\n");
+    replay_timer = 0;
+    return FALSE;
+  }
+
+  printf("Restoring %u journaled writes\n", att_journal_length(journal));
+  att_journal_replay(journal, attrib, journal_replayed, NULL);
+  replay_timer = 0;
+  return FALSE;
+}
+
 static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 {
   if (err) {
@@ -478,10 +634,31 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
     g_attrib_register(attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES, events_handler, attrib, NULL);
     set_state(STATE_CONNECTED);
   }
+
+  if (reconnecting) {
+    reconnecting = 0;
+    if (!err) {
+      /* HID reports need the link encrypted again, see main(), and the
+       * journal holds their CCCs, so it is replayed once it is
+       */
+      if (cmd_set_sec_level("high") == 0) {
+        replay_polls = 0;
+        replay_timer = g_timeout_add(SEC_POLL_MS, replay_when_secure, NULL);
+      } else {
+        printf("Journaled writes not restored\n");
+      }
+      /* the database is still cached, only Service Changed is watched */
+      attach_db_cache(attrib, 0);
+      set_state(STATE_CONNACTIVE);
+    }
+    /* the main loop keeps running for the data */
+    return;
+  }
+
   g_main_loop_quit(event_loop);
 }
 
-static int cmd_connect(const char *dst, gpointer user_data)
+static int connect_io(const char *dst, gpointer user_data)
 {
   bdaddr_t sba, dba;
   uint8_t dest_type;
@@ -518,11 +695,25 @@ static int cmd_connect(const char *dst, gpointer user_data)
     printf("Error: %d  %s\n", gerr->code, gerr->message);
     g_error_free(gerr);
     return -2;
-  } else {
-    g_io_add_watch(iochannel, G_IO_HUP, channel_hangup_watcher, user_data);
-    g_main_loop_run(event_loop);
   }
 
+  g_io_add_watch(iochannel, G_IO_HUP, channel_hangup_watcher, user_data);
+
+  return 0;
+}
+
+static int cmd_connect(const char *dst, gpointer user_data)
+{
+  int ret;
+
+  ret = connect_io(dst, user_data);
+  if (ret < 0) {
+    return ret;
+  }
+
+  strncpy(peer_addr, dst, sizeof(peer_addr) - 1);
+  g_main_loop_run(event_loop);
+
   return 0;
 }
 
@@ -539,6 +730,26 @@ static int strtohandle(const char *src)
   return dst;
 }
 
+/* only writes that are state, and so safe to repeat, are journaled:
+ * CCCs, the mode and the LED pattern
+ */
+static int journaled_handle(int hdl)
+{
+  int i;
+
+  if (hdl == strtohandle(NCONTROL_HDL) || hdl == strtohandle(LIGHTS_HDL)) {
+    return 1;
+  }
+
+  for (i = 0; i < GET_SZ(ccc_hdl_no); i++) {
+    if (hdl == strtohandle(ccc_hdl_no[i])) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 static int cmd_char_write(gpointer user_data, const char *handle, const char* data, int type)
 {
   GAttrib *attrib = user_data;
@@ -566,6 +777,10 @@ static int cmd_char_write(gpointer user_data, const char *handle, const char* da
     return -3;
   }
 
+  if (journal && journaled_handle(hdl)) {
+    att_journal_record(journal, hdl, 0, value, len, type == WRITE_REQUEST);
+  }
+
   if (type == WRITE_REQUEST) {
     ret = gatt_write_char(attrib, hdl, value, len, NULL, NULL);
   } else if (type == WRITE_COMMAND) {
@@ -693,18 +908,53 @@ static int cmd_set_sec_level(char *level)
   return 0;
 }
 
+/* all CCC writes go out as one g_attrib_send_batch() burst */
 static void control_service(const int notify_array[], const int size, const char *type)
 {
-  int i, ret;
+  struct att_write writes[size];
+  uint8_t *value;
+  size_t len;
+  int i, hdl, n = 0;
+
+  if ((get_state() != STATE_DATARCVD) && (get_state() != STATE_CONNECTED)) {
+    printf("Device is not connected\n");
+    return;
+  }
+
+  len = gatt_attr_data_from_string(type, &value);
+  if (len == 0) {
+    printf("Invalid value(s) passed\n");
+    return;
+  }
 
   for (i = 0; i < size; i++) {
-    if (ret = cmd_change_notify((gpointer)attrib, ccc_hdl_no[notify_array[i]], type) < 0) {
+    hdl = strtohandle(ccc_hdl_no[notify_array[i]]);
+    if (hdl <= 0) {
       printf("Failed to set notification for handle %s\n", ccc_hdl_no[notify_array[i]]);
       break;
-    } else {
-      printf("notification handle: %s, value: %s\n", ccc_hdl_no[notify_array[i]], type);
     }
+
+    if (journal) {
+      att_journal_record(journal, hdl, 0, value, len, FALSE);
+    }
+
+    writes[n].handle = hdl;
+    writes[n].value = value;
+    writes[n].vlen = len;
+    n++;
+  }
+
+  if (n > 0 && g_attrib_send_batch(attrib, writes, n, NULL, NULL) == 0) {
+    printf("Failed to queue %d notification writes\n", n);
+    n = 0;
+  }
+
+  for (i = 0; i < n; i++) {
+    printf("notification handle: %s, value: %s\n", ccc_hdl_no[notify_array[i]], type);
   }
+
+  /* the batch holds its own copy of the PDUs */
+  g_free(value);
   return;
 }
 
@@ -738,7 +988,23 @@ int main(int argc, char **argv)
 {
   char addr[18];
   char *handle, *value;
-  int ret, choice;
+  int ret, choice, opt;
+
+  while ((opt = getopt(argc, argv, "jr")) != -1) {
+    switch (opt) {
+      case 'j':
+        journal = att_journal_new();
+        break;
+      case 'r':
+        db_rediscover = 1;
+        break;
+      default:
+        printf("Usage: %s [-j] [-r]\n", argv[0]);
+        printf("  -j  restore notifications and mode after a link loss\n");
+        printf("  -r  discover the attribute database, even if cached\n");
+        exit(-1);
+    }
+  }
 
   printf("*********************************\n");
   printf("**** Nod Labs test framework ****\n");
@@ -766,11 +1032,7 @@ int main(int argc, char **argv)
     printf("Connected to [%s]\n", addr);
   }
 
-  printf("SERVICES:\n");
-  discover_services((gpointer)attrib);
-
-  printf("\nCHARACTERISTICS:\n");
-  discover_characteristics((gpointer)attrib, CHAR_START, CHAR_END);
+  discover_database((gpointer)attrib);
 
   /* IMP: If the native bluez stack is running while this test runs, then the
    * keys get cached in the system(on which this is running). Next time, when this
@@ -828,6 +1090,9 @@ int main(int argc, char **argv)
 
   cmd_disconnect();
 
+  att_journal_free(journal);
+  gatt_cache_close(db_cache);
+
   /* un-initialize glib event loop */
   g_main_loop_unref(event_loop);
 